@@ -0,0 +1,233 @@
+/*==============================================================================
+  End-to-end benchmark driver.
+
+  bench run <name> <runs> <brocopy> [args...]
+      Runs "<brocopy> --metrics <tmp> [args...]" <runs> times and prints one JSON
+      object: jobs/sec, MB/s (bytes actually written, from the metrics export),
+      p50/p99 of the job wall time and of the per destination latency.
+
+  bench compare <baseline.json> <results.json> [max_regression_pct]
+      Matches scenarios by name and prints the change of every figure. Exits 1
+      if any of them got worse by more than max_regression_pct (default 10).
+  ==============================================================================*/
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SAMPLES (1 << 20)
+
+#define FIGURE_COUNT 6
+
+// Figures compared by `bench compare`, and whether bigger is better
+static struct { char *key; int higher_is_better; } figures[FIGURE_COUNT] =
+{
+  { "jobs_per_sec", 1 },
+  { "mb_per_sec", 1 },
+  { "job_p50_ms", 0 },
+  { "job_p99_ms", 0 },
+  { "dest_p50_ms", 0 },
+  { "dest_p99_ms", 0 },
+};
+
+typedef struct Result Result;
+struct Result
+{
+  char name[64];
+  double values[FIGURE_COUNT]; // In `figures` order
+};
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted `samples`, in ms
+static double
+percentile_ms(uint64_t *samples, uint64_t count, uint64_t pct)
+{
+  if (count == 0) { return 0.0; }
+  uint64_t rank = (count*pct + 99) / 100;
+  return (double)samples[(rank > 0 ? rank : 1) - 1] / 1000.0;
+}
+
+static char *
+read_file(char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f) { return NULL; }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *buf = (char*)malloc((size_t)size + 1);
+  if (buf && fread(buf, 1, (size_t)size, f) != (size_t)size) { size = 0; }
+  if (buf) { buf[size] = 0; }
+  fclose(f);
+  return buf;
+}
+
+// Value of the first `"key": <number>` at or after `from`
+static double
+json_number(char *from, char *key)
+{
+  char pattern[64];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  char *at = strstr(from, pattern);
+  return at ? strtod(at + strlen(pattern), NULL) : -1.0;
+}
+
+static int
+bench_run(char *name, int runs, int argc, char **argv)
+{
+  static uint64_t job_us[MAX_SAMPLES];
+  static uint64_t dest_us[MAX_SAMPLES];
+  uint64_t dest_count = 0;
+  uint64_t bytes = 0;
+  uint64_t failed = 0;
+  uint64_t ok = 0;
+
+  char metrics_path[] = "/tmp/brocopy-bench-XXXXXX.json";
+  int fd = mkstemps(metrics_path, 5);
+  if (fd < 0) { return 1; }
+  close(fd);
+
+  // brocopy --metrics <tmp> [args...] -> options go first, --all-csv-paths stops at the first extra positional
+  char **child_argv = (char**)calloc((size_t)argc + 3, sizeof(char*));
+  child_argv[0] = argv[0];
+  child_argv[1] = "--metrics";
+  child_argv[2] = metrics_path;
+  for (int i = 1; i < argc; ++i) { child_argv[i + 2] = argv[i]; }
+
+  if (runs > MAX_SAMPLES) { runs = MAX_SAMPLES; }
+  uint64_t total_start = now_us();
+  for (int r = 0; r < runs; ++r)
+  {
+    uint64_t start = now_us();
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      if (!freopen("/dev/null", "w", stdout)) { _exit(127); }
+      execv(child_argv[0], child_argv);
+      _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    job_us[r] = now_us() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+    {
+      fprintf(stderr, "bench: \"%s\" did not run\n", child_argv[0]);
+      return 1;
+    }
+
+    char *json = read_file(metrics_path);
+    for (char *cursor = json; cursor && (cursor = strstr(cursor, "{\"dest\":")); ++cursor)
+    {
+      char *outcome = strstr(cursor, "\"outcome\": \"");
+      if (outcome && strncmp(outcome + 12, "ok", 2) == 0) { ++ok; } else { ++failed; }
+      bytes += (uint64_t)json_number(cursor, "bytes");
+      uint64_t latency = (uint64_t)json_number(cursor, "open_us") + (uint64_t)json_number(cursor, "transfer_us");
+      if (dest_count < MAX_SAMPLES) { dest_us[dest_count++] = latency; }
+    }
+    free(json);
+  }
+  double total_s = (double)(now_us() - total_start) / 1e6;
+  remove(metrics_path);
+
+  qsort(job_us, (size_t)runs, sizeof(uint64_t), cmp_u64);
+  qsort(dest_us, dest_count, sizeof(uint64_t), cmp_u64);
+
+  printf("{\"name\": \"%s\", \"runs\": %d, \"jobs_per_sec\": %.3f, \"mb_per_sec\": %.3f, "
+         "\"job_p50_ms\": %.3f, \"job_p99_ms\": %.3f, \"dest_p50_ms\": %.3f, \"dest_p99_ms\": %.3f, "
+         "\"dests_ok\": %llu, \"dests_failed\": %llu}\n",
+         name, runs, runs / total_s, (double)bytes / (1 << 20) / total_s,
+         percentile_ms(job_us, (uint64_t)runs, 50), percentile_ms(job_us, (uint64_t)runs, 99),
+         percentile_ms(dest_us, dest_count, 50), percentile_ms(dest_us, dest_count, 99),
+         (unsigned long long)ok, (unsigned long long)failed);
+  free(child_argv);
+  return 0;
+}
+
+// Parse every `{"name": ...}` object of a results file
+static int
+load_results(char *path, Result *results, int max)
+{
+  char *json = read_file(path);
+  int count = 0;
+  for (char *cursor = json; cursor && count < max && (cursor = strstr(cursor, "{\"name\": \"")); ++cursor)
+  {
+    Result *result = &results[count++];
+    sscanf(cursor + 10, "%63[^\"]", result->name);
+    for (int f = 0; f < FIGURE_COUNT; ++f) { result->values[f] = json_number(cursor, figures[f].key); }
+  }
+  free(json);
+  return count;
+}
+
+static int
+bench_compare(char *baseline_path, char *results_path, double max_regression)
+{
+  static Result baseline[256], results[256];
+  int baseline_count = load_results(baseline_path, baseline, 256);
+  int results_count = load_results(results_path, results, 256);
+  int regressions = 0;
+
+  for (int i = 0; i < results_count; ++i)
+  {
+    Result *base = NULL;
+    for (int j = 0; j < baseline_count; ++j)
+    {
+      if (strcmp(baseline[j].name, results[i].name) == 0) { base = &baseline[j]; }
+    }
+    if (!base)
+    {
+      printf("%-24s (no baseline)\n", results[i].name);
+      continue;
+    }
+
+    double *old_values = base->values;
+    double *new_values = results[i].values;
+    for (int f = 0; f < FIGURE_COUNT; ++f)
+    {
+      if (old_values[f] <= 0.0) { continue; }
+      double change = (new_values[f] - old_values[f]) / old_values[f] * 100.0;
+      double worse = figures[f].higher_is_better ? -change : change;
+      int regressed = worse > max_regression;
+      regressions += regressed;
+      printf("%-24s %-14s %12.3f -> %12.3f  %+7.1f%%%s\n", results[i].name, figures[f].key,
+             old_values[f], new_values[f], change, regressed ? "  REGRESSION" : "");
+    }
+  }
+
+  return regressions > 0;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc >= 5 && strcmp(argv[1], "run") == 0)
+  {
+    return bench_run(argv[2], atoi(argv[3]), argc - 4, argv + 4);
+  }
+  if (argc >= 4 && strcmp(argv[1], "compare") == 0)
+  {
+    return bench_compare(argv[2], argv[3], (argc >= 5) ? strtod(argv[4], NULL) : 10.0);
+  }
+
+  fprintf(stderr, "Usage: bench run <name> <runs> <brocopy> [args...]\n"
+                  "       bench compare <baseline.json> <results.json> [max_regression_pct]\n");
+  return 1;
+}
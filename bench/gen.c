@@ -0,0 +1,124 @@
+/*==============================================================================
+  Synthetic inputs for the benchmark suite.
+
+  gen csv <out.csv> <rows> <dest_dir> [seed]
+      Routing table with `rows` rows: keys "k<i>" padded to 2..32 chars, paths
+      "<dest_dir>/d<i % 64>/<name>.out" with names of 4..120 chars. Prints the
+      keys of 16 evenly spaced rows (all of them if fewer) -> brocopy keys.
+
+  gen src <out> <size>[k|m|g] [dense|sparse]
+      Source file: dense is pseudo-random data, sparse is a hole with 4KB of
+      data every 1MB (ftruncate + pwrite), so multi-GB sources cost no disk.
+  ==============================================================================*/
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+// xorshift64* -> reproducible for a given seed
+static uint64_t
+rng_next(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545f4914f6cdd1dull;
+}
+
+static uint64_t
+parse_size(char *arg)
+{
+  char *end;
+  uint64_t size = strtoull(arg, &end, 10);
+  if (*end == 'k' || *end == 'K') { size <<= 10; }
+  if (*end == 'm' || *end == 'M') { size <<= 20; }
+  if (*end == 'g' || *end == 'G') { size <<= 30; }
+  return size;
+}
+
+static int
+gen_csv(char *out_path, uint64_t rows, char *dest_dir)
+{
+  static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-";
+  FILE *out = fopen(out_path, "wb");
+  if (!out) { return 1; }
+
+  static char buf[1 << 16];
+  setvbuf(out, buf, _IOFBF, sizeof(buf));
+  fprintf(out, "key,path\n");
+
+  for (uint64_t i = 0; i < rows; ++i)
+  {
+    char key[40];
+    int key_len = snprintf(key, sizeof(key), "k%llu", (unsigned long long)i);
+    int key_target = 2 + (int)(rng_next() % 31);
+    while (key_len < key_target) { key[key_len++] = 'x'; } // Pad -> keys of varied length, still unique
+    key[key_len] = 0;
+
+    char name[128];
+    int name_len = 4 + (int)(rng_next() % 117);
+    for (int c = 0; c < name_len; ++c) { name[c] = alphabet[rng_next() % (sizeof(alphabet) - 1)]; }
+    name[name_len] = 0;
+
+    fprintf(out, "%s,%s/d%llu/%s.out\n", key, dest_dir, (unsigned long long)(i % 64), name);
+    if (i % ((rows >= 16) ? rows / 16 : 1) == 0) { printf("%s ", key); }
+  }
+  printf("\n");
+
+  return fclose(out) != 0;
+}
+
+static int
+gen_src(char *out_path, uint64_t size, int sparse)
+{
+  int fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) { return 1; }
+
+  static uint64_t block[1 << 13]; // 64KB
+  int result = 0;
+
+  if (sparse)
+  { // A hole with a 4KB island every 1MB
+    result = ftruncate(fd, (off_t)size);
+    for (uint64_t off = 0; off < size && result == 0; off += 1 << 20)
+    {
+      for (int i = 0; i < 512; ++i) { block[i] = rng_next(); }
+      uint64_t len = (size - off < 4096) ? size - off : 4096;
+      result = (pwrite(fd, block, len, (off_t)off) == (ssize_t)len) ? 0 : 1;
+    }
+  }
+  else
+  {
+    for (uint64_t off = 0; off < size && result == 0; off += sizeof(block))
+    {
+      for (uint64_t i = 0; i < sizeof(block)/sizeof(block[0]); ++i) { block[i] = rng_next(); }
+      uint64_t len = (size - off < sizeof(block)) ? size - off : sizeof(block);
+      result = (write(fd, block, len) == (ssize_t)len) ? 0 : 1;
+    }
+  }
+
+  return (close(fd) != 0) || result;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc >= 5 && strcmp(argv[1], "csv") == 0)
+  {
+    if (argc >= 6) { rng_state ^= strtoull(argv[5], NULL, 10); }
+    return gen_csv(argv[2], strtoull(argv[3], NULL, 10), argv[4]);
+  }
+  if (argc >= 4 && strcmp(argv[1], "src") == 0)
+  {
+    return gen_src(argv[2], parse_size(argv[3]), argc >= 5 && strcmp(argv[4], "sparse") == 0);
+  }
+
+  fprintf(stderr, "Usage: gen csv <out.csv> <rows> <dest_dir> [seed]\n"
+                  "       gen src <out> <size>[k|m|g] [dense|sparse]\n");
+  return 1;
+}
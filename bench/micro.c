@@ -0,0 +1,341 @@
+/*==============================================================================
+  Microbenchmarks for the primitives shared by src/main.c and
+  example/broadcast_pjob.c (unity build of the same sources).
+
+  micro [--check <thresholds>] [--save <thresholds> [--slack 1.5]]
+
+  Every kernel runs over a range of sizes, starting at a few misalignments of
+  the buffers, and reports cycles per byte (rdtsc on x86, ns elsewhere) for the
+  aligned case and for the worst misalignment. Str8 kernels are measured once
+  per instruction set the CPU supports (scalar, sse2, avx2).
+
+  Thresholds file: one "<name> <size|*> <max_per_byte>" per line, '#' comments.
+  --check fails (exit 1) when the worst case of a matching row exceeds its
+  threshold. --save writes the current worst cases times `slack`, as a baseline
+  to check later runs against.
+  ==============================================================================*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MICRO_UNIT "cycles"
+#else
+#define MICRO_UNIT "ns"
+#endif
+
+#include "../src/base.h"
+#include "../src/arena.c"
+#include "../src/clock.c"
+#include "../src/cstring.c"
+#include "../src/string.c"
+#include "../src/string_simd.c"
+
+#define MICRO_BYTES_PER_TRIAL (16ull << 20) /* Bytes processed per timed trial */
+#define MICRO_TRIALS 7                      /* Best of */
+#define MICRO_MAX_SIZE (64*1024)
+#define MICRO_MAX_THRESHOLDS 256
+
+static uint64_t micro_sizes[] = { 16, 64, 256, 4096, MICRO_MAX_SIZE };
+static uint64_t micro_aligns[] = { 0, 1, 13 };
+
+typedef struct MicroInput MicroInput;
+struct MicroInput
+{
+  Arena *arena;
+  uint8_t *lhs;   // `size` bytes of lowercase letters (no '\n'), NUL terminated
+  uint8_t *rhs;   // Same letters uppercased, NUL terminated
+  uint8_t *out;   // Room for `size` + 1 bytes
+  uint64_t size;
+};
+
+// Run the kernel `reps` times -> returns something derived from the results so nothing is optimized out
+typedef uint64_t MicroFn(MicroInput *in, uint64_t reps);
+
+typedef struct MicroKernel MicroKernel;
+struct MicroKernel
+{
+  char *name;
+  MicroFn *fn;
+  int32_t per_isa;  // Goes through str8_kernels() -> measure every supported ISA
+  int32_t aligned;  // Alignment is irrelevant (allocators) -> aligned case only
+};
+
+typedef struct MicroThreshold MicroThreshold;
+struct MicroThreshold
+{
+  char name[64];
+  uint64_t size;    // 0 = any
+  double max_per_byte;
+};
+
+static uint64_t
+micro_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+//==================================================
+// Kernels
+//==================================================
+
+static uint64_t
+micro_arena_push(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  for (uint64_t i = 0; i < reps; ++i)
+  {
+    if (in->arena->pos > (256ull << 20)) { arena_clear(in->arena); }
+    sink += (uint64_t)(uintptr_t)arena_push(in->arena, in->size);
+  }
+  return sink;
+}
+
+static uint64_t
+micro_str8_pushf(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  for (uint64_t i = 0; i < reps; ++i)
+  {
+    if (in->arena->pos > (256ull << 20)) { arena_clear(in->arena); }
+    sink += str8_pushf(in->arena, "%.*s", (int)in->size, (char*)in->lhs).size;
+  }
+  return sink;
+}
+
+static uint64_t
+micro_str8_index(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  Str8 str = { in->lhs, in->size };
+  for (uint64_t i = 0; i < reps; ++i) { sink += str8_index(str, '\n'); }
+  return sink;
+}
+
+static uint64_t
+micro_str8_index_last(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  Str8 str = { in->lhs, in->size };
+  for (uint64_t i = 0; i < reps; ++i) { sink += str8_index_last(str, '\n'); }
+  return sink;
+}
+
+static uint64_t
+micro_str8_index_substr(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  Str8 str = { in->lhs, in->size };
+  for (uint64_t i = 0; i < reps; ++i) { sink += str8_index_substr(str, str8_from_lit("abcdefg!")); }
+  return sink;
+}
+
+static uint64_t
+micro_str8_equals_insensitive(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  Str8 lhs = { in->lhs, in->size };
+  Str8 rhs = { in->rhs, in->size };
+  for (uint64_t i = 0; i < reps; ++i) { sink += str8_equals_insensitive(lhs, rhs); }
+  return sink;
+}
+
+static uint64_t
+micro_cstr_match(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  for (uint64_t i = 0; i < reps; ++i) { sink += cstr_match((char*)in->lhs, (char*)in->rhs, (int32_t)in->size, 1); }
+  return sink;
+}
+
+static uint64_t
+micro_cstr_append(MicroInput *in, uint64_t reps)
+{
+  uint64_t sink = 0;
+  for (uint64_t i = 0; i < reps; ++i)
+  {
+    in->out[0] = '\0';
+    sink += cstr_append((char*)in->out, (char*)in->lhs, (uint32_t)in->size + 1);
+  }
+  return sink;
+}
+
+static MicroKernel micro_kernels[] =
+{
+  { "arena_push",              micro_arena_push,              0, 1 },
+  { "str8_pushf",              micro_str8_pushf,              0, 0 },
+  { "str8_index",              micro_str8_index,              1, 0 },
+  { "str8_index_last",         micro_str8_index_last,         1, 0 },
+  { "str8_index_substr",       micro_str8_index_substr,       1, 0 },
+  { "str8_equals_insensitive", micro_str8_equals_insensitive, 1, 0 },
+  { "cstr_match",              micro_cstr_match,              0, 0 },
+  { "cstr_append",             micro_cstr_append,             0, 0 },
+};
+
+//==================================================
+// Harness
+//==================================================
+
+// Best of MICRO_TRIALS, in units per byte
+static double
+micro_measure(MicroKernel *kernel, MicroInput *in)
+{
+  uint64_t reps = MICRO_BYTES_PER_TRIAL / in->size;
+  double best = 1e30;
+  volatile uint64_t sink = kernel->fn(in, reps / 16 + 1); // Warm up caches and page commits
+
+  for (int32_t trial = 0; trial < MICRO_TRIALS; ++trial)
+  {
+    uint64_t start = micro_now();
+    sink += kernel->fn(in, reps);
+    double per_byte = (double)(micro_now() - start) / (double)(reps * in->size);
+    if (per_byte < best) { best = per_byte; }
+  }
+  (void)sink;
+  return best;
+}
+
+static void
+micro_fill(uint8_t *lhs, uint8_t *rhs, uint64_t size)
+{
+  for (uint64_t i = 0; i < size; ++i)
+  {
+    lhs[i] = (uint8_t)('a' + (i * 7) % 26);
+    rhs[i] = (uint8_t)(lhs[i] - 'a' + 'A');
+  }
+  lhs[size] = 0;
+  rhs[size] = 0;
+}
+
+static int32_t
+micro_load_thresholds(char *path, MicroThreshold *thresholds, int32_t *count)
+{
+  FILE *file = fopen(path, "r");
+  if (!file) { return 0; }
+
+  char line[256];
+  while (fgets(line, sizeof(line), file) && *count < MICRO_MAX_THRESHOLDS)
+  {
+    MicroThreshold *t = &thresholds[*count];
+    char size[32];
+    if (line[0] == '#' || sscanf(line, "%63s %31s %lf", t->name, size, &t->max_per_byte) != 3) { continue; }
+    t->size = (size[0] == '*') ? 0 : strtoull(size, NULL, 10);
+    ++*count;
+  }
+
+  fclose(file);
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  char *check_path = NULL;
+  char *save_path = NULL;
+  double slack = 1.5;
+  for (int32_t i = 1; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "--check") == 0 && i + 1 < argc)      { check_path = argv[++i]; }
+    else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)  { save_path = argv[++i]; }
+    else if (strcmp(argv[i], "--slack") == 0 && i + 1 < argc) { slack = strtod(argv[++i], NULL); }
+    else
+    {
+      fprintf(stderr, "Usage: micro [--check <thresholds>] [--save <thresholds> [--slack 1.5]]\n");
+      return 1;
+    }
+  }
+
+  static MicroThreshold thresholds[MICRO_MAX_THRESHOLDS];
+  int32_t threshold_count = 0;
+  if (check_path && !micro_load_thresholds(check_path, thresholds, &threshold_count))
+  {
+    fprintf(stderr, "micro: could not read \"%s\"\n", check_path);
+    return 1;
+  }
+
+  FILE *save = save_path ? fopen(save_path, "w") : NULL;
+  if (save_path && !save)
+  {
+    fprintf(stderr, "micro: could not write \"%s\"\n", save_path);
+    return 1;
+  }
+  if (save) { fprintf(save, "# <name> <size|*> <max %s per byte>, written by micro --save (slack %.2f)\n", MICRO_UNIT, slack); }
+
+  Arena arena = arena_alloc(1ull << 30);
+  uint64_t buf_size = MICRO_MAX_SIZE + 64;
+  uint8_t *lhs_buf = (uint8_t*)aligned_alloc(64, buf_size);
+  uint8_t *rhs_buf = (uint8_t*)aligned_alloc(64, buf_size);
+  uint8_t *out_buf = (uint8_t*)aligned_alloc(64, buf_size);
+  if (!arena.base || !lhs_buf || !rhs_buf || !out_buf) { return 1; }
+
+  uint64_t isa_count = sizeof(str8_kernel_table) / sizeof(str8_kernel_table[0]);
+  int32_t failures = 0;
+
+  printf("%-36s %8s %12s %12s   (%s per byte)\n", "kernel", "size", "aligned", "worst", MICRO_UNIT);
+  for (uint64_t k = 0; k < sizeof(micro_kernels) / sizeof(micro_kernels[0]); ++k)
+  {
+    MicroKernel *kernel = &micro_kernels[k];
+    for (uint64_t isa = 0; isa < (kernel->per_isa ? isa_count : 1); ++isa)
+    {
+      char name[64];
+      if (kernel->per_isa)
+      {
+        if (!str8_kernels_supported(&str8_kernel_table[isa])) { continue; }
+        str8_kernels_selected = &str8_kernel_table[isa];
+        snprintf(name, sizeof(name), "%s/%s", kernel->name, str8_kernel_table[isa].name);
+      }
+      else
+      {
+        snprintf(name, sizeof(name), "%s", kernel->name);
+      }
+
+      for (uint64_t s = 0; s < sizeof(micro_sizes) / sizeof(micro_sizes[0]); ++s)
+      {
+        double aligned = 0.0, worst = 0.0;
+        for (uint64_t a = 0; a < (kernel->aligned ? 1 : sizeof(micro_aligns) / sizeof(micro_aligns[0])); ++a)
+        {
+          MicroInput in = { &arena, lhs_buf + micro_aligns[a], rhs_buf + micro_aligns[a], out_buf + micro_aligns[a], micro_sizes[s] };
+          micro_fill(in.lhs, in.rhs, in.size);
+          double per_byte = micro_measure(kernel, &in);
+          if (a == 0) { aligned = per_byte; }
+          if (per_byte > worst) { worst = per_byte; }
+        }
+
+        char *verdict = "";
+        for (int32_t t = 0; t < threshold_count; ++t)
+        {
+          if (strcmp(thresholds[t].name, name) == 0 && (thresholds[t].size == 0 || thresholds[t].size == micro_sizes[s]) &&
+              worst > thresholds[t].max_per_byte)
+          {
+            verdict = "  REGRESSION";
+            ++failures;
+            break;
+          }
+        }
+
+        printf("%-36s %8llu %12.3f %12.3f%s\n", name, (unsigned long long)micro_sizes[s], aligned, worst, verdict);
+        if (save) { fprintf(save, "%s %llu %.4f\n", name, (unsigned long long)micro_sizes[s], worst * slack); }
+      }
+    }
+  }
+  str8_kernels_selected = NULL;
+
+  if (save) { fclose(save); }
+  arena_free(&arena);
+  free(lhs_buf);
+  free(rhs_buf);
+  free(out_buf);
+
+  if (failures) { fprintf(stderr, "micro: %d kernel(s) slower than their threshold\n", failures); }
+  return failures > 0;
+}
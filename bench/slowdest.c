@@ -0,0 +1,59 @@
+/*==============================================================================
+  Stand-in for a slow or dead network share.
+
+  slowdest <fifo> <bytes_per_sec>
+      Creates <fifo> and drains every writer that opens it at ~<bytes_per_sec>
+      (one read per 10ms tick), so a brocopy destination copy to it is throttled.
+
+  slowdest <fifo> hang
+      Creates <fifo> and never opens it: writers block in open(), like a copy to
+      a share whose server stopped answering.
+
+  Runs until killed (the bench Makefile starts it in the background).
+  ==============================================================================*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+int main(int argc, char *argv[])
+{
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: slowdest <fifo> <bytes_per_sec|hang>\n");
+    return 1;
+  }
+
+  if (mkfifo(argv[1], 0666) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "slowdest: could not create \"%s\": %s\n", argv[1], strerror(errno));
+    return 1;
+  }
+
+  if (strcmp(argv[2], "hang") == 0)
+  {
+    for (;;) { pause(); }
+  }
+
+  uint64_t per_tick = strtoull(argv[2], NULL, 10) / 100;
+  if (per_tick == 0) { per_tick = 1; }
+  static char buf[1 << 20];
+  if (per_tick > sizeof(buf)) { per_tick = sizeof(buf); }
+
+  struct timespec tick = { 0, 10*1000*1000 };
+  for (;;)
+  { // One writer at a time, EOF (writer done or killed) -> wait for the next one
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) { return 1; }
+
+    while (read(fd, buf, per_tick) > 0) { nanosleep(&tick, NULL); }
+    close(fd);
+  }
+}
@@ -1,27 +1,70 @@
-#ifndef BROCOPY_H
-#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#ifndef BROCOPY_BASE_H
+#include "base.h" // only to make it possible to use -fsyntax-only
 #endif
 
 //==================================================
-// Arena (Simple arena implementation)
+// Arena (Reserve/commit arena implementation)
 //==================================================
+// (arena_push), (arena_push_bytes), (scratch_start) and (scratch_end) are parenthesized so the ARENA_INSTRUMENT
+// macros don't expand on their definitions.
+/*
+   The whole `size` is reserved up front as inaccessible address space, so pushes never move
+   the arena (pointers stay valid) and there's no fixed ceiling short of the reservation.
+   Pages are committed in ARENA_COMMIT_SIZE steps as `pos` grows, the OS hands them out zeroed.
+*/
 
+static uint64_t
+arena_round_up(uint64_t value, uint64_t granularity)
+{
+  return (value + granularity - 1) / granularity * granularity;
+}
+
+static int32_t
+os_mem_commit(uint8_t *ptr, uint64_t size)
+{
+#ifdef _WIN32
+  return VirtualAlloc(ptr, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+#else
+  return mprotect(ptr, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+static void
+os_mem_decommit(uint8_t *ptr, uint64_t size)
+{
+#ifdef _WIN32
+  VirtualFree(ptr, size, MEM_DECOMMIT);
+#else
+  madvise(ptr, size, MADV_DONTNEED);
+  mprotect(ptr, size, PROT_NONE);
+#endif
+}
+
+// Reserve `size` bytes, halving the request while the address space is limited (32-bit, ulimit -v)
 static Arena
 arena_alloc(uint64_t size)
 {
   Arena arena = {0};
+  size = arena_round_up(size, ARENA_COMMIT_SIZE);
+  void *base = NULL;
 
-  arena.base = (uint8_t*)malloc(size);
-  if (arena.base)
+  for (;;)
   {
-    arena.size = size;
-    memset(arena.base, 0, arena.size);
+#ifdef _WIN32
+    base = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) { base = NULL; }
+#endif
+    if (base || size <= ARENA_COMMIT_SIZE) { break; }
+    size = arena_round_up(size / 2, ARENA_COMMIT_SIZE);
   }
-  else
+
+  if (base)
   {
-    arena.size = 0;
+    arena.base = (uint8_t*)base;
+    arena.size = size;
   }
-  arena.pos = 0;
 
   return arena;
 }
@@ -34,30 +77,97 @@ arena_from_buffer(uint8_t *buffer, uint64_t size)
 
   arena.base = buffer;
   arena.size = size;
+  arena.commit = size;
   arena.pos = 0;
+  arena.split_pos = 0;
+
+  return arena;
+}
+
+// Carve a `size` bytes sub-arena out of `parent`'s reservation, without committing it. Meant for
+// handing each worker thread its own arena before it starts: the worker pushes (and commits) with
+// no locking, and after joining it the results already live in `parent`, nothing to copy.
+// The split lives as long as `parent`: arena_clear()/scratch_end() on `parent` stop at its end,
+// only arena_free(parent) releases it -> never arena_free() a split arena.
+static Arena
+arena_split(Arena *parent, uint64_t size)
+{
+  Arena arena = {0};
+  size = arena_round_up(size, ARENA_COMMIT_SIZE);
 
+  // Start at a commit boundary so the parent's commit/decommit steps never straddle the split
+  uint64_t aligned = arena_round_up(parent->pos, ARENA_COMMIT_SIZE);
+  if (parent->commit == parent->size || aligned > parent->size || size > parent->size - aligned)
+  {
+    return arena; // Buffer arenas can't be split, nothing to commit on demand
+  }
+
+  arena.base = parent->base + aligned;
+  arena.size = size;
+  parent->pos = aligned + size; // Parent commits over it later only if it grows past the split
+  parent->split_pos = parent->pos;
   return arena;
 }
 
 static void *
-arena_push(Arena *arena, uint64_t size)
+arena_push_align(Arena *arena, uint64_t size, uint64_t align)
 {
-  // calculate new position - 8 byte aligned
-  uint64_t aligned = (arena->pos + 7u) & ~7u;
-  if (aligned + size <= arena->size)
+  // calculate new position - `align` (power of two) aligned
+  uint64_t aligned = (arena->pos + (align - 1)) & ~(align - 1);
+  if (aligned > arena->size || size > arena->size - aligned)
   {
-    void *ptr = arena->base + aligned;
-    arena->pos = aligned + size;
-    return ptr;
+    return NULL; // Arena out of (reserved) space
   }
 
-  return NULL; // Arena out of space
+  uint64_t new_pos = aligned + size;
+  if (new_pos > arena->commit)
+  {
+    uint64_t new_commit = arena_round_up(new_pos, ARENA_COMMIT_SIZE);
+    if (new_commit > arena->size) { new_commit = arena->size; }
+
+    if (!os_mem_commit(arena->base + arena->commit, new_commit - arena->commit))
+    {
+      return NULL; // Out of memory
+    }
+    arena->commit = new_commit;
+  }
+
+  arena->pos = new_pos;
+  return arena->base + aligned;
+}
+
+static void *
+(arena_push)(Arena *arena, uint64_t size)
+{
+  return arena_push_align(arena, size, 8);
+}
+
+// Unaligned -> the bytes continue right where the previous push ended (see Str8Builder)
+static void *
+(arena_push_bytes)(Arena *arena, uint64_t size)
+{
+  return arena_push_align(arena, size, 1);
+}
+
+// Hand committed pages past `pos` back to the OS once the slack exceeds ARENA_DECOMMIT_THRESHOLD
+static void
+arena_decommit_slack(Arena *arena)
+{
+  if (ARENA_DECOMMIT_THRESHOLD == 0 || arena->commit == arena->size) { return; } // Buffer arenas own no pages
+
+  uint64_t keep = arena_round_up(arena->pos, ARENA_COMMIT_SIZE);
+  if (arena->commit - keep > ARENA_DECOMMIT_THRESHOLD)
+  {
+    os_mem_decommit(arena->base + keep, arena->commit - keep);
+    arena->commit = keep;
+  }
 }
 
 static void
 arena_clear(Arena *arena)
 {
-  arena->pos = 0;
+  arena->pos = arena->split_pos;
+  arena_decommit_slack(arena);
 }
 
 static void
@@ -65,10 +175,16 @@ arena_free(Arena *arena)
 {
   if (arena->base)
   {
-    free(arena->base);
+#ifdef _WIN32
+    VirtualFree(arena->base, 0, MEM_RELEASE);
+#else
+    munmap(arena->base, arena->size);
+#endif
     arena->base = NULL;
     arena->size = 0;
+    arena->commit = 0;
     arena->pos = 0;
+    arena->split_pos = 0;
   }
 }
 
@@ -77,13 +193,174 @@ arena_free(Arena *arena)
 //==================================================
 
 static Scratch
-scratch_start(Arena *arena)
+(scratch_start)(Arena *arena)
 {
   return (Scratch){ arena, arena->pos };
 }
 
 static void
-scratch_end(Scratch scratch)
+(scratch_end)(Scratch scratch)
+{
+  uint64_t split_pos = scratch.arena->split_pos;
+  scratch.arena->pos = (scratch.origin_pos > split_pos) ? scratch.origin_pos : split_pos;
+  arena_decommit_slack(scratch.arena);
+}
+
+// Per thread scratch arenas, reserved on first use
+static THREAD_LOCAL Arena tl_scratch_arenas[SCRATCH_ARENA_COUNT];
+
+static Scratch
+scratch_get(Arena **conflicts, uint64_t count)
 {
-  scratch.arena->pos = scratch.origin_pos;
+  for (uint64_t i = 0; i < SCRATCH_ARENA_COUNT; ++i)
+  {
+    Arena *arena = &tl_scratch_arenas[i];
+    int32_t conflicting = 0;
+    for (uint64_t j = 0; j < count; ++j)
+    {
+      if (conflicts[j] == arena) { conflicting = 1; break; }
+    }
+    if (conflicting) { continue; }
+
+    if (!arena->base) { *arena = arena_alloc(SCRATCH_RESERVE_SIZE); }
+    return scratch_start(arena);
+  }
+
+  // Every scratch arena conflicts -> more than SCRATCH_ARENA_COUNT nested result arenas
+  return scratch_start(&tl_scratch_arenas[0]);
 }
+
+// Unmap the calling thread's scratch arenas -> call before a worker thread exits
+static void
+scratch_thread_release(void)
+{
+  for (uint64_t i = 0; i < SCRATCH_ARENA_COUNT; ++i)
+  {
+    arena_free(&tl_scratch_arenas[i]);
+  }
+}
+
+//==================================================
+// Arena instrumentation (-DARENA_INSTRUMENT)
+//==================================================
+#ifdef ARENA_INSTRUMENT
+
+static ArenaStats arena_stats;
+
+static void
+arena_stats_max(uint64_t *peak, uint64_t value)
+{
+  uint64_t curr = __atomic_load_n(peak, __ATOMIC_RELAXED);
+  while (value > curr && !__atomic_compare_exchange_n(peak, &curr, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+// Find or claim the slot of a call site -> NULL once ARENA_MAX_SITES distinct sites were seen
+static ArenaSite *
+arena_site(char *file, int32_t line, char *func)
+{
+  uint64_t key = ((uint64_t)(uintptr_t)file * 0x9e3779b97f4a7c15ull) ^ (uint64_t)line;
+  key = key ? key : 1;
+
+  for (uint64_t i = 0; i < ARENA_MAX_SITES; ++i)
+  {
+    ArenaSite *site = &arena_stats.sites[(key + i) % ARENA_MAX_SITES];
+    uint64_t expected = 0;
+    if (__atomic_compare_exchange_n(&site->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      site->file = file;
+      site->line = line;
+      site->func = func;
+      return site;
+    }
+    if (expected == key) { return site; }
+  }
+
+  return NULL;
+}
+
+static void *
+arena_push_site(Arena *arena, uint64_t size, uint64_t align, char *file, int32_t line, char *func)
+{
+  void *ptr = arena_push_align(arena, size, align);
+  ArenaSite *site = arena_site(file, line, func);
+
+  __atomic_add_fetch(&arena_stats.pushes, 1, __ATOMIC_RELAXED);
+  if (site) { __atomic_add_fetch(&site->pushes, 1, __ATOMIC_RELAXED); }
+
+  if (ptr)
+  {
+    __atomic_add_fetch(&arena_stats.bytes, size, __ATOMIC_RELAXED);
+    if (site) { __atomic_add_fetch(&site->bytes, size, __ATOMIC_RELAXED); }
+    arena_stats_max(&arena_stats.peak_pos, arena->pos);
+    arena_stats_max(&arena_stats.peak_commit, arena->commit);
+    return ptr;
+  }
+
+  char *reason = "commit failed (out of memory)";
+  uint64_t aligned = (arena->pos + (align - 1)) & ~(align - 1);
+  if (!arena->base)                                                { reason = "arena was never allocated"; }
+  else if (aligned > arena->size || size > arena->size - aligned) { reason = "reservation exhausted"; }
+
+  __atomic_add_fetch(&arena_stats.failures, 1, __ATOMIC_RELAXED);
+  if (site)
+  {
+    __atomic_add_fetch(&site->failures, 1, __ATOMIC_RELAXED);
+    site->last_failure = reason;
+  }
+
+  fprintf(stderr, "arena: push of %" PRIu64 " bytes failed at %s:%d (%s): %s (pos=%" PRIu64 " commit=%" PRIu64 " reserved=%" PRIu64 ")\n",
+          size, file, line, func, reason, arena->pos, arena->commit, arena->size);
+  return NULL;
+}
+
+static Scratch
+scratch_start_site(Arena *arena)
+{
+  __atomic_add_fetch(&arena_stats.scratch_scopes, 1, __ATOMIC_RELAXED);
+  return (scratch_start)(arena);
+}
+
+static void
+scratch_end_site(Scratch scratch)
+{
+  uint64_t used = scratch.arena->pos - scratch.origin_pos;
+  __atomic_add_fetch(&arena_stats.scratch_bytes, used, __ATOMIC_RELAXED);
+  arena_stats_max(&arena_stats.scratch_peak, used);
+  (scratch_end)(scratch);
+}
+
+// Summary of every arena so far, call sites sorted by bytes pushed
+static void
+arena_stats_print(FILE *stream)
+{
+  ArenaSite *order[ARENA_MAX_SITES];
+  uint64_t count = 0;
+
+  for (uint64_t i = 0; i < ARENA_MAX_SITES; ++i)
+  {
+    ArenaSite *site = &arena_stats.sites[i];
+    if (site->key == 0) { continue; }
+
+    uint64_t j = count++;
+    for (; j > 0 && order[j - 1]->bytes < site->bytes; --j) { order[j] = order[j - 1]; }
+    order[j] = site;
+  }
+
+  fprintf(stream, "Arena stats: %" PRIu64 " pushes, %" PRIu64 " bytes, %" PRIu64 " failed, peak pos %" PRIu64 ", peak commit %" PRIu64 "\n",
+          arena_stats.pushes, arena_stats.bytes, arena_stats.failures, arena_stats.peak_pos, arena_stats.peak_commit);
+  fprintf(stream, "Arena stats: %" PRIu64 " scratch scopes released %" PRIu64 " bytes, largest scope %" PRIu64 " bytes\n",
+          arena_stats.scratch_scopes, arena_stats.scratch_bytes, arena_stats.scratch_peak);
+
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    ArenaSite *site = order[i];
+    fprintf(stream, "  %10" PRIu64 " bytes %8" PRIu64 " pushes  %s:%d (%s)", site->bytes, site->pushes, site->file, site->line, site->func);
+    if (site->failures)
+    {
+      fprintf(stream, "  %" PRIu64 " failed, last: %s", site->failures, site->last_failure);
+    }
+    fprintf(stream, "\n");
+  }
+}
+
+#endif
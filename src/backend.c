@@ -0,0 +1,555 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Backends (fifo:, exec:, unix: stream destinations)
+//==================================================
+/*
+   A destination without a scheme is a file (copy_file). With one, it is a stream:
+
+     fifo:/run/lp/in        FIFO -> waited on (without blocking) until its reader shows up
+     exec:lp -d printer     Shell command fed through its stdin -> must exit with 0
+     unix:/run/printd.sock  Unix stream socket
+
+   broadcast_streams_start hands all of them to a StreamWorker, a child process feeding them from
+   a single epoll loop while the parent copies the files. Every stream has its own offset into
+   the source and takes at most STREAM_SEND_MAX per wakeup, so a slow (or stuck) consumer only
+   delays itself. Pipes are filled with splice() and sockets with sendfile(), straight from the
+   source's page cache, read()/write() where the kernel refuses the pair. The job ends once every
+   stream did, so without a timeout a stream that stalls for STREAM_IDLE_MAX_MS is abandoned
+   rather than holding it open forever.
+*/
+
+static int32_t stream_open_fifo(DestStream *stream);
+static int32_t stream_open_exec(DestStream *stream);
+static int32_t stream_open_unix(DestStream *stream);
+static int32_t stream_send_splice(DestStream *stream, int32_t src_fd, uint64_t src_size);
+static int32_t stream_send_socket(DestStream *stream, int32_t src_fd, uint64_t src_size);
+static int32_t stream_finish_close(DestStream *stream);
+static int32_t stream_finish_exec(DestStream *stream);
+static int32_t stream_finish_socket(DestStream *stream);
+
+static DestBackend dest_backends[] =
+{
+  { "fifo:", stream_open_fifo, stream_send_splice, stream_finish_close },
+  { "exec:", stream_open_exec, stream_send_splice, stream_finish_exec },
+  { "unix:", stream_open_unix, stream_send_socket, stream_finish_socket },
+};
+
+// Backend index of `path` -> -1 for a plain file path
+static int32_t
+dest_backend_find(Str8 path)
+{
+  for (uint32_t i = 0; i < sizeof(dest_backends)/sizeof(dest_backends[0]); ++i)
+  {
+    Str8 scheme = str8_from_cstr(dest_backends[i].scheme);
+    if (path.size > scheme.size && str8_equals(str8_prefix(path, scheme.size), scheme)) { return (int32_t)i; }
+  }
+  return -1;
+}
+
+#ifndef _WIN32
+
+static int32_t
+stream_fail(DestStream *stream, int32_t err)
+{
+  stream->copy.err = err ? err : EIO;
+  return 0;
+}
+
+// Bounce through a buffer -> for pairs splice/sendfile refuse. A partial write is read again next time.
+static int32_t
+stream_send_copy(DestStream *stream, int32_t src_fd, uint64_t src_size)
+{
+  uint8_t buf[64*1024];
+  for (uint64_t budget = STREAM_SEND_MAX; stream->offset < src_size && budget > 0;)
+  {
+    uint64_t want = src_size - stream->offset;
+    want = (want < sizeof(buf)) ? want : sizeof(buf);
+    want = (want < budget) ? want : budget;
+    ssize_t b_read = pread(src_fd, buf, (size_t)want, (off_t)stream->offset);
+    if (b_read < 0 && errno == EINTR) { continue; }
+    if (b_read <= 0) { return stream_fail(stream, (b_read < 0) ? errno : EIO); } // 0 -> the source shrank
+
+    ssize_t b_written = write(stream->fd, buf, (size_t)b_read);
+    if (b_written < 0)
+    {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { return -1; }
+      return stream_fail(stream, errno);
+    }
+    stream->offset += (uint64_t)b_written;
+    stream->copy.bytes += (uint64_t)b_written;
+    budget -= (uint64_t)b_written;
+  }
+  return (stream->offset == src_size) ? 1 : -1;
+}
+
+// Source pages -> pipe (FIFO or the command's stdin), no copy through user space
+static int32_t
+stream_send_splice(DestStream *stream, int32_t src_fd, uint64_t src_size)
+{
+  for (uint64_t budget = STREAM_SEND_MAX; stream->offset < src_size && budget > 0;)
+  {
+    loff_t off = (loff_t)stream->offset;
+    uint64_t want = (src_size - stream->offset < budget) ? src_size - stream->offset : budget;
+    ssize_t sent = splice(src_fd, &off, stream->fd, NULL, (size_t)want, SPLICE_F_NONBLOCK | SPLICE_F_MOVE);
+    if (sent < 0)
+    {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN) { return -1; }
+      if (errno == EINVAL || errno == ENOSYS) { return stream_send_copy(stream, src_fd, src_size); }
+      return stream_fail(stream, errno);
+    }
+    if (sent == 0) { return stream_fail(stream, EIO); }
+    stream->offset += (uint64_t)sent;
+    stream->copy.bytes += (uint64_t)sent;
+    budget -= (uint64_t)sent;
+  }
+  return (stream->offset == src_size) ? 1 : -1;
+}
+
+// Source pages -> socket
+static int32_t
+stream_send_socket(DestStream *stream, int32_t src_fd, uint64_t src_size)
+{
+  for (uint64_t budget = STREAM_SEND_MAX; stream->offset < src_size && budget > 0;)
+  {
+    off_t off = (off_t)stream->offset;
+    uint64_t want = (src_size - stream->offset < budget) ? src_size - stream->offset : budget;
+    ssize_t sent = sendfile(stream->fd, src_fd, &off, (size_t)want);
+    if (sent < 0)
+    {
+      if (errno == EINTR) { continue; }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) { return -1; }
+      if (errno == EINVAL || errno == ENOSYS) { return stream_send_copy(stream, src_fd, src_size); }
+      return stream_fail(stream, errno);
+    }
+    if (sent == 0) { return stream_fail(stream, EIO); }
+    stream->offset += (uint64_t)sent;
+    stream->copy.bytes += (uint64_t)sent;
+    budget -= (uint64_t)sent;
+  }
+  return (stream->offset == src_size) ? 1 : -1;
+}
+
+static int32_t
+stream_open_fifo(DestStream *stream)
+{
+  stream->fd = open((char*)stream->target.ptr, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+  if (stream->fd >= 0) { return 1; }
+  return (errno == ENXIO) ? -1 : stream_fail(stream, errno); // ENXIO -> no reader yet
+}
+
+// `sh -c <command>` with the write end of a pipe to its stdin
+static int32_t
+stream_open_exec(DestStream *stream)
+{
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) { return stream_fail(stream, errno); }
+
+  pid_t pid = fork();
+  if (pid == 0)
+  { // Command -> back to the default signal mask (SIGPIPE is blocked around the event loop)
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (dup2(fds[0], STDIN_FILENO) < 0) { _exit(127); } // The copy doesn't inherit O_CLOEXEC
+    execl("/bin/sh", "sh", "-c", (char*)stream->target.ptr, (char*)NULL);
+    _exit(127);
+  }
+
+  int32_t err = errno;
+  close(fds[0]);
+  if (pid < 0)
+  {
+    close(fds[1]);
+    return stream_fail(stream, err);
+  }
+
+  stream->pid = pid;
+  stream->fd = fds[1];
+  fcntl(stream->fd, F_SETFL, fcntl(stream->fd, F_GETFL) | O_NONBLOCK);
+  return 1;
+}
+
+static int32_t
+stream_open_unix(DestStream *stream)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (stream->target.size >= sizeof(addr.sun_path)) { return stream_fail(stream, ENAMETOOLONG); }
+  memcpy(addr.sun_path, stream->target.ptr, stream->target.size);
+
+  if (stream->fd < 0)
+  {
+    stream->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stream->fd < 0) { return stream_fail(stream, errno); }
+  }
+
+  if (connect(stream->fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) { return 1; }
+  if (errno == EAGAIN) { return -1; } // Listen backlog full -> connect again later
+
+  int32_t err = errno;
+  close(stream->fd);
+  stream->fd = -1;
+  return stream_fail(stream, err);
+}
+
+static int32_t
+stream_finish_close(DestStream *stream)
+{
+  int32_t result = (close(stream->fd) == 0);
+  stream->fd = -1;
+  return result ? 1 : stream_fail(stream, errno);
+}
+
+// EOF on the command's stdin, then its exit status
+static int32_t
+stream_finish_exec(DestStream *stream)
+{
+  if (stream->fd >= 0)
+  {
+    close(stream->fd);
+    stream->fd = -1;
+  }
+
+  int status;
+  pid_t pid = waitpid(stream->pid, &status, WNOHANG);
+  if (pid == 0) { return -1; }
+  stream->pid = 0;
+  if (pid < 0) { return stream_fail(stream, errno); }
+  if (WIFEXITED(status) && WEXITSTATUS(status) == 0) { return 1; }
+
+  stream->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+  return stream_fail(stream, ECHILD);
+}
+
+static int32_t
+stream_finish_socket(DestStream *stream)
+{
+  shutdown(stream->fd, SHUT_WR); // The peer reads EOF even if something else holds the socket
+  return stream_finish_close(stream);
+}
+
+// The stream is over -> release what is left of it and report the outcome to the parent
+static void
+stream_end(Broadcast *job, DestStream *stream, CopyStatus status, int32_t report_fd, uint64_t idx)
+{
+  if (stream->fd >= 0)
+  { // Closing also removes it from the epoll set
+    close(stream->fd);
+    stream->fd = -1;
+  }
+  if (stream->pid > 0)
+  { // Abandoned or failed command
+    kill(stream->pid, SIGKILL);
+    waitpid(stream->pid, NULL, WNOHANG); // Still running -> inherited by init once the worker exits
+    stream->pid = 0;
+  }
+
+  stream->state = STREAM_DONE;
+  stream->copy.xfer_us = os_now_us() - stream->start_us - stream->copy.open_us;
+
+  JournalSlot *slot = (status == COPY_OK) ? journal_slot(job->journal, stream->path) : NULL;
+  if (slot) { __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE); }
+
+  StreamReport report = { idx, (uint32_t)status, stream->exit_code, stream->start_us, stream->copy };
+  ssize_t written = write(report_fd, &report, sizeof(report)); // Parent gone -> nothing left to tell it
+  (void)written;
+}
+
+// Worker side: feed every stream from a single epoll loop until each one is done, failed or expired
+static void
+streams_feed(Broadcast *job, DestStream *streams, uint64_t amt_streams, int32_t report_fd)
+{
+  sigset_t pipe_set;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  sigprocmask(SIG_BLOCK, &pipe_set, NULL); // A gone reader is an EPIPE, not the end of the worker
+
+  struct stat st;
+  int32_t src_fd = open((char*)job->src.ptr, O_RDONLY | O_CLOEXEC);
+  int32_t epfd = epoll_create1(EPOLL_CLOEXEC);
+  int32_t err = (src_fd < 0 || epfd < 0 || fstat(src_fd, &st) != 0) ? errno : 0;
+  uint64_t src_size = err ? 0 : (uint64_t)st.st_size;
+  uint64_t deadline_at_ms = job->start_ms + job->deadline_ms;
+  uint64_t amt_active = amt_streams;
+
+  for (uint64_t i = 0; i < amt_streams; ++i)
+  {
+    streams[i].start_us = os_now_us();
+    streams[i].progress_us = streams[i].start_us;
+    if (err)
+    {
+      streams[i].copy.err = err;
+      stream_end(job, &streams[i], COPY_FAILED, report_fd, i);
+      --amt_active;
+    }
+  }
+
+  while (amt_active > 0)
+  {
+    // Open, finish and expire -> whatever isn't driven by an event
+    int64_t wait_ms = -1;
+    uint64_t now_ms = os_now_us() / 1000;
+    for (uint64_t i = 0; i < amt_streams; ++i)
+    {
+      DestStream *stream = &streams[i];
+      DestBackend *backend = &dest_backends[stream->backend];
+      if (stream->state == STREAM_DONE) { continue; }
+
+      uint64_t elapsed_ms = (os_now_us() - stream->start_us) / 1000;
+      uint64_t idle_ms = (os_now_us() - stream->progress_us) / 1000;
+      if ((job->timeout_ms && elapsed_ms >= job->timeout_ms) || (job->deadline_ms && now_ms >= deadline_at_ms) ||
+          (!job->timeout_ms && idle_ms >= STREAM_IDLE_MAX_MS))
+      { // Abandoned like a stuck file copy -> without -t only once it stalled, the job waits for it to end
+        stream->copy.err = ETIMEDOUT;
+        stream_end(job, stream, COPY_TIMEOUT, report_fd, i);
+        --amt_active;
+        continue;
+      }
+
+      int32_t result = 1;
+      if (stream->state == STREAM_OPENING)
+      {
+        result = backend->open(stream);
+        if (result == 1)
+        {
+          struct epoll_event event = { .events = EPOLLOUT, .data.u64 = i };
+          stream->copy.open_us = os_now_us() - stream->start_us;
+          stream->progress_us = os_now_us();
+          stream->state = STREAM_SENDING;
+          result = (epoll_ctl(epfd, EPOLL_CTL_ADD, stream->fd, &event) == 0) ? 1 : stream_fail(stream, errno);
+        }
+      }
+      else if (stream->state == STREAM_EXITING)
+      {
+        result = backend->finish(stream);
+        if (result == 1)
+        {
+          stream_end(job, stream, COPY_OK, report_fd, i);
+          --amt_active;
+          continue;
+        }
+      }
+
+      if (result == 0)
+      {
+        stream_end(job, stream, COPY_FAILED, report_fd, i);
+        --amt_active;
+        continue;
+      }
+
+      // Wake up for the next retry or expiry, whichever comes first
+      int64_t next_ms = (result == -1) ? STREAM_RETRY_MS : -1;
+      if (job->timeout_ms && (next_ms < 0 || job->timeout_ms - elapsed_ms < (uint64_t)next_ms)) { next_ms = (int64_t)(job->timeout_ms - elapsed_ms); }
+      if (!job->timeout_ms && (next_ms < 0 || STREAM_IDLE_MAX_MS - idle_ms < (uint64_t)next_ms)) { next_ms = (int64_t)(STREAM_IDLE_MAX_MS - idle_ms); }
+      if (job->deadline_ms && (next_ms < 0 || deadline_at_ms - now_ms < (uint64_t)next_ms)) { next_ms = (int64_t)(deadline_at_ms - now_ms); }
+      if (next_ms >= 0 && (wait_ms < 0 || next_ms < wait_ms)) { wait_ms = next_ms; }
+    }
+    if (amt_active == 0) { break; }
+
+    struct epoll_event events[STREAM_EVENTS];
+    int32_t amt_events = epoll_wait(epfd, events, STREAM_EVENTS, (wait_ms > INT32_MAX) ? INT32_MAX : (int)wait_ms);
+    for (int32_t e = 0; e < amt_events; ++e)
+    {
+      uint64_t i = events[e].data.u64;
+      DestStream *stream = &streams[i];
+      DestBackend *backend = &dest_backends[stream->backend];
+      if (stream->state != STREAM_SENDING) { continue; }
+
+      uint64_t sent_before = stream->offset;
+      int32_t result = backend->send(stream, src_fd, src_size); // A reader that left shows up as EPIPE here
+      if (stream->offset != sent_before) { stream->progress_us = os_now_us(); }
+      if (result == 1)
+      {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, stream->fd, NULL);
+        stream->state = STREAM_EXITING;
+        result = backend->finish(stream);
+        if (result == 1)
+        {
+          stream_end(job, stream, COPY_OK, report_fd, i);
+          --amt_active;
+        }
+      }
+      if (result == 0)
+      {
+        stream_end(job, stream, COPY_FAILED, report_fd, i);
+        --amt_active;
+      }
+    }
+  }
+}
+
+// Move the stream destinations of job->paths to a StreamWorker feeding them in the background, and
+// leave only the files in job->paths. The worker is a child process, like a CopyWorker: the event
+// loop runs next to the file copies and holds none of their descriptors. Streams the worker could
+// not be started for are recorded as failed right away.
+static void
+broadcast_streams_start(Broadcast *job, Arena *arena, StreamWorker *worker)
+{
+  Str8Array *paths = job->paths;
+  worker->fd = -1;
+  worker->count = 0;
+  worker->amt_pending = 0;
+  worker->streams = (DestStream*)arena_push(arena, paths->count*sizeof(DestStream));
+  if (!worker->streams) { return; } // Left in place -> they fail as files, with a logged error
+
+  uint64_t amt_files = 0;
+  for (uint64_t i = 0; i < paths->count; ++i)
+  {
+    Str8 path = str8_array_get(paths, i);
+    int32_t backend = dest_backend_find(path);
+    if (backend < 0)
+    {
+      paths->offsets[amt_files] = paths->offsets[i];
+      paths->sizes[amt_files] = paths->sizes[i];
+      ++amt_files;
+      continue;
+    }
+
+    DestStream *stream = &worker->streams[worker->count++];
+    memset(stream, 0, sizeof(*stream));
+    stream->path = path;
+    stream->target = str8_skip(path, strlen(dest_backends[backend].scheme));
+    stream->backend = (uint32_t)backend;
+    stream->fd = -1;
+  }
+  paths->count = amt_files;
+  if (worker->count == 0) { return; }
+
+  int fds[2];
+  pid_t pid = -1;
+  int32_t err = errno;
+  if (pipe2(fds, O_CLOEXEC) != 0) { err = errno; }
+  else
+  {
+    // Room for every report -> the worker never waits on a parent busy copying a file
+    uint64_t reports_size = worker->count*sizeof(StreamReport);
+    if (reports_size > (uint64_t)fcntl(fds[1], F_GETPIPE_SZ)) { fcntl(fds[1], F_SETPIPE_SZ, (int)((reports_size < INT32_MAX) ? reports_size : INT32_MAX)); }
+
+    pid = fork();
+    if (pid == 0)
+    { // Worker -> no malloc, stdio or logging, the parent records the reports
+      close(fds[0]);
+      streams_feed(job, worker->streams, worker->count, fds[1]);
+      _exit(0);
+    }
+    err = errno;
+    close(fds[1]);
+    if (pid < 0) { close(fds[0]); }
+  }
+
+  worker->amt_pending = worker->count;
+  if (pid < 0)
+  {
+    for (uint64_t i = 0; i < worker->count; ++i)
+    {
+      worker->streams[i].copy.err = err ? err : EAGAIN;
+      worker->streams[i].state = STREAM_DONE;
+      broadcast_record(job, worker->streams[i].path, &worker->streams[i].copy, COPY_FAILED);
+    }
+    worker->amt_pending = 0;
+    return;
+  }
+
+  worker->pid = pid;
+  worker->fd = fds[0];
+}
+
+// Record the streams the worker reported -> `wait` blocks until every one of them ended (the worker
+// applies the timeouts, the deadline and STREAM_IDLE_MAX_MS, so it does end). Return the number
+// of successful streams recorded.
+static uint64_t
+broadcast_streams_collect(Broadcast *job, StreamWorker *worker, int32_t wait)
+{
+  uint64_t amt_ok = 0;
+  while (worker->amt_pending > 0)
+  {
+    struct pollfd pfd = { .fd = worker->fd, .events = POLLIN };
+    int32_t ready = poll(&pfd, 1, wait ? -1 : 0);
+    if (ready < 0 && errno == EINTR) { continue; }
+    if (ready == 0) { break; }
+
+    StreamReport report;
+    if (ready < 0 || read(worker->fd, &report, sizeof(report)) != sizeof(report) || report.idx >= worker->count)
+    { // Worker died (or garbled its reports) -> whatever it didn't report failed
+      kill(worker->pid, SIGKILL);
+      for (uint64_t i = 0; i < worker->count; ++i)
+      {
+        DestStream *stream = &worker->streams[i];
+        if (stream->state == STREAM_DONE) { continue; }
+        stream->copy.err = ECHILD;
+        stream->state = STREAM_DONE;
+        broadcast_record(job, stream->path, &stream->copy, COPY_FAILED);
+      }
+      worker->amt_pending = 0;
+      break;
+    }
+
+    DestStream *stream = &worker->streams[report.idx];
+    if (stream->state == STREAM_DONE) { continue; }
+    stream->state = STREAM_DONE;
+    stream->copy = report.copy;
+    --worker->amt_pending;
+
+    // The worker's zones die with it, rebuild the stream's from its report
+    trace_record("stream", worker->pid, report.start_us, report.copy.open_us + report.copy.xfer_us, stream->path);
+    if (report.exit_code)
+    {
+      log_printf(job->log, LOG_ERROR, "Command of \"%s\" exited with status %d", (char*)stream->path.ptr, report.exit_code);
+    }
+    broadcast_record(job, stream->path, &stream->copy, (CopyStatus)report.status);
+    amt_ok += (report.status == COPY_OK);
+  }
+
+  if (worker->amt_pending == 0 && worker->fd >= 0)
+  { // The worker exits right after its last report (or was killed)
+    close(worker->fd);
+    worker->fd = -1;
+    waitpid(worker->pid, NULL, 0);
+  }
+  return amt_ok;
+}
+
+#else // No backends on Windows yet -> stream destinations fail, files are left to broadcast_copy
+
+static void
+broadcast_streams_start(Broadcast *job, Arena *arena, StreamWorker *worker)
+{
+  (void)arena;
+  Str8Array *paths = job->paths;
+  uint64_t amt_files = 0;
+  worker->fd = -1;
+  worker->count = 0;
+  worker->amt_pending = 0;
+  for (uint64_t i = 0; i < paths->count; ++i)
+  {
+    Str8 path = str8_array_get(paths, i);
+    if (dest_backend_find(path) >= 0)
+    {
+      CopyMetrics copy = {0};
+      copy.err = ERROR_NOT_SUPPORTED;
+      broadcast_record(job, path, &copy, COPY_FAILED);
+      continue;
+    }
+    paths->offsets[amt_files] = paths->offsets[i];
+    paths->sizes[amt_files] = paths->sizes[i];
+    ++amt_files;
+  }
+  paths->count = amt_files;
+}
+
+static uint64_t
+broadcast_streams_collect(Broadcast *job, StreamWorker *worker, int32_t wait)
+{
+  (void)job;
+  (void)worker;
+  (void)wait;
+  return 0;
+}
+
+#endif
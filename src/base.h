@@ -0,0 +1,306 @@
+// Unity-Build: the primitives (arena, clock, Str8, C strings), usable without the rest of brocopy.h
+#ifndef BROCOPY_BASE_H
+#define BROCOPY_BASE_H
+
+#include <inttypes.h> // PRIu64
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // memset and memcpy
+
+#ifdef _WIN32
+#define OS_SLASH '\\'
+#else
+#define OS_SLASH '/'
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread /* C99 has no _Thread_local */
+#endif
+
+
+//==================================================
+// Inlined / Macros
+//==================================================
+
+// (double evaluation error prone)
+#define IS_UPPER(ch) ((ch) >= 'A' && (ch) <= 'Z')
+#define IS_LOWER(ch) ((ch) >= 'a' && (ch) <= 'z')
+
+static inline uint64_t
+str_len(char *s)
+{
+  char *p = s;
+  while (*p) ++p;
+  return p - s;
+}
+
+// 'A' = 0b0100 0001
+// 'a' = 0b0110 0001
+// Flip the bit 5 to lower A-Z
+static inline int32_t
+to_lower(int32_t ch)
+{
+  uint32_t is_cap = (ch >= 'A' && ch <= 'Z');
+  return ch | (is_cap << 5);
+}
+
+static inline int32_t
+is_slash(int32_t ch)
+{
+  return (ch == '/' || ch == '\\');
+}
+
+
+//==================================================
+// Arena (Reserve/commit arena implementation)
+//==================================================
+
+// arena_alloc() only reserves address space, pages are committed as `pos` grows
+#define ARENA_COMMIT_SIZE (64*1024) /* Minimum commit step */
+#ifndef ARENA_DECOMMIT_THRESHOLD
+#define ARENA_DECOMMIT_THRESHOLD (8*1024*1024) /* Give pages back on clear/scratch_end past this much slack (0 = never) */
+#endif
+
+typedef struct Arena Arena;
+struct Arena
+{
+  uint8_t *base;
+  uint64_t size;   // Reserved
+  uint64_t commit; // Committed (== size for arenas over a user buffer)
+  uint64_t pos;
+  uint64_t split_pos; // End of the last arena_split() -> clear/scratch_end never rewind below it
+};
+
+static Arena arena_alloc(uint64_t size);
+static Arena arena_from_buffer(uint8_t *buffer, uint64_t size);
+static Arena arena_split(Arena *parent, uint64_t size);
+static void * arena_push(Arena *arena, uint64_t size);
+static void * arena_push_bytes(Arena *arena, uint64_t size);
+static void arena_clear(Arena *arena);
+static void arena_free(Arena *arena);
+
+
+//==================================================
+// Clock
+//==================================================
+
+static uint64_t os_now_us(void);
+static uint64_t os_wall_ms(void);
+
+
+//==================================================
+// Scratch
+//==================================================
+
+typedef struct Scratch Scratch;
+struct Scratch
+{
+  Arena *arena;
+  uint64_t origin_pos;
+};
+
+// Every thread lazily reserves SCRATCH_ARENA_COUNT arenas of its own -> scratch_get() hands out
+// the first one not in `conflicts` (i.e. not the arena the caller is building its result on).
+#define SCRATCH_ARENA_COUNT 2
+#define SCRATCH_RESERVE_SIZE (8ull << 30) /* 8GB of address space each */
+
+static Scratch scratch_start(Arena *arena);
+static void scratch_end(Scratch scratch);
+static Scratch scratch_get(Arena **conflicts, uint64_t count);
+static void scratch_thread_release(void);
+
+
+//==================================================
+// Arena instrumentation (-DARENA_INSTRUMENT)
+//==================================================
+/*
+   Instrumented builds route every arena_push(_bytes)/scratch_start/scratch_end through a wrapper that
+   records, per call site (file:line and function), the pushes, bytes and failures, plus the
+   peak `pos`/commit over all arenas. arena_stats_print() dumps the summary.
+   Release builds compile none of it.
+*/
+#ifdef ARENA_INSTRUMENT
+
+#define ARENA_MAX_SITES 256
+
+typedef struct ArenaSite ArenaSite;
+struct ArenaSite
+{
+  uint64_t key; // 0 = free slot
+  char *file;
+  char *func;
+  int32_t line;
+  uint64_t pushes;
+  uint64_t bytes;
+  uint64_t failures;
+  char *last_failure; // Reason of the most recent failed push
+};
+
+typedef struct ArenaStats ArenaStats;
+struct ArenaStats
+{
+  ArenaSite sites[ARENA_MAX_SITES];
+  uint64_t pushes;
+  uint64_t bytes;
+  uint64_t failures;
+  uint64_t peak_pos;       // Highest `pos` reached by any arena
+  uint64_t peak_commit;    // Highest `commit` reached by any arena
+  uint64_t scratch_scopes;
+  uint64_t scratch_bytes;  // Released by scratch_end
+  uint64_t scratch_peak;   // Largest single scratch scope
+};
+
+static void * arena_push_site(Arena *arena, uint64_t size, uint64_t align, char *file, int32_t line, char *func);
+static Scratch scratch_start_site(Arena *arena);
+static void scratch_end_site(Scratch scratch);
+static void arena_stats_print(FILE *stream);
+
+// Defined after the prototypes -> arena.c keeps the real names by parenthesizing them
+#define arena_push(arena, size) arena_push_site((arena), (size), 8, __FILE__, __LINE__, (char*)__func__)
+#define arena_push_bytes(arena, size) arena_push_site((arena), (size), 1, __FILE__, __LINE__, (char*)__func__)
+#define scratch_start(arena) scratch_start_site(arena)
+#define scratch_end(scratch) scratch_end_site(scratch)
+
+#endif
+
+
+//==================================================
+// Str8
+//==================================================
+typedef struct Str8 Str8;
+struct Str8
+{
+  uint8_t *ptr;
+  uint64_t size;
+};
+
+typedef struct Str8Node Str8Node;
+struct Str8Node
+{
+  Str8Node *next;
+  Str8 str;
+};
+
+typedef struct Str8List Str8List;
+struct Str8List
+{
+  Str8Node *head;
+  Str8Node *tail;
+};
+
+// Contiguous, growable array of strings: struct-of-arrays `offsets`/`sizes` into one packed
+// blob. Each part lives in its own reserved arena, so growing never moves (or copies) anything.
+#define STR8_ARRAY_RESERVE_SIZE (4ull << 30) /* Address space per part */
+
+typedef struct Str8Array Str8Array;
+struct Str8Array
+{
+  Arena bytes;       // Packed strings, each followed by a null terminator
+  Arena offsets_mem;
+  Arena sizes_mem;
+  uint64_t *offsets; // Into `bytes`, aliases offsets_mem.base
+  uint64_t *sizes;   // Aliases sizes_mem.base
+  uint64_t count;
+};
+
+#define str8_from_buf(buf)  (Str8){ (uint8_t *)(buf), sizeof(buf) }
+#define str8_from_lit(lit)  (Str8){ (uint8_t *)(lit), sizeof(lit) - 1 }
+#define str8_from_lit_term(lit)  (Str8){ (uint8_t *)(lit), sizeof(lit) }     /* Preserve null terminator */
+#define str8_from_cstr(ptr) (Str8){ (uint8_t *)(ptr), str_len(ptr) }         /* Assumes null terminated char* */
+#define str8_from_cstr_term(ptr) (Str8){ (uint8_t *)(ptr), str_len(ptr) + 1} /* Preserve null terminator */
+
+static Str8       str8_push(Arena *arena, uint64_t size);
+static Str8       str8_pushf(Arena *arena, char *fmt, ...);
+static Str8       str8_push_copy(Arena *arena, Str8 str);
+static Str8Node * str8_list_push(Arena *arena, Str8List *list);
+static Str8Array  str8_array_alloc(void);
+static void       str8_array_free(Str8Array *array);
+static void       str8_array_clear(Str8Array *array);
+static int32_t    str8_array_push(Str8Array *array, Str8 str);
+static Str8       str8_array_get(Str8Array *array, uint64_t idx);
+static void       str8_array_sort(Str8Array *array, int32_t insensitive);
+static uint64_t   str8_array_dedup(Str8Array *array, int32_t insensitive);
+static uint64_t   str8_array_find(Str8Array *array, Str8 str, int32_t insensitive);
+static Str8       str8_append(Arena *arena, Str8 lhs, Str8 rhs);
+static uint64_t   str8_snprintf(Str8 str, char *fmt, ...);
+
+// Appends straight into the arena, no format strings -> nothing else may push on `arena` until
+// str8_builder_end(). The result has the exact size (+ null terminator if asked).
+typedef struct Str8Builder Str8Builder;
+struct Str8Builder
+{
+  Arena *arena;
+  Str8 str;       // Built so far
+  int32_t failed; // Arena full, or something else pushed in between -> end() returns an empty Str8
+};
+
+static Str8Builder str8_builder_begin(Arena *arena);
+static void        str8_builder_push(Str8Builder *builder, Str8 str);
+static void        str8_builder_push_char(Str8Builder *builder, uint8_t ch);
+static void        str8_builder_push_u64(Str8Builder *builder, uint64_t value);
+static Str8        str8_builder_end(Str8Builder *builder, int32_t null_terminate);
+static Str8        str8_push_copy_term(Arena *arena, Str8 str);
+
+static int32_t str8_equals(Str8 lhs, Str8 rhs);
+static int32_t str8_compare(Str8 lhs, Str8 rhs, int32_t insensitive);
+static int32_t str8_equals_insensitive(Str8 lhs, Str8 rhs);
+static int32_t str8_match(Str8 lhs, Str8 rhs, uint64_t n);
+static int32_t str8_match_insensitive(Str8 lhs, Str8 rhs, uint64_t n);
+
+static uint64_t str8_index(Str8 str, uint8_t ch);
+static uint64_t str8_index_last(Str8 str, uint8_t ch);
+static uint64_t str8_index_last_slash(Str8 str);
+static uint64_t str8_index_substr(Str8 str, Str8 sub);
+static uint64_t str8_index_substr_last(Str8 str, Str8 sub);
+
+static Str8 str8_skip(Str8 str, uint64_t n);
+static Str8 str8_prefix(Str8 str, uint64_t n);
+static Str8 str8_postfix(Str8 str, uint64_t n);
+
+static Str8 str8_buffer_file(Arena *arena, Str8 path);
+static Str8 str8_buffer_stream(Arena *arena, FILE *file);
+static void str8_normalize_slash(Str8 str);
+static int32_t str8_parse_u64(Str8 str, uint64_t *out);
+static uint64_t str8_hash(Str8 str);
+
+
+//==================================================
+// Str8 kernels (SIMD with runtime dispatch)
+//==================================================
+
+typedef enum Str8Isa Str8Isa;
+enum Str8Isa
+{
+  STR8_ISA_SCALAR = 0,
+  STR8_ISA_SSE2,
+  STR8_ISA_AVX2,
+};
+
+// One variant of the hot Str8 primitives -> str8_index & co. go through str8_kernels()
+typedef struct Str8Kernels Str8Kernels;
+struct Str8Kernels
+{
+  char *name;
+  Str8Isa isa;
+  uint64_t (*index)(Str8 str, uint8_t ch);
+  uint64_t (*index_last)(Str8 str, uint8_t ch);
+  int32_t  (*equals_insensitive)(uint8_t *lhs, uint8_t *rhs, uint64_t size);
+  uint64_t (*index_substr)(Str8 str, Str8 sub); // 0 < sub.size <= str.size
+};
+
+static Str8Kernels * str8_kernels(void);
+
+
+//==================================================
+// C Strings
+//==================================================
+
+static int32_t  cstr_match(char *str0, char *str1, int32_t len, int32_t insensitive);
+static uint32_t cstr_append(char *buf, char *s, uint32_t size);
+static char *   cstr_index(char *buf_p, char ch);
+
+#endif // BROCOPY_BASE_H
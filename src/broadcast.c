@@ -0,0 +1,1516 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Broadcast (Routing table + copy pipeline shared by main.c and libbrocopy.c)
+//==================================================
+/*
+   Everything between "the CSV is buffered" and "every destination has an outcome": matching
+   keys to paths, the circuit breaker partition and the copy loop (timed copies run in a
+   CopyWorker). The CLI runs it once per process, libbrocopy once per broadcast() call on a
+   routing table it loaded (and indexed) once.
+
+   Nothing in here keeps global state besides the orphan list, so concurrent jobs on different
+   threads only share what they are handed (Log, HealthCache and StatsFile are safe to share).
+*/
+
+#define COPY_MAX_ORPHANS 64
+
+static char *copy_status_names[] = { "failed", "ok", "timeout", "skipped", "mismatch" }; // By CopyStatus
+
+//==================================================
+// Routes
+//==================================================
+
+static Routes
+routes_from_csv(Str8 csv)
+{
+  Routes routes = {0};
+  routes.csv = str8_skip(csv, str8_index(csv, '\n') + 1); // Skip .csv header row
+  return routes;
+}
+
+static Str8
+routes_line(Routes *routes, uint64_t offset)
+{
+  Str8 cursor = str8_skip(routes->csv, offset);
+  return str8_prefix(cursor, str8_index(cursor, '\n'));
+}
+
+static Str8
+routes_key(Str8 line)
+{
+  return str8_prefix(line, str8_index(line, ','));
+}
+
+// Push the path column of `line` (normalized, unless it's a stream) -> 0 if the array is full
+static int32_t
+routes_push_path(Str8Array *paths, Str8 line)
+{
+  Str8 path_slice = str8_postfix(line, line.size - str8_index(line, ',') - 1);
+  if (!str8_array_push(paths, str8_prefix(path_slice, str8_index(path_slice, '\r')))) { return 0; }
+  Str8 path = str8_array_get(paths, paths->count - 1);
+  if (dest_backend_find(path) < 0) { str8_normalize_slash(path); } // Commands keep their backslashes
+  return 1;
+}
+
+static int32_t
+routes_row_less(Routes *routes, uint64_t a, uint64_t b)
+{
+  return str8_compare(routes_key(routes_line(routes, a)), routes_key(routes_line(routes, b)), 1) < 0;
+}
+
+static void
+routes_sift_down(Routes *routes, uint64_t root, uint64_t end)
+{
+  uint64_t *rows = routes->rows;
+  for (uint64_t child; (child = 2*root + 1) < end; root = child)
+  {
+    if (child + 1 < end && routes_row_less(routes, rows[child], rows[child + 1])) { ++child; }
+    if (!routes_row_less(routes, rows[root], rows[child])) { return; }
+    uint64_t tmp = rows[root];
+    rows[root] = rows[child];
+    rows[child] = tmp;
+  }
+}
+
+// Sort the rows by key -> 0 (and left unindexed) if `arena` has no room
+static int32_t
+routes_index(Routes *routes, Arena *arena)
+{
+  uint64_t count = 0;
+  for (Str8 cursor = routes->csv; cursor.size > 0; ++count)
+  {
+    cursor = str8_skip(cursor, str8_index(cursor, '\n') + 1);
+  }
+
+  uint64_t *rows = (uint64_t*)arena_push(arena, (count + 1)*sizeof(uint64_t));
+  if (!rows) { return 0; }
+
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    rows[i] = offset;
+    offset += routes_line(routes, offset).size + 1;
+  }
+
+  routes->rows = rows;
+  routes->count = count;
+  for (uint64_t i = count / 2; i > 0; --i) { routes_sift_down(routes, i - 1, count); }
+  for (uint64_t end = count; end > 1; --end)
+  {
+    uint64_t tmp = rows[0];
+    rows[0] = rows[end - 1];
+    rows[end - 1] = tmp;
+    routes_sift_down(routes, 0, end - 1);
+  }
+  return 1;
+}
+
+static int
+routes_offset_cmp(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// Push the path of every row whose key is in `keys` (sorted and unique), in CSV order.
+// Return the number of paths pushed.
+static uint64_t
+routes_match(Routes *routes, Str8Array *keys, Str8Array *paths)
+{
+  uint64_t amt_paths = 0;
+
+  if (!routes->rows)
+  { // Single use -> one scan, each row is a binary search on the keys
+    for (Str8 cursor = routes->csv; cursor.size > 0;)
+    {
+      Str8 line = str8_prefix(cursor, str8_index(cursor, '\n'));
+      if (str8_array_find(keys, routes_key(line), 1) < keys->count)
+      {
+        if (!routes_push_path(paths, line)) { return 0; }
+        ++amt_paths;
+      }
+      cursor = str8_skip(cursor, line.size + 1);
+    }
+    return amt_paths;
+  }
+
+  // Indexed -> each key is a binary search on the rows, matches are put back in CSV order
+  Scratch tmp = scratch_get(NULL, 0);
+  uint64_t *matches = (uint64_t*)arena_push(tmp.arena, (routes->count + 1)*sizeof(uint64_t));
+  if (!matches)
+  {
+    scratch_end(tmp);
+    return 0;
+  }
+
+  for (uint64_t k = 0; k < keys->count; ++k)
+  {
+    Str8 key = str8_array_get(keys, k);
+    uint64_t lo = 0, hi = routes->count;
+    while (lo < hi)
+    { // First row with a key >= `key`
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (str8_compare(routes_key(routes_line(routes, routes->rows[mid])), key, 1) < 0) { lo = mid + 1; }
+      else { hi = mid; }
+    }
+    for (; lo < routes->count && str8_compare(routes_key(routes_line(routes, routes->rows[lo])), key, 1) == 0; ++lo)
+    {
+      matches[amt_paths++] = routes->rows[lo];
+    }
+  }
+
+  qsort(matches, amt_paths, sizeof(uint64_t), routes_offset_cmp);
+  for (uint64_t i = 0; i < amt_paths; ++i)
+  {
+    if (!routes_push_path(paths, routes_line(routes, matches[i])))
+    {
+      amt_paths = 0;
+      break;
+    }
+  }
+
+  scratch_end(tmp);
+  return amt_paths;
+}
+
+// Push the path of every row, stopping after `max` -> return the number of paths pushed
+static uint64_t
+routes_all(Routes *routes, Str8Array *paths, uint64_t max)
+{
+  uint64_t amt_paths = 0;
+
+  for (Str8 cursor = routes->csv; cursor.size > 0;)
+  {
+    Str8 line = str8_prefix(cursor, str8_index(cursor, '\n'));
+    if (!routes_push_path(paths, line)) { return 0; }
+
+    if (++amt_paths > max) { break; }
+    cursor = str8_skip(cursor, line.size + 1);
+  }
+
+  return amt_paths;
+}
+
+
+#ifndef _WIN32
+//==================================================
+// Copy worker
+//==================================================
+
+// Children we gave up on (killed workers stuck on a dead mount, partial file removals). Reaped
+// by pid -> waitpid(-1) would steal the children of a process embedding libbrocopy.
+static pid_t copy_orphans[COPY_MAX_ORPHANS];
+
+static void
+copy_orphan_add(pid_t pid)
+{
+  for (uint64_t i = 0; i < COPY_MAX_ORPHANS; ++i)
+  {
+    pid_t expected = 0;
+    if (__atomic_compare_exchange_n(&copy_orphans[i], &expected, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { return; }
+  }
+  // Full -> it stays a zombie until we exit
+}
+
+static void
+copy_orphans_reap(void)
+{
+  for (uint64_t i = 0; i < COPY_MAX_ORPHANS; ++i)
+  {
+    pid_t pid = __atomic_load_n(&copy_orphans[i], __ATOMIC_ACQUIRE);
+    if (pid > 0 && __atomic_compare_exchange_n(&copy_orphans[i], &pid, -1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    { // Slot is ours while it holds -1
+      __atomic_store_n(&copy_orphans[i], (waitpid(pid, NULL, WNOHANG) == 0) ? pid : 0, __ATOMIC_RELEASE);
+    }
+  }
+}
+
+// Buffers bigger than the stack ones (tuned) come straight from mmap -> no malloc in a forked worker
+static uint8_t *
+copy_buffer_map(uint64_t size)
+{
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (map == MAP_FAILED) ? NULL : (uint8_t*)map;
+}
+
+// Reserve the blocks of [offset, size) up front -> less fragmentation, and a full disk fails the
+// copy before the first write instead of near its end. Only ENOSPC/EDQUOT fail, unsupported is fine.
+static int32_t
+copy_preallocate(int32_t dest_fd, uint64_t offset, uint64_t size)
+{
+#ifdef FALLOC_FL_KEEP_SIZE
+  if (size > offset && fallocate(dest_fd, FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)(size - offset)) != 0)
+  {
+    return (errno != ENOSPC && errno != EDQUOT);
+  }
+#else
+  (void)dest_fd; (void)offset; (void)size;
+#endif
+  return 1;
+}
+
+// Write [from, to) of the destination back and drop it from the page cache (dirty pages can't be
+// dropped, hence the wait), along with the same range of the source if `src_fd` >= 0
+static void
+copy_drop_range(int32_t src_fd, int32_t dest_fd, uint64_t from, uint64_t to)
+{
+  if (to <= from) { return; }
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range(dest_fd, (off_t)from, (off_t)(to - from),
+                  SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#endif
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(dest_fd, (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED);
+  if (src_fd >= 0) { posix_fadvise(src_fd, (off_t)from, (off_t)(to - from), POSIX_FADV_DONTNEED); }
+#else
+  (void)src_fd;
+#endif
+}
+
+// The stream reached `offset` -> once a window is full, start its writeback and drop the previous
+// one, which had a whole window's time to reach storage (the wait in copy_drop_range is short)
+static void
+copy_behind(CopyBehind *behind, int32_t src_fd, int32_t dest_fd, uint64_t offset)
+{
+  if (offset - behind->kicked < COPY_BEHIND_WINDOW) { return; }
+#ifdef SYNC_FILE_RANGE_WRITE
+  sync_file_range(dest_fd, (off_t)behind->kicked, (off_t)(offset - behind->kicked), SYNC_FILE_RANGE_WRITE);
+#endif
+  copy_drop_range(src_fd, dest_fd, behind->dropped, behind->kicked);
+  behind->dropped = behind->kicked;
+  behind->kicked = offset;
+}
+
+// First failure wins, the other threads of a chunked copy stop at their next chunk
+static void
+copy_chunks_fail(CopyChunks *task, int32_t err)
+{
+  int32_t expected = 0;
+  __atomic_compare_exchange_n(&task->err, &expected, err ? err : EIO, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// Chunk `idx` is written -> commit the journal's offset once the contiguous prefix grew enough
+static void
+copy_chunks_commit(CopyChunks *task, uint64_t idx)
+{
+  if (!task->slot) { return; }
+
+  pthread_mutex_lock(&task->lock);
+  task->done[idx] = 1;
+  while (task->done_prefix < task->chunk_count && task->done[task->done_prefix]) { ++task->done_prefix; }
+  uint64_t prefix = task->start + task->done_prefix*task->chunk_size;
+  if (prefix > task->end) { prefix = task->end; }
+  if (prefix >= task->commit_at && fdatasync(task->dest_fd) == 0)
+  { // Only what reached storage is committed
+    __atomic_store_n(&task->slot->committed, prefix, __ATOMIC_RELEASE);
+    task->commit_at = prefix + JOURNAL_COMMIT_BYTES;
+  }
+  pthread_mutex_unlock(&task->lock);
+}
+
+static void
+copy_chunks_loop(CopyChunks *task, uint8_t *buf, uint64_t buf_size)
+{
+  while (!__atomic_load_n(&task->err, __ATOMIC_ACQUIRE))
+  {
+    uint64_t idx = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED);
+    if (idx >= task->chunk_count) { break; }
+
+    uint64_t off = task->start + idx*task->chunk_size;
+    uint64_t end = (off + task->chunk_size < task->end) ? off + task->chunk_size : task->end;
+    int32_t drop_fd = task->drop_src ? task->src_fd : -1;
+    CopyBehind behind = { off, off };
+    uint32_t crc = 0;
+    while (off < end)
+    {
+      uint64_t want = (end - off < buf_size) ? end - off : buf_size;
+      ssize_t b_read = pread(task->src_fd, buf, (size_t)want, (off_t)off);
+      if (b_read <= 0)
+      { // 0 -> the source shrank under us
+        if (b_read < 0 && errno == EINTR) { continue; }
+        copy_chunks_fail(task, (b_read < 0) ? errno : EIO);
+        return;
+      }
+      if (task->crcs) { crc = crc32c(crc, buf, (uint64_t)b_read); }
+
+      for (ssize_t w = 0; w < b_read;)
+      {
+        ssize_t b_written = pwrite(task->dest_fd, buf + w, (size_t)(b_read - w), (off_t)(off + (uint64_t)w));
+        if (b_written < 0)
+        {
+          if (errno == EINTR) { continue; }
+          copy_chunks_fail(task, errno);
+          return;
+        }
+        w += b_written;
+      }
+      off += (uint64_t)b_read;
+      __atomic_fetch_add(&task->bytes, (uint64_t)b_read, __ATOMIC_RELAXED);
+      if (task->nocache) { copy_behind(&behind, drop_fd, task->dest_fd, off); }
+    }
+    if (task->nocache) { copy_drop_range(drop_fd, task->dest_fd, behind.dropped, end); }
+
+    if (task->crcs) { task->crcs[idx] = crc; }
+    copy_chunks_commit(task, idx);
+  }
+}
+
+static void *
+copy_chunks_thread(void *param)
+{
+  CopyChunks *task = (CopyChunks*)param;
+  uint8_t stack_buf[128*1024];
+  uint8_t *buf = (task->buf_size > sizeof(stack_buf)) ? copy_buffer_map(task->buf_size) : NULL;
+
+  if (buf)
+  {
+    copy_chunks_loop(task, buf, task->buf_size);
+    munmap(buf, task->buf_size);
+  }
+  else
+  { // Default, smaller than the stack one, or no memory for it
+    uint64_t buf_size = (task->buf_size && task->buf_size < sizeof(stack_buf)) ? task->buf_size : sizeof(stack_buf);
+    copy_chunks_loop(task, stack_buf, buf_size);
+  }
+
+  return NULL;
+}
+
+// Copy [task->start, task->end) on up to `threads` threads (this one included) -> 0 and `err` on failure.
+// With `crc` (only from offset 0), the per chunk checksums are combined into the source's.
+static int32_t
+copy_chunks(CopyChunks *task, uint32_t threads, uint32_t *crc)
+{
+  Scratch tmp = scratch_get(NULL, 0);
+  task->crcs = crc ? (uint32_t*)arena_push(tmp.arena, task->chunk_count*sizeof(uint32_t)) : NULL;
+  task->done = task->slot ? (uint8_t*)arena_push(tmp.arena, task->chunk_count) : NULL;
+  if ((crc && !task->crcs) || (task->slot && !task->done))
+  {
+    scratch_end(tmp);
+    task->err = ENOMEM;
+    return 0;
+  }
+  if (task->done) { memset(task->done, 0, task->chunk_count); }
+  task->commit_at = task->start + JOURNAL_COMMIT_BYTES;
+  pthread_mutex_init(&task->lock, NULL);
+
+  pthread_t pool[COPY_CHUNK_THREADS_MAX];
+  uint64_t amt_threads = 0;
+  uint64_t wanted = (task->chunk_count < threads) ? task->chunk_count : threads;
+  if (wanted > COPY_CHUNK_THREADS_MAX) { wanted = COPY_CHUNK_THREADS_MAX; }
+  while (amt_threads + 1 < wanted && pthread_create(&pool[amt_threads], NULL, copy_chunks_thread, task) == 0) { ++amt_threads; }
+  copy_chunks_thread(task); // This thread takes a share too (and all of it if no thread could start)
+  for (uint64_t i = 0; i < amt_threads; ++i) { pthread_join(pool[i], NULL); }
+  pthread_mutex_destroy(&task->lock);
+
+  int32_t result = (task->err == 0);
+  if (result && crc)
+  {
+    uint32_t combined = 0;
+    for (uint64_t i = 0; i < task->chunk_count; ++i)
+    {
+      uint64_t off = task->start + i*task->chunk_size;
+      uint64_t size = (task->end - off < task->chunk_size) ? task->end - off : task->chunk_size;
+      combined = crc32c_combine(combined, task->crcs[i], size);
+    }
+    *crc = combined;
+  }
+  scratch_end(tmp);
+  return result;
+}
+
+// `size` bytes of the source, already hashed, reached the destination's offset -> write them and
+// move the run forward (journal commits, --nocache write-behind)
+static int32_t
+copy_run_write(CopyRun *run, uint8_t *data, uint64_t size)
+{
+  for (uint64_t off = 0; off < size;)
+  {
+    ssize_t b_written = write(run->dest_fd, data + off, (size_t)(size - off));
+    if (b_written < 0)
+    {
+      if (errno == EINTR) { continue; }
+      run->err = errno;
+      return 0;
+    }
+    off += (uint64_t)b_written;
+    run->bytes += (uint64_t)b_written;
+  }
+  run->offset += size;
+  if (run->slot && run->offset >= run->commit_at && fdatasync(run->dest_fd) == 0)
+  { // Only what reached storage is committed
+    __atomic_store_n(&run->slot->committed, run->offset, __ATOMIC_RELEASE);
+    run->commit_at = run->offset + JOURNAL_COMMIT_BYTES;
+  }
+  if (run->nocache) { copy_behind(&run->behind, run->drop_fd, run->dest_fd, run->offset); }
+  return 1;
+}
+
+static int32_t
+copy_backend_rw(CopyRun *run)
+{
+  while (run->offset < run->end)
+  {
+    uint64_t want = (run->end - run->offset < run->buf_size) ? run->end - run->offset : run->buf_size;
+    ssize_t b_read = read(run->src_fd, run->buf, (size_t)want);
+    if (b_read == 0) { break; }
+    if (b_read < 0)
+    {
+      if (errno == EINTR) { continue; }
+      run->err = errno;
+      return 0;
+    }
+    if (run->crc) { *run->crc = crc32c(*run->crc, run->buf, (uint64_t)b_read); }
+    if (!copy_run_write(run, run->buf, (uint64_t)b_read)) { return 0; }
+  }
+  return 1;
+}
+
+// No copy through the buffer: written straight from the page cache. Stops at the size the source had
+// when opened (a source truncated under the mapping raises SIGBUS, same as any mmap reader).
+static int32_t
+copy_backend_mmap(CopyRun *run)
+{
+  uint64_t end = (run->end < run->size) ? run->end : run->size;
+  if (run->offset >= end) { return run->size ? 1 : -1; } // Done, or not a regular file
+
+  uint64_t start = run->offset;
+  while (run->offset < end)
+  {
+    uint64_t map_at = run->offset & ~(COPY_MMAP_WINDOW - 1); // Page aligned
+    uint64_t map_end = (map_at + COPY_MMAP_WINDOW < end) ? map_at + COPY_MMAP_WINDOW : end;
+    void *map = mmap(NULL, (size_t)(map_end - map_at), PROT_READ, MAP_SHARED, run->src_fd, (off_t)map_at);
+    if (map == MAP_FAILED)
+    {
+      if (run->offset == start) { return -1; }
+      run->err = errno;
+      return 0;
+    }
+    madvise(map, (size_t)(map_end - map_at), MADV_SEQUENTIAL);
+
+    int32_t result = 1;
+    while (result && run->offset < map_end)
+    {
+      uint8_t *data = (uint8_t*)map + (run->offset - map_at);
+      uint64_t size = (map_end - run->offset < run->buf_size) ? map_end - run->offset : run->buf_size;
+      if (run->crc) { *run->crc = crc32c(*run->crc, data, size); }
+      result = copy_run_write(run, data, size);
+    }
+    munmap(map, (size_t)(map_end - map_at));
+    if (!result) { return 0; }
+  }
+
+  if (lseek(run->src_fd, (off_t)run->offset, SEEK_SET) < 0)
+  { // The next backend reads from the file offset
+    run->err = errno;
+    return 0;
+  }
+  return 1;
+}
+
+// In kernel, and a reflink where the filesystem can (btrfs, XFS, NFS 4.2 server side copy)
+static int32_t
+copy_backend_range(CopyRun *run)
+{
+  uint64_t start = run->offset;
+  while (run->offset < run->end)
+  {
+    uint64_t want = (run->end - run->offset < COPY_RANGE_STEP) ? run->end - run->offset : COPY_RANGE_STEP;
+    ssize_t b_copied = copy_file_range(run->src_fd, NULL, run->dest_fd, NULL, (size_t)want, 0);
+    if (b_copied == 0) { break; }
+    if (b_copied < 0)
+    {
+      if (errno == EINTR) { continue; }
+      if (run->offset == start && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+      { // Cross filesystem on older kernels, or not supported here
+        return -1;
+      }
+      run->err = errno;
+      return 0;
+    }
+    run->bytes += (uint64_t)b_copied;
+    run->offset += (uint64_t)b_copied;
+    if (run->slot && run->offset >= run->commit_at && fdatasync(run->dest_fd) == 0)
+    {
+      __atomic_store_n(&run->slot->committed, run->offset, __ATOMIC_RELEASE);
+      run->commit_at = run->offset + JOURNAL_COMMIT_BYTES;
+    }
+    if (run->nocache) { copy_behind(&run->behind, run->drop_fd, run->dest_fd, run->offset); }
+  }
+  return 1;
+}
+
+static CopyBackend copy_backends[COPY_BACKEND_COUNT] =
+{
+  [COPY_BACKEND_RW]    = { copy_backend_rw, 1 },
+  [COPY_BACKEND_MMAP]  = { copy_backend_mmap, 1 },
+  [COPY_BACKEND_RANGE] = { copy_backend_range, 0 },
+};
+
+// --backend auto, first copy to a filesystem type: each backend copies the next COPY_CALIBRATE_BYTES
+// of this very copy (nothing is copied twice) and the fastest is kept for the type. -> the winner,
+// `metrics` gets the measured rates. A backend that can't run (hashing, unsupported) scores 0.
+static uint32_t
+copy_calibrate(CopyRun *run, uint64_t fs_type, CopyMetrics *metrics)
+{
+  uint32_t best = COPY_BACKEND_RW;
+  uint64_t end = run->end;
+  metrics->fs_type = (uint32_t)fs_type;
+
+  for (uint32_t i = 0; i < COPY_BACKEND_COUNT; ++i)
+  {
+    if (run->crc && !copy_backends[i].hashes) { continue; }
+
+    uint64_t start_us = os_now_us();
+    uint64_t start = run->offset;
+    run->end = start + COPY_CALIBRATE_BYTES;
+    int32_t result = copy_backends[i].copy(run);
+    run->end = end;
+    if (result == 0) { return best; } // Failed -> the caller sees `err`
+    if (result < 0 || run->offset == start) { continue; }
+
+    uint64_t elapsed_us = os_now_us() - start_us;
+    uint64_t kbps = ((run->offset - start) / 1024)*1000000 / (elapsed_us ? elapsed_us : 1);
+    metrics->calibrated_kbps[i] = (kbps > UINT32_MAX) ? UINT32_MAX : (uint32_t)kbps;
+    if (metrics->calibrated_kbps[i] > metrics->calibrated_kbps[best]) { best = i; }
+  }
+
+  return best;
+}
+
+// Move [run->offset, EOF) with the job's backend -> falls back to read/write where it can't work
+static int32_t
+copy_run(Broadcast *job, CopyRun *run, CopyMetrics *metrics)
+{
+  uint32_t backend = job->backend;
+  struct statfs fs;
+  if (backend == COPY_BACKEND_AUTO && run->size && fstatfs(run->dest_fd, &fs) == 0)
+  {
+    uint64_t fs_type = (uint64_t)fs.f_type;
+    uint32_t known = tune_fs_backend(job->tune, fs_type);
+    if (known)
+    {
+      backend = known - 1;
+    }
+    else if (run->size - run->offset >= 2*COPY_BACKEND_COUNT*COPY_CALIBRATE_BYTES)
+    { // Big enough that calibrating costs at most half of it
+      backend = copy_calibrate(run, fs_type, metrics);
+      if (run->err) { return 0; }
+      tune_fs_calibrated(job->tune, fs_type, backend);
+    }
+  }
+  if (backend >= COPY_BACKEND_COUNT || !run->size || (run->crc && !copy_backends[backend].hashes))
+  {
+    backend = COPY_BACKEND_RW;
+  }
+
+  int32_t result = copy_backends[backend].copy(run);
+  if (result < 0)
+  {
+    backend = COPY_BACKEND_RW;
+    result = copy_backend_rw(run);
+  }
+  else if (result > 0 && backend != COPY_BACKEND_RW)
+  { // Whatever the source grew by since it was sized
+    result = copy_backend_rw(run);
+  }
+  if (run->size) { metrics->backend = backend + 1; }
+  return result;
+}
+
+// `dest` is created through the directory cache (openat on its parent's fd). Plain
+// read/write (pread/pwrite on the chunk threads), no stdio or malloc, scratch arenas are bare
+// mmap -> nothing in a worker forked from a multithreaded process waits on a lock the parent's
+// other threads held. Chunked copies do start threads in the worker, which POSIX leaves undefined
+// after fork() in a multithreaded process; glibc and musl reset their thread and allocator locks
+// in the child, elsewhere use chunk_threads = 1 with timeouts.
+// With `crc`, the source is hashed on the way -> set only if the whole file was copied.
+// With a journal `slot`, a regular destination continues at its committed offset, which then
+// advances every JOURNAL_COMMIT_BYTES synced to storage, and the slot is marked done at the end.
+// A resumed copy only reads part of the source -> callers don't ask it for a `crc` (journal_resumes).
+// Regular files of at least two chunks are copied by job->chunk_threads threads (copy_chunks),
+// the others by job->backend (copy_run).
+// Regular destinations are preallocated, and with job->nocache kept out of the page cache, along
+// with the source when `drop_src` (the last destination, nobody reads the source after it).
+static int32_t
+copy_file(DirCache *dirs, Broadcast *job, Str8 dest, CopyMetrics *metrics, uint32_t *crc, JournalSlot *slot,
+          int32_t drop_src)
+{
+  uint8_t stack_buf[64*1024];
+  uint8_t *buf = stack_buf;
+  uint64_t buf_size = sizeof(stack_buf);
+  TuneChoice tune = {0};
+  int32_t result = 1;
+  uint32_t src_crc = 0;
+  uint64_t start_us = os_now_us();
+  uint64_t offset = slot ? __atomic_load_n(&slot->committed, __ATOMIC_ACQUIRE) : 0;
+  int32_t regular = 0;   // Regular source and destination -> sizes and offsets mean something
+  int32_t journaled = 0; // Regular destination -> offsets can be committed
+  int32_t chunked = 0;
+  uint64_t src_size = 0;
+  TRACE_ZONE_BEGIN(copy_zone, "copy_file");
+  TRACE_ZONE_BEGIN(open_zone, "copy_open");
+
+  int32_t src_fd = -1;
+  if (job->src_fd >= 0 && broadcast_source(job, dest).ptr == job->src.ptr)
+  { // The caller's handle, already reading ahead -> saves a path lookup on the first copy
+    src_fd = job->src_fd;
+    job->src_fd = -1;
+  }
+  else
+  {
+    src_fd = open((char*)broadcast_source(job, dest).ptr, O_RDONLY | O_CLOEXEC);
+  }
+  int32_t dest_fd = (src_fd >= 0) ? dircache_open_file(dirs, dest, offset == 0) : -1;
+  if (src_fd >= 0 && dest_fd >= 0)
+  {
+    struct stat src_st;
+    struct stat dest_st;
+    regular = (fstat(dest_fd, &dest_st) == 0 && S_ISREG(dest_st.st_mode) &&
+               fstat(src_fd, &src_st) == 0 && S_ISREG(src_st.st_mode));
+    src_size = regular ? (uint64_t)src_st.st_size : 0;
+    journaled = (slot && regular);
+    if (!journaled || (uint64_t)dest_st.st_size < offset)
+    { // Not a file, or shorter than what was committed (replaced since?) -> from the start
+      offset = 0;
+    }
+    int32_t chunkable = (regular && src_size >= offset + 2*job->chunk_size);
+    tune_pick(regular ? job->tune : NULL, (uint64_t)dest_st.st_dev, (uint64_t)dest_st.st_blksize, src_size - offset,
+              chunkable, job->chunk_threads, &tune);
+    chunked = (chunkable && tune.threads > 1);
+
+    // Chunked -> reserved, then sized to the source, the threads write at their own offsets.
+    // Sequential and journaled -> drop whatever was written past the last commit, then reserve
+    // the rest (a shrinking truncate would free the reservation again).
+    if ((chunked && (!copy_preallocate(dest_fd, offset, src_size) || ftruncate(dest_fd, (off_t)src_size) != 0)) ||
+        (!chunked && journaled && (ftruncate(dest_fd, (off_t)offset) != 0 || lseek(dest_fd, (off_t)offset, SEEK_SET) < 0 ||
+                                   lseek(src_fd, (off_t)offset, SEEK_SET) < 0)) ||
+        (!chunked && regular && !copy_preallocate(dest_fd, offset, src_size)))
+    {
+      close(dest_fd);
+      dest_fd = -1;
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(src_fd, (off_t)offset, 0, POSIX_FADV_SEQUENTIAL); // Larger readahead
+#endif
+  }
+  if (src_fd < 0 || dest_fd < 0)
+  {
+    metrics->err = errno;
+    if (src_fd >= 0) { close(src_fd); }
+    metrics->open_us = os_now_us() - start_us;
+    TRACE_ZONE_END(open_zone);
+    TRACE_ZONE_END_DETAIL(copy_zone, dest);
+    return 0;
+  }
+  int32_t nocache = (job->nocache && regular);
+
+  if (!chunked && tune.buf_size > buf_size)
+  {
+    uint8_t *mapped = copy_buffer_map(tune.buf_size);
+    if (mapped)
+    {
+      buf = mapped;
+      buf_size = tune.buf_size;
+    }
+    else { tune.slot = NULL; } // Not what was picked, don't learn from it
+  }
+  if (tune.buf_size)
+  {
+    metrics->buf_kb = (uint32_t)((chunked ? tune.buf_size : buf_size) / 1024);
+    metrics->threads = chunked ? tune.threads : 1;
+  }
+
+  uint64_t open_done_us = os_now_us();
+  metrics->open_us = open_done_us - start_us;
+  TRACE_ZONE_END(open_zone);
+  TRACE_ZONE_BEGIN(write_zone, "copy_write");
+
+  if (chunked)
+  {
+    CopyChunks task = {0};
+    task.src_fd = src_fd;
+    task.dest_fd = dest_fd;
+    task.start = offset;
+    task.end = src_size;
+    task.chunk_size = job->chunk_size;
+    task.chunk_count = (src_size - offset + job->chunk_size - 1) / job->chunk_size;
+    task.buf_size = tune.buf_size;
+    task.slot = journaled ? slot : NULL;
+    task.nocache = nocache;
+    task.drop_src = drop_src;
+    result = copy_chunks(&task, tune.threads, crc ? &src_crc : NULL);
+    metrics->bytes = task.bytes;
+    metrics->err = task.err;
+    offset = src_size;
+  }
+  else
+  {
+    CopyRun run = {0};
+    run.src_fd = src_fd;
+    run.dest_fd = dest_fd;
+    run.offset = offset;
+    run.end = UINT64_MAX;
+    run.size = src_size;
+    run.buf = buf;
+    run.buf_size = buf_size;
+    run.crc = crc ? &src_crc : NULL;
+    run.slot = journaled ? slot : NULL;
+    run.commit_at = offset + JOURNAL_COMMIT_BYTES;
+    run.nocache = nocache;
+    run.drop_fd = drop_src ? src_fd : -1;
+    run.behind = (CopyBehind){ offset, offset };
+    result = copy_run(job, &run, metrics);
+    if (nocache) { copy_drop_range(run.drop_fd, dest_fd, run.behind.dropped, run.offset); }
+    metrics->bytes = run.bytes;
+    metrics->err = run.err;
+    offset = run.offset;
+  }
+
+  close(src_fd);
+  if (buf != stack_buf) { munmap(buf, buf_size); }
+  if (journaled && result && fdatasync(dest_fd) != 0)
+  {
+    metrics->err = errno;
+    result = 0;
+  }
+  if (close(dest_fd) != 0 && result)
+  { // Deferred write errors (NFS, full disk)
+    metrics->err = errno;
+    result = 0;
+  }
+  if (result && slot)
+  {
+    if (journaled) { __atomic_store_n(&slot->committed, offset, __ATOMIC_RELEASE); }
+    __atomic_store_n(&slot->done, 1, __ATOMIC_RELEASE);
+  }
+  if (result && crc) { *crc = src_crc; }
+  metrics->xfer_us = os_now_us() - open_done_us;
+  if (result) { tune_record(&tune, metrics->bytes, metrics->xfer_us); }
+  TRACE_ZONE_END(write_zone);
+  TRACE_ZONE_END_DETAIL(copy_zone, dest);
+  return result;
+}
+
+// Spawn a worker copying the source to every destination from `paths[idx]` to the end of the array
+static int32_t
+copy_worker_spawn(CopyWorker *worker, DirCache *dirs, Broadcast *job, uint64_t idx)
+{
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) { return 0; }
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+  }
+
+  if (pid == 0)
+  { // Worker -> `dirs` is our own copy-on-write state from here on
+    close(fds[0]);
+    int32_t hash = job->checksum && !job->src_hashed;
+    for (; idx < job->paths->count; ++idx)
+    { // Hash until one copy read the whole source, reported once
+      CopyReport report = {0};
+      Str8 dest = str8_array_get(job->paths, idx);
+      JournalSlot *slot = journal_slot(job->journal, dest);
+      int32_t hash_this = hash && !journal_resumes(slot) && broadcast_source(job, dest).ptr == job->src.ptr;
+      report.start_us = os_now_us();
+      report.status = copy_file(dirs, job, dest, &report.metrics,
+                                hash_this ? &report.crc : NULL, slot, idx + 1 == job->paths->count) ? COPY_OK : COPY_FAILED;
+      report.hashed = hash_this && report.status == COPY_OK;
+      hash &= !report.hashed;
+      if (write(fds[1], &report, sizeof(report)) != sizeof(report)) { break; } // Parent is gone or gave up on us
+    }
+    _exit(0); // Skip atexit and stdio flushing, those belong to the parent
+  }
+
+  close(fds[1]);
+  if (job->src_fd >= 0)
+  { // Handed to the worker -> a later one must not share its file offset
+    close(job->src_fd);
+    job->src_fd = -1;
+  }
+  worker->pid = pid;
+  worker->fd = fds[0];
+  return 1;
+}
+
+// Kill the worker (if any) -> a child blocked on a dead mount may linger until the kernel lets
+// go of it, so it is reaped opportunistically and never waited on.
+static void
+copy_worker_stop(CopyWorker *worker)
+{
+  if (worker->fd < 0) { return; }
+
+  kill(worker->pid, SIGKILL);
+  close(worker->fd);
+  if (waitpid(worker->pid, NULL, WNOHANG) == 0) { copy_orphan_add(worker->pid); }
+  worker->fd = -1;
+}
+
+// Remove a partially written destination without waiting for it (unlink can hang on the same mount).
+// Only regular files are removed -> FIFOs and device nodes were never "partial".
+static void
+remove_partial_file(Str8 path)
+{
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    struct stat st;
+    if (stat((char*)path.ptr, &st) == 0 && S_ISREG(st.st_mode)) { unlink((char*)path.ptr); }
+    _exit(0);
+  }
+  if (pid > 0) { copy_orphan_add(pid); }
+}
+
+// Stop a worker the deadline caught mid job, `idx` being the first destination it did not report.
+// Reports already sent are finished copies, the next destination is partial -> removed like a timed
+// out copy, unless journaled.
+static void
+copy_worker_abandon(CopyWorker *worker, Broadcast *job, uint64_t idx)
+{
+  if (worker->fd < 0) { return; }
+
+  kill(worker->pid, SIGKILL);
+  CopyReport report;
+  struct pollfd pfd = { .fd = worker->fd, .events = POLLIN };
+  while (idx < job->paths->count && poll(&pfd, 1, 0) > 0 && read(worker->fd, &report, sizeof(report)) == sizeof(report))
+  {
+    ++idx;
+  }
+  copy_worker_stop(worker);
+  if (idx < job->paths->count && (!job->journal || !job->journal->file))
+  {
+    remove_partial_file(str8_array_get(job->paths, idx));
+  }
+}
+
+// Wait up to `timeout_ms` for the copy of `paths[idx]`. Reports are read in order, so `idx` must
+// follow the one of the previous call until a COPY_TIMEOUT restarts the worker.
+static CopyStatus
+copy_worker_await(CopyWorker *worker, DirCache *dirs, Broadcast *job, uint64_t idx,
+                  uint64_t timeout_ms, CopyMetrics *metrics)
+{
+  Str8Array *paths = job->paths;
+  uint64_t start_us = os_now_us();
+
+  // Reap workers abandoned by earlier timeouts that have since died
+  copy_orphans_reap();
+
+  if (worker->fd < 0 && !copy_worker_spawn(worker, dirs, job, idx))
+  {
+    return COPY_FAILED;
+  }
+
+  struct pollfd pfd = { .fd = worker->fd, .events = POLLIN };
+  int32_t ready = poll(&pfd, 1, (timeout_ms > INT32_MAX) ? INT32_MAX : (int)timeout_ms);
+
+  if (ready > 0)
+  {
+    CopyReport report;
+    if (read(worker->fd, &report, sizeof(report)) == sizeof(report))
+    { // The worker's own zones die with it, rebuild them from the report
+      Str8 dest = str8_array_get(paths, idx);
+      trace_record("copy_file", worker->pid, report.start_us, report.metrics.open_us + report.metrics.xfer_us, dest);
+      trace_record("copy_open", worker->pid, report.start_us, report.metrics.open_us, (Str8){0});
+      trace_record("copy_write", worker->pid, report.start_us + report.metrics.open_us, report.metrics.xfer_us, (Str8){0});
+      if (report.hashed)
+      {
+        job->src_crc = report.crc;
+        job->src_hashed = 1;
+      }
+      *metrics = report.metrics;
+      return (CopyStatus)report.status;
+    }
+
+    copy_worker_stop(worker); // Worker died mid copy, restart from the next destination
+    metrics->err = ECHILD;
+    metrics->xfer_us = os_now_us() - start_us;
+    return COPY_FAILED;
+  }
+
+  copy_worker_stop(worker);
+  metrics->err = ETIMEDOUT;
+  metrics->xfer_us = os_now_us() - start_us; // Unknown split, charge it all to the transfer
+  if (!job->journal || !job->journal->file)
+  { // Journaled -> the partial file is what the next run resumes from
+    remove_partial_file(str8_array_get(paths, idx));
+  }
+  return COPY_TIMEOUT;
+}
+#endif
+
+
+//==================================================
+// Pipeline
+//==================================================
+
+// Circuit breaker -> skip recently failed destinations, probe the recovering ones last.
+// Return the number of destinations skipped.
+static uint64_t
+broadcast_partition(Broadcast *job)
+{
+  if (!job->health || !job->health->file) { return 0; }
+
+  // Compact the kept destinations in place, probes go to scratch and are appended at the end
+  TRACE_ZONE_BEGIN(health_zone, "health_partition");
+  Str8Array *paths = job->paths;
+  Scratch tmp = scratch_get(NULL, 0);
+  uint64_t *probe_offsets = (uint64_t*)arena_push(tmp.arena, paths->count*sizeof(uint64_t));
+  uint64_t *probe_sizes = (uint64_t*)arena_push(tmp.arena, paths->count*sizeof(uint64_t));
+  uint64_t amt_healthy = 0;
+  uint64_t amt_probes = 0;
+  uint64_t amt_skipped = 0;
+
+  for (uint64_t i = 0; i < paths->count; ++i)
+  {
+    Str8 path = str8_array_get(paths, i);
+    HealthSlot info;
+    HealthState state = health_check(job->health, path, &info);
+    if (state == HEALTH_OPEN)
+    {
+      uint64_t retry_in_s = (info.retry_at_ms - info.last_failure_ms) / 1000;
+      log_printf(job->log, LOG_WARN, "Circuit open: skipping \"%s\" (%" PRIu64 " consecutive failures, backoff %" PRIu64 "s)",
+                 (char*)path.ptr, info.failures, retry_in_s);
+      if (job->held) { str8_array_push(job->held, path); }
+      ++amt_skipped;
+      continue;
+    }
+
+    if (state == HEALTH_HALF_OPEN && probe_offsets && probe_sizes)
+    {
+      log_printf(job->log, LOG_INFO, "Circuit half-open: probing \"%s\" after the healthy destinations (%" PRIu64 " consecutive failures)",
+                 (char*)path.ptr, info.failures);
+      probe_offsets[amt_probes] = paths->offsets[i];
+      probe_sizes[amt_probes] = paths->sizes[i];
+      ++amt_probes;
+      continue;
+    }
+
+    paths->offsets[amt_healthy] = paths->offsets[i];
+    paths->sizes[amt_healthy] = paths->sizes[i];
+    ++amt_healthy;
+  }
+
+  for (uint64_t i = 0; i < amt_probes; ++i)
+  {
+    paths->offsets[amt_healthy + i] = probe_offsets[i];
+    paths->sizes[amt_healthy + i] = probe_sizes[i];
+  }
+  paths->count = amt_healthy + amt_probes;
+  scratch_end(tmp);
+  TRACE_ZONE_END(health_zone);
+  return amt_skipped;
+}
+
+// Journal -> drop the destinations a previous run completed, announce the ones it will resume.
+// Return the number of destinations dropped.
+static uint64_t
+broadcast_resume(Broadcast *job)
+{
+  if (!job->journal || !job->journal->file) { return 0; }
+
+  Str8Array *paths = job->paths;
+  uint64_t amt_kept = 0;
+  for (uint64_t i = 0; i < paths->count; ++i)
+  {
+    Str8 path = str8_array_get(paths, i);
+    JournalSlot *slot = journal_slot(job->journal, path);
+    if (slot && __atomic_load_n(&slot->done, __ATOMIC_ACQUIRE))
+    {
+      log_printf(job->log, LOG_INFO, "Already copied \"%s\" (journal)", (char*)path.ptr);
+      continue;
+    }
+    if (journal_resumes(slot))
+    {
+      log_printf(job->log, LOG_INFO, "Resuming \"%s\" from byte %" PRIu64 " (journal)", (char*)path.ptr, slot->committed);
+    }
+
+    paths->offsets[amt_kept] = paths->offsets[i];
+    paths->sizes[amt_kept] = paths->sizes[i];
+    ++amt_kept;
+  }
+
+  uint64_t amt_done = paths->count - amt_kept;
+  paths->count = amt_kept;
+  return amt_done;
+}
+
+static char *copy_backend_names[COPY_BACKEND_COUNT + 1] = { "rw", "mmap", "copy_file_range", "auto" };
+
+// CopyBackendId of a --backend name, -1 if unknown
+static int32_t
+copy_backend_find(Str8 name)
+{
+  for (int32_t i = 0; i <= COPY_BACKEND_COUNT; ++i)
+  {
+    if (str8_equals(str8_from_cstr(copy_backend_names[i]), name)) { return i; }
+  }
+  return -1;
+}
+
+// Open `src` for Broadcast.src_fd and start reading its head into the page cache, so the disk
+// works while the CSV is parsed and the destinations are opened. -1 if it can't be read.
+static int32_t
+broadcast_open_source(Str8 src)
+{
+#ifdef _WIN32
+  (void)src;
+  return -1; // CopyFile opens the source itself
+#else
+  int32_t fd = open((char*)src.ptr, O_RDONLY | O_CLOEXEC);
+#ifdef POSIX_FADV_WILLNEED
+  if (fd >= 0) { posix_fadvise(fd, 0, (off_t)COPY_PREFETCH_BYTES, POSIX_FADV_WILLNEED); } // Async, returns once queued
+#endif
+  return fd;
+#endif
+}
+
+// Which file `dest` is copied from -> the compressed source for the .lz4 destinations
+static Str8
+broadcast_source(Broadcast *job, Str8 dest)
+{
+  return (job->lz4_path.ptr && lz4_is_target(dest)) ? job->lz4_path : job->src;
+}
+
+// What a complete copy of `dest` reads back as -> 0 if not known (the source wasn't hashed)
+static int32_t
+broadcast_expected(Broadcast *job, Str8 dest, uint32_t *crc, uint64_t *size)
+{
+  if (job->lz4_path.ptr && lz4_is_target(dest))
+  {
+    *crc = job->lz4_crc;
+    *size = job->lz4_size;
+    return 1;
+  }
+
+  *crc = job->src_crc;
+  *size = job->src_size;
+  return job->src_hashed;
+}
+
+// Hash the source on its own when no copy read all of it (every copy of it resumed, or --timeout
+// workers that died before reporting) but some completed -> they can still be verified/listed.
+// Return job->src_hashed.
+static int32_t
+broadcast_hash_source(Broadcast *job)
+{
+  if (job->src_hashed || !job->checksum) { return job->src_hashed; }
+
+  int32_t copied = 0;
+  for (uint64_t i = 0; i < job->metrics->count && !copied; ++i)
+  {
+    MetricsDest *dest = &job->metrics->dests[i];
+    copied = (dest->copy.status == COPY_OK && broadcast_source(job, dest->path).ptr == job->src.ptr);
+  }
+  if (!copied) { return 0; }
+
+  uint64_t size;
+  TRACE_ZONE_BEGIN(hash_zone, "crc32c_source");
+  job->src_hashed = crc32c_file(job->src, &job->src_crc, &size) && size == job->src_size;
+  TRACE_ZONE_END(hash_zone);
+  if (!job->src_hashed)
+  {
+    log_printf(job->log, LOG_WARN, "Could not hash \"%s\" (unreadable, or changed while copying).", (char*)job->src.ptr);
+  }
+  return job->src_hashed;
+}
+
+// Compress the source once, into a temp file every .lz4 destination is copied from (a source
+// that already is .lz4 is copied as is). If that fails, the .lz4 destinations are recorded as
+// failed and left out of job->paths. Return 0 in that case.
+static int32_t
+broadcast_compress(Broadcast *job, Arena *arena)
+{
+  Str8Array *paths = job->paths;
+  uint64_t amt_targets = 0;
+  for (uint64_t i = 0; i < paths->count; ++i) { amt_targets += lz4_is_target(str8_array_get(paths, i)); }
+  if (amt_targets == 0 || lz4_is_target(str8_from_cstr((char*)job->src.ptr))) { return 1; }
+
+  TRACE_ZONE_BEGIN(lz4_zone, "lz4_compress");
+  uint64_t start_us = os_now_us();
+  int32_t err = 0;
+#ifdef _WIN32
+  char dir[MAX_PATH];
+  char name[MAX_PATH];
+  int32_t fd = -1;
+  if (GetTempPathA(MAX_PATH, dir) && GetTempFileNameA(dir, "bro", 0, name))
+  {
+    job->lz4_path = str8_push_copy_term(arena, str8_from_cstr(name));
+    fd = _open(name, _O_WRONLY | _O_TRUNC | _O_BINARY);
+  }
+#else
+  char *dir = getenv("TMPDIR");
+  job->lz4_path = str8_pushf(arena, "%s/brocopy-XXXXXX", (dir && dir[0]) ? dir : "/tmp");
+  int32_t fd = job->lz4_path.ptr ? mkostemp((char*)job->lz4_path.ptr, O_CLOEXEC) : -1;
+#endif
+  if (fd < 0 || !lz4_compress_file(job->src, fd, &job->lz4_crc, &job->lz4_size)) { err = errno ? errno : EIO; }
+  if (fd >= 0 && log_os_close(fd) != 0 && !err) { err = errno; }
+  TRACE_ZONE_END(lz4_zone);
+
+  if (!err)
+  {
+    uint64_t took_us = os_now_us() - start_us;
+    log_printf(job->log, LOG_INFO, "Compressed \"%s\" for %" PRIu64 " .lz4 destinations (%" PRIu64 " -> %" PRIu64 " bytes, %" PRIu64 ".%03" PRIu64 "ms)",
+               (char*)job->src.ptr, amt_targets, job->src_size, job->lz4_size, took_us / 1000, took_us % 1000);
+    return 1;
+  }
+
+  log_printf(job->log, LOG_ERROR, "Could not compress \"%s\" (error %d)", (char*)job->src.ptr, err);
+  if (job->lz4_path.ptr && fd >= 0) { remove((char*)job->lz4_path.ptr); }
+  job->lz4_path = (Str8){0};
+
+  uint64_t amt_kept = 0;
+  for (uint64_t i = 0; i < paths->count; ++i)
+  {
+    Str8 path = str8_array_get(paths, i);
+    if (lz4_is_target(path))
+    {
+      CopyMetrics copy = {0};
+      copy.err = err;
+      broadcast_record(job, path, &copy, COPY_FAILED);
+      continue;
+    }
+    paths->offsets[amt_kept] = paths->offsets[i];
+    paths->sizes[amt_kept] = paths->sizes[i];
+    ++amt_kept;
+  }
+  paths->count = amt_kept;
+  return 0;
+}
+
+// Outcome of one destination -> metrics, log and health file
+static void
+broadcast_record(Broadcast *job, Str8 dest_path, CopyMetrics *copy, CopyStatus result)
+{
+  copy->status = result;
+  metrics_record(job->metrics, dest_path, copy, result == COPY_OK);
+
+  if (result == COPY_OK)
+  {
+    char detail[64] = ""; // How it was copied, when that was chosen rather than fixed
+    int32_t len = 0;
+    if (copy->buf_kb) { len = snprintf(detail, sizeof(detail), ", tuned %uKB x%u", copy->buf_kb, copy->threads); }
+    if (job->backend != COPY_BACKEND_RW && copy->backend && len >= 0 && len < (int32_t)sizeof(detail))
+    {
+      snprintf(detail + len, sizeof(detail) - (uint64_t)len, ", via %s", copy_backend_names[copy->backend - 1]);
+    }
+    if (copy->fs_type)
+    {
+      log_printf(job->log, LOG_INFO, "Calibrated copy backends for filesystem type 0x%x on \"%s\": "
+                 "rw %uMB/s, mmap %uMB/s, copy_file_range %uMB/s -> %s", copy->fs_type, (char*)dest_path.ptr,
+                 copy->calibrated_kbps[COPY_BACKEND_RW] / 1024, copy->calibrated_kbps[COPY_BACKEND_MMAP] / 1024,
+                 copy->calibrated_kbps[COPY_BACKEND_RANGE] / 1024,
+                 copy->backend ? copy_backend_names[copy->backend - 1] : "rw");
+    }
+    log_printf(job->log, LOG_INFO, "\"%s\" copied to \"%s\" (%" PRIu64 " bytes, open %" PRIu64 ".%03" PRIu64 "ms, write %" PRIu64 ".%03" PRIu64 "ms%s)",
+               (char*)job->src.ptr, (char*)dest_path.ptr, copy->bytes,
+               copy->open_us / 1000, copy->open_us % 1000, copy->xfer_us / 1000, copy->xfer_us % 1000, detail);
+  }
+  else if (result == COPY_TIMEOUT)
+  {
+    log_printf(job->log, LOG_WARN, "Timed out copying \"%s\" to \"%s\" (abandoned)", (char*)job->src.ptr, (char*)dest_path.ptr);
+  }
+  else if (result == COPY_SKIPPED)
+  {
+    log_printf(job->log, LOG_WARN, "Skipped \"%s\" (job deadline of %" PRIu64 "ms expired)", (char*)dest_path.ptr, job->deadline_ms);
+  }
+  else
+  {
+    log_printf(job->log, LOG_ERROR, "Failed to copy \"%s\" to \"%s\" (error %d)",
+               (char*)job->src.ptr, (char*)dest_path.ptr, copy->err);
+  }
+
+  if (job->health && job->health->file && result != COPY_SKIPPED)
+  {
+    HealthSlot info;
+    health_record(job->health, dest_path, result == COPY_OK, &info);
+    if (result != COPY_OK)
+    {
+      uint64_t retry_in_s = (info.retry_at_ms - info.last_failure_ms) / 1000;
+      log_printf(job->log, LOG_WARN, "Circuit opened for \"%s\" (%" PRIu64 " consecutive failures, next probe in %" PRIu64 "s)",
+                 (char*)dest_path.ptr, info.failures, retry_in_s);
+    }
+    else if (info.failures > 0)
+    {
+      log_printf(job->log, LOG_INFO, "Circuit closed for \"%s\" (recovered after %" PRIu64 " failures)", (char*)dest_path.ptr, info.failures);
+    }
+  }
+}
+
+// Copy `src` to every path: the streams (backend.c) all at once in the background, the files in order.
+// Outcomes go to the log, the health file and the metrics. `arena` backs the directory cache
+// and the streams. Return the number of successful copies.
+static uint64_t
+broadcast_copy(Broadcast *job, Arena *arena)
+{
+  Str8Array *paths = job->paths;
+  CopyStatus result = COPY_FAILED;
+  CopyMetrics copy = {0};
+#ifdef _WIN32
+  struct _stat64 src_st;
+  job->src_size = (_stat64((char*)job->src.ptr, &src_st) == 0) ? (uint64_t)src_st.st_size : 0;
+#else
+  struct stat src_st;
+  int32_t src_stat = (job->src_fd >= 0) ? fstat(job->src_fd, &src_st) : stat((char*)job->src.ptr, &src_st);
+  job->src_size = (src_stat == 0) ? (uint64_t)src_st.st_size : 0;
+#endif
+  StreamWorker streams;
+  broadcast_streams_start(job, arena, &streams); // Fed in the background from here on -> the files are left
+  uint64_t amt_ok = 0;
+  broadcast_compress(job, arena);
+#ifndef _WIN32
+  CopyWorker worker = { .fd = -1 };
+  DirCache dirs = dircache_alloc(arena, job->mkdir);
+#endif
+  uint64_t deadline_at_ms = job->start_ms + job->deadline_ms;
+  job->checksum |= job->verify;
+  job->chunk_size = job->chunk_size ? job->chunk_size : COPY_CHUNK_SIZE;
+  job->chunk_threads = job->chunk_threads ? job->chunk_threads : COPY_CHUNK_THREADS;
+
+  for (uint64_t path_idx = 0; path_idx < paths->count; ++path_idx)
+  {
+    Str8 dest_path = str8_array_get(paths, path_idx); // Null terminated and normalized while parsing
+    uint64_t now_ms = os_now_us() / 1000;
+    copy = (CopyMetrics){0};
+    if (job->deadline_ms && now_ms >= deadline_at_ms)
+    {
+      result = COPY_SKIPPED;
+#ifndef _WIN32
+      copy_worker_abandon(&worker, job, path_idx); // Already writing the next destination, if any
+#endif
+    }
+    else
+    {
+#ifdef _WIN32
+      uint64_t start_us = os_now_us();
+      WIN32_FILE_ATTRIBUTE_DATA attr;
+      result = CopyFile((char*)broadcast_source(job, dest_path).ptr, (char*)dest_path.ptr, FALSE) ? COPY_OK : COPY_FAILED;
+      copy.xfer_us = os_now_us() - start_us; // No separate open step to time
+      if (result != COPY_OK) { copy.err = (int32_t)GetLastError(); }
+      else if (GetFileAttributesExA((char*)dest_path.ptr, GetFileExInfoStandard, &attr))
+      {
+        copy.bytes = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+      }
+      if (result == COPY_OK && job->checksum && !job->src_hashed)
+      { // CopyFile never hands us the bytes -> one extra read of the source, still only once
+        uint64_t src_size;
+        job->src_hashed = crc32c_file(job->src, &job->src_crc, &src_size);
+      }
+#else
+      if (job->timeout_ms || job->deadline_ms)
+      { // Effective timeout is whichever expires first: this destination's or the whole job's
+        uint64_t timeout_ms = job->timeout_ms;
+        if (job->deadline_ms && (timeout_ms == 0 || deadline_at_ms - now_ms < timeout_ms))
+        {
+          timeout_ms = deadline_at_ms - now_ms;
+        }
+        TRACE_ZONE_BEGIN(wait_zone, "copy_wait");
+        result = copy_worker_await(&worker, &dirs, job, path_idx, timeout_ms, &copy);
+        TRACE_ZONE_END_DETAIL(wait_zone, dest_path);
+      }
+      else
+      {
+        JournalSlot *slot = journal_slot(job->journal, dest_path);
+        int32_t raw = (broadcast_source(job, dest_path).ptr == job->src.ptr);
+        uint32_t *crc = (job->checksum && !job->src_hashed && !journal_resumes(slot) && raw) ? &job->src_crc : NULL;
+        result = copy_file(&dirs, job, dest_path, &copy, crc, slot, path_idx + 1 == paths->count) ? COPY_OK : COPY_FAILED;
+        job->src_hashed |= (crc && result == COPY_OK);
+      }
+#endif
+    }
+    amt_ok += (result == COPY_OK);
+    broadcast_record(job, dest_path, &copy, result);
+    amt_ok += broadcast_streams_collect(job, &streams, 0); // Streams that ended meanwhile
+  }
+  amt_ok += broadcast_streams_collect(job, &streams, 1);
+
+#ifndef _WIN32
+  copy_worker_stop(&worker);
+  dircache_release(&dirs);
+  if (job->src_fd >= 0)
+  { // No copy of the source itself took it
+    close(job->src_fd);
+    job->src_fd = -1;
+  }
+#endif
+  if (job->lz4_path.ptr) { remove((char*)job->lz4_path.ptr); } // Verification only needs its checksum
+  return amt_ok;
+}
+
+//==================================================
+// Verification
+//==================================================
+
+static void *
+verify_thread(void *param)
+{
+  VerifyTask *task = (VerifyTask*)param;
+  Metrics *metrics = task->job->metrics;
+
+  for (;;)
+  {
+    uint64_t idx = __atomic_fetch_add(&task->next, 1, __ATOMIC_RELAXED);
+    if (idx >= metrics->count) { break; }
+
+    MetricsDest *dest = &metrics->dests[idx];
+    uint32_t expected_crc;
+    uint64_t expected_size;
+    if (dest->copy.status != COPY_OK || !broadcast_expected(task->job, dest->path, &expected_crc, &expected_size)) { continue; }
+#ifndef _WIN32
+    struct stat st;
+    if (stat((char*)dest->path.ptr, &st) != 0 || !S_ISREG(st.st_mode)) { continue; }
+#endif
+
+    uint64_t size;
+    uint32_t *crc = &task->job->dest_crcs[idx];
+    if (!crc32c_file(dest->path, crc, &size))
+    {
+      task->verdicts[idx] = VERIFY_UNREADABLE;
+    }
+    else
+    {
+      task->verdicts[idx] = (*crc == expected_crc && size == expected_size) ? VERIFY_MATCH : VERIFY_MISMATCH;
+    }
+  }
+
+  return NULL;
+}
+
+// Read every copied destination back (on up to VERIFY_THREADS threads) and compare it with the
+// source's checksum, computed once while copying. Mismatches become COPY_MISMATCH and count as a
+// failure for the circuit breaker. Return the number of mismatches.
+static uint64_t
+broadcast_verify(Broadcast *job, Arena *arena)
+{
+  Metrics *metrics = job->metrics;
+  if (!job->verify || metrics->count == 0) { return 0; }
+  if (!broadcast_hash_source(job) && !job->lz4_path.ptr)
+  {
+    log_printf(job->log, LOG_WARN, "Nothing to verify, no destination was copied completely.");
+    return 0;
+  }
+
+  TRACE_ZONE_BEGIN(verify_zone, "verify");
+  VerifyTask task = {0};
+  task.job = job;
+  task.verdicts = (uint8_t*)arena_push(arena, metrics->count);
+  job->dest_crcs = (uint32_t*)arena_push(arena, metrics->count*sizeof(uint32_t));
+  if (!task.verdicts || !job->dest_crcs)
+  {
+    log_printf(job->log, LOG_WARN, "Could not verify the copies (arena full).");
+    job->dest_crcs = NULL;
+    TRACE_ZONE_END(verify_zone);
+    return 0;
+  }
+  memset(task.verdicts, 0, metrics->count);
+  memset(job->dest_crcs, 0, metrics->count*sizeof(uint32_t));
+
+#ifndef _WIN32
+  pthread_t threads[VERIFY_THREADS];
+  uint64_t amt_threads = 0;
+  uint64_t wanted = (metrics->count < VERIFY_THREADS) ? metrics->count : VERIFY_THREADS;
+  while (amt_threads + 1 < wanted && pthread_create(&threads[amt_threads], NULL, verify_thread, &task) == 0) { ++amt_threads; }
+  verify_thread(&task); // This thread takes a share too (and all of it if no thread could start)
+  for (uint64_t i = 0; i < amt_threads; ++i) { pthread_join(threads[i], NULL); }
+#else
+  verify_thread(&task);
+#endif
+
+  uint64_t amt_mismatches = 0;
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  {
+    MetricsDest *dest = &metrics->dests[i];
+    if (task.verdicts[i] == VERIFY_MATCH)
+    {
+      log_printf(job->log, LOG_INFO, "Verified \"%s\" (crc32c %08x)", (char*)dest->path.ptr, job->dest_crcs[i]);
+    }
+    else if (task.verdicts[i] == VERIFY_UNREADABLE)
+    {
+      log_printf(job->log, LOG_WARN, "Could not read \"%s\" back, left unverified", (char*)dest->path.ptr);
+    }
+    else if (task.verdicts[i] == VERIFY_MISMATCH)
+    {
+      uint32_t expected_crc;
+      uint64_t expected_size;
+      broadcast_expected(job, dest->path, &expected_crc, &expected_size);
+      log_printf(job->log, LOG_ERROR, "Checksum mismatch for \"%s\" (crc32c %08x, expected %08x)",
+                 (char*)dest->path.ptr, job->dest_crcs[i], expected_crc);
+      dest->copy.status = COPY_MISMATCH;
+      dest->copy.err = EIO;
+      ++amt_mismatches;
+      if (job->health && job->health->file)
+      {
+        HealthSlot info;
+        health_record(job->health, dest->path, 0, &info);
+      }
+      JournalSlot *slot = journal_slot(job->journal, dest->path);
+      if (slot)
+      { // Not a copy to resume from -> the next run starts it over
+        __atomic_store_n(&slot->done, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->committed, 0, __ATOMIC_RELEASE);
+      }
+    }
+  }
+
+  TRACE_ZONE_END(verify_zone);
+  return amt_mismatches;
+}
+
+// Append "crc32c  bytes  state  path" lines for the source and every copied destination to
+// `path`, in one write (several jobs may share the manifest, like the log)
+static int32_t
+broadcast_manifest(Broadcast *job, Str8 path)
+{
+  Metrics *metrics = job->metrics;
+  if (!broadcast_hash_source(job) && !job->lz4_path.ptr) { return 1; } // Nothing was copied completely
+
+  Scratch tmp = scratch_get(NULL, 0);
+  Str8Builder builder = str8_builder_begin(tmp.arena);
+  char line[64];
+
+  if (job->src_hashed)
+  {
+    snprintf(line, sizeof(line), "%08x  %llu  source  ", job->src_crc, (unsigned long long)job->src_size);
+    str8_builder_push(&builder, str8_from_cstr(line));
+    str8_builder_push(&builder, str8_from_cstr((char*)job->src.ptr)); // CLI args carry their terminator
+    str8_builder_push_char(&builder, '\n');
+  }
+
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  {
+    MetricsDest *dest = &metrics->dests[i];
+    uint32_t expected_crc;
+    uint64_t expected_size;
+    if ((dest->copy.status != COPY_OK && dest->copy.status != COPY_MISMATCH) ||
+        !broadcast_expected(job, dest->path, &expected_crc, &expected_size))
+    {
+      continue;
+    }
+
+    int32_t verified = job->dest_crcs && (dest->copy.status == COPY_MISMATCH || job->dest_crcs[i] == expected_crc);
+    char *state = (dest->copy.status == COPY_MISMATCH) ? "mismatch" : verified ? "verified" : "copied";
+    snprintf(line, sizeof(line), "%08x  %llu  %s  ", verified ? job->dest_crcs[i] : expected_crc,
+             (unsigned long long)expected_size, state);
+    str8_builder_push(&builder, str8_from_cstr(line));
+    str8_builder_push(&builder, dest->path);
+    str8_builder_push_char(&builder, '\n');
+  }
+
+  Str8 manifest = str8_builder_end(&builder, 0);
+  int32_t fd = manifest.ptr ? log_os_open((char*)path.ptr) : -1;
+  if (fd >= 0)
+  {
+    log_os_write_all(fd, manifest.ptr, manifest.size);
+    log_os_close(fd);
+  }
+
+  scratch_end(tmp);
+  return fd >= 0;
+}
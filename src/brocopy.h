@@ -2,147 +2,748 @@
 #ifndef BROCOPY_H
 #define BROCOPY_H
 
-#include <stdarg.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h> // memset and memcpy
-
-#ifdef _WIN32
-#define OS_SLASH '\\'
+#include "base.h"
+
+
+//==================================================
+// Checksum (CRC32C, SSE4.2 with runtime dispatch)
+//==================================================
+
+static uint32_t crc32c(uint32_t crc, uint8_t *ptr, uint64_t size);
+static uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t size2);
+static int32_t  crc32c_file(Str8 path, uint32_t *crc, uint64_t *size);
+
+
+//==================================================
+// Trace zones (Chrome trace export, -DBROCOPY_NO_TRACE removes them)
+//==================================================
+/*
+   TRACE_ZONE_BEGIN(zone, "name") ... TRACE_ZONE_END(zone) times a scope. Zones are only stored
+   after trace_enable(), so a disabled trace costs a clock read and a branch per zone.
+   trace_write() dumps them as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+*/
+
+#define TRACE_MAX_EVENTS (64*1024) /* Later zones are dropped */
+
+typedef struct TraceZone TraceZone;
+struct TraceZone
+{
+  char *name;
+  uint64_t start_us;
+};
+
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent
+{
+  char *name;
+  Str8 detail;  // Optional (destination path...), must outlive trace_write()
+  uint64_t start_us;
+  uint64_t dur_us;
+  int32_t pid;  // 0 = this process
+  uint32_t tid;
+};
+
+typedef struct Tracer Tracer;
+struct Tracer
+{
+  TraceEvent *events; // NULL while disabled
+  uint64_t count;     // Reserved with an atomic add, may exceed TRACE_MAX_EVENTS
+  uint32_t next_tid;
+  int32_t pid;
+};
+
+#ifndef BROCOPY_NO_TRACE
+#define TRACE_ZONE_BEGIN(zone, name) TraceZone zone = trace_zone_begin(name)
+#define TRACE_ZONE_END(zone) trace_zone_end(&(zone), (Str8){0})
+#define TRACE_ZONE_END_DETAIL(zone, detail) trace_zone_end(&(zone), (detail))
 #else
-#define OS_SLASH '/'
+#define TRACE_ZONE_BEGIN(zone, name)
+#define TRACE_ZONE_END(zone)
+#define TRACE_ZONE_END_DETAIL(zone, detail)
 #endif
 
+static int32_t trace_enable(void);
+static TraceZone trace_zone_begin(char *name);
+static void trace_zone_end(TraceZone *zone, Str8 detail);
+static void trace_record(char *name, int32_t pid, uint64_t start_us, uint64_t dur_us, Str8 detail);
+static int32_t trace_write(Str8 path);
+
 
 //==================================================
-// Inlined / Macros
+// Log (Atomic records on an O_APPEND fd)
 //==================================================
 
-// (double evaluation error prone)
-#define IS_UPPER(ch) ((ch) >= 'A' && (ch) <= 'Z')
-#define IS_LOWER(ch) ((ch) >= 'a' && (ch) <= 'z')
+#define LOG_RECORD_MAX 4096       /* Longer records are truncated */
+#define LOG_BUFFER_SIZE (64*1024) /* Whole records only -> one write() per flush */
+#define LOG_FLUSH_INTERVAL_MS 200 /* Background flusher period */
+#define LOG_SEP_LINE "==================================================\n"
 
-static inline uint64_t
-str_len(char *s)
+typedef enum LogLevel LogLevel;
+enum LogLevel
 {
-  char *p = s;
-  while (*p) ++p;
-  return p - s;
-}
+  LOG_INFO = 0,
+  LOG_WARN,
+  LOG_ERROR,
+};
 
-// 'A' = 0b0100 0001
-// 'a' = 0b0110 0001
-// Flip the bit 5 to lower A-Z
-static inline int32_t
-to_lower(int32_t ch)
+typedef struct Log Log;
+struct Log
 {
-  uint32_t is_cap = (ch >= 'A' && ch <= 'Z');
-  return ch | (is_cap << 5);
-}
+  int32_t fd;     // -1 -> records only go to stdout (if echo)
+  int32_t echo;   // Also print messages to stdout (--verbose)
+  int32_t json;   // JSON lines instead of the plain text layout
+  int32_t pid;
+  uint8_t *buf;   // Pending records
+  uint64_t size;
+#ifndef _WIN32
+  int32_t async;  // A background thread owns the write() calls
+  int32_t stop;
+  uint8_t *back;  // Buffer being written by the flusher
+  pthread_t flusher;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+#endif
+};
 
-static inline int32_t
-is_slash(int32_t ch)
+static int32_t log_open(Log *log, Str8 path, int32_t echo, int32_t json, int32_t async);
+static void log_printf(Log *log, LogLevel level, char *fmt, ...);
+static void log_job_begin(Log *log, int32_t argc, char **argv);
+static void log_job_end(Log *log);
+static void log_flush(Log *log);
+static void log_close(Log *log);
+
+
+//==================================================
+// Health cache (Destination circuit breaker)
+//==================================================
+
+#define HEALTH_MAGIC 0x31484c4842524f42ull /* "BROBHLH1" */
+#define HEALTH_SLOTS 4096
+#define HEALTH_BACKOFF_BASE_MS 5000         /* 5s after the first failure... */
+#define HEALTH_BACKOFF_MAX_MS (30*60*1000)  /* ...doubling up to 30min */
+
+// One slot per destination that ever failed, shared by every brocopy process through the mmap'd file.
+// Fields are only touched with atomics, `hash` == 0 marks a free slot.
+typedef struct HealthSlot HealthSlot;
+struct HealthSlot
 {
-  return (ch == '/' || ch == '\\');
-}
+  uint64_t hash;
+  uint64_t failures;
+  uint64_t last_failure_ms; // Wall clock, survives reboots
+  uint64_t retry_at_ms;     // Circuit is open until then
+};
+
+typedef struct HealthFile HealthFile;
+struct HealthFile
+{
+  uint64_t magic;
+  uint64_t slot_count;
+  HealthSlot slots[HEALTH_SLOTS];
+};
+
+typedef struct HealthCache HealthCache;
+struct HealthCache
+{
+  HealthFile *file; // NULL when disabled -> every destination is healthy
+};
+
+typedef enum HealthState HealthState;
+enum HealthState
+{
+  HEALTH_CLOSED = 0, // Healthy or unknown, copy normally
+  HEALTH_HALF_OPEN,  // Backoff elapsed, this process won the probe
+  HEALTH_OPEN,       // Failed recently, skip
+};
+
+static HealthCache health_open(Str8 path);
+static void health_close(HealthCache *cache);
+static HealthState health_check(HealthCache *cache, Str8 dest, HealthSlot *info);
+static void health_record(HealthCache *cache, Str8 dest, int32_t ok, HealthSlot *info);
 
 
 //==================================================
-// Arena (Simple arena implementation)
+// Metrics (Per destination timings + mmap'd latency histograms)
 //==================================================
-typedef struct Arena Arena;
-struct Arena
+
+#define STATS_MAGIC 0x3154535442524f42ull /* "BROBTST1" */
+#define STATS_SLOTS 1024
+#define STATS_NAME_SIZE 96                /* Tail of the destination path, for reports */
+#define STATS_SUB_BUCKETS 4               /* Linear steps per power of two... */
+#define STATS_BUCKETS (33*STATS_SUB_BUCKETS) /* ...from 1us up to ~4.7h */
+
+// How a sequential copy moves its bytes (copy_backends in broadcast.c)
+typedef enum CopyBackendId CopyBackendId;
+enum CopyBackendId
 {
-  uint8_t *base;
-  uint64_t size;
-  uint64_t pos;
+  COPY_BACKEND_RW = 0,                    // read/write through the (tuned) buffer, any kind of file
+  COPY_BACKEND_MMAP,                      // Source mapped in windows, written straight from the mapping
+  COPY_BACKEND_RANGE,                     // copy_file_range, in kernel (or reflinked) -> can't hash
+  COPY_BACKEND_COUNT,
+  COPY_BACKEND_AUTO = COPY_BACKEND_COUNT, // Calibrated once per filesystem type (statfs f_type)
+};
+
+// What a single destination copy cost
+typedef struct CopyMetrics CopyMetrics;
+struct CopyMetrics
+{
+  uint64_t open_us; // Source + destination open (includes mkdir)
+  uint64_t xfer_us; // Read/write loop + close
+  uint64_t bytes;   // Bytes written
+  int32_t err;      // errno (GetLastError on Windows) of the failed step, 0 if none
+  uint32_t status;  // Caller defined outcome (CopyStatus in main.c)
+  uint32_t buf_kb;  // Buffer and chunk threads picked by the tuner, 0 = not tuned
+  uint32_t threads;
+  uint32_t backend; // CopyBackendId + 1 of a sequential copy to a regular file, 0 = chunked (or not a file)
+  uint32_t fs_type; // statfs f_type of the destination, when this copy calibrated it (--backend auto)
+  uint32_t calibrated_kbps[COPY_BACKEND_COUNT]; // What each backend did then, 0 = could not run
+};
+
+typedef enum MetricsPhase MetricsPhase;
+enum MetricsPhase
+{
+  METRICS_PHASE_ARGS = 0, // Args, path checks and log setup
+  METRICS_PHASE_CSV,      // Buffer + parse the CSV
+  METRICS_PHASE_HEALTH,   // Circuit breaker partition
+  METRICS_PHASE_COPY,
+  METRICS_PHASE_CLEANUP,
+  METRICS_PHASE_COUNT,
+};
+
+typedef struct MetricsDest MetricsDest;
+struct MetricsDest
+{
+  Str8 path;
+  CopyMetrics copy;
 };
 
-static Arena arena_alloc(uint64_t size);
-static Arena arena_from_buffer(uint8_t *buffer, uint64_t size);
-static void * arena_push(Arena *arena, uint64_t size);
-static void arena_clear(Arena *arena);
-static void arena_free(Arena *arena);
+// One slot per destination, shared by every brocopy process through the mmap'd file.
+// Fields are only touched with atomics, `hash` == 0 marks a free slot.
+typedef struct StatsSlot StatsSlot;
+struct StatsSlot
+{
+  uint64_t hash;
+  uint64_t count;
+  uint64_t failures;
+  uint64_t bytes;
+  uint64_t total_us;
+  uint8_t name[STATS_NAME_SIZE];  // Written once by the process claiming the slot
+  uint32_t buckets[STATS_BUCKETS]; // Log-linear histogram of open_us + xfer_us
+};
+
+typedef struct StatsFile StatsFile;
+struct StatsFile
+{
+  uint64_t magic;
+  uint64_t slot_count;
+  StatsSlot slots[STATS_SLOTS];
+};
+
+typedef struct Metrics Metrics;
+struct Metrics
+{
+  MetricsDest *dests;
+  uint64_t count;
+  uint64_t capacity;
+  uint64_t phase_us[METRICS_PHASE_COUNT];
+  uint64_t mark_us;  // End of the last phase
+  StatsFile *stats;  // NULL when no --stats file is mapped
+};
+
+static Metrics metrics_begin(void);
+static void metrics_phase_end(Metrics *metrics, MetricsPhase phase);
+static void metrics_reserve(Metrics *metrics, Arena *arena, uint64_t count);
+static void metrics_record(Metrics *metrics, Str8 dest, CopyMetrics *copy, int32_t ok);
+static int32_t metrics_write(Metrics *metrics, Str8 path, char **status_names);
+static int32_t metrics_stats_open(Metrics *metrics, Str8 path);
+static void metrics_stats_close(Metrics *metrics);
 
 
 //==================================================
-// Scratch
+// Directory cache (Parent dir fds for openat + mkdir memo)
 //==================================================
 
-typedef struct Scratch Scratch;
-struct Scratch
+#define DIRCACHE_SLOTS 1024  /* Power of two */
+#define DIRCACHE_MAX_FDS 256 /* Stay well below the usual RLIMIT_NOFILE of 1024 */
+
+typedef struct DirEntry DirEntry;
+struct DirEntry
+{
+  uint64_t hash; // 0 = free slot
+  Str8 path;     // Null terminated
+  int32_t fd;    // O_PATH/O_DIRECTORY fd, -1 if not opened (yet, or failed)
+  int32_t known; // Directory is known to exist (opened or created by us)
+};
+
+typedef struct DirCache DirCache;
+struct DirCache
 {
   Arena *arena;
-  uint64_t origin_pos;
+  DirEntry *slots; // NULL when the arena had no room -> every open walks the full path
+  uint64_t count;
+  uint64_t open_fds;
+  int32_t mkdir;   // Create missing parent directories
 };
 
-static Scratch scratch_start(Arena *arena);
-static void scratch_end(Scratch scratch);
+static DirCache dircache_alloc(Arena *arena, int32_t mkdir);
+static int32_t dircache_open_file(DirCache *cache, Str8 path, int32_t truncate);
+static void dircache_release(DirCache *cache);
 
 
 //==================================================
-// Str8
+// Journal (Crash-resumable broadcast progress)
 //==================================================
-typedef struct Str8 Str8;
-struct Str8
+
+#define JOURNAL_MAGIC 0x314c4e4a42524f42ull /* "BROBJNL1" */
+#define JOURNAL_SLOTS 4096
+#define JOURNAL_COMMIT_BYTES (64ull << 20) /* Sync the destination and commit its offset every 64MB */
+
+// One slot per destination of the journaled job. Written by whichever process copies it
+// (workers included) through the shared mapping, so progress survives any of them dying.
+typedef struct JournalSlot JournalSlot;
+struct JournalSlot
 {
-  uint8_t *ptr;
-  uint64_t size;
+  uint64_t hash;      // str8_hash of the destination, 0 = free slot
+  uint64_t committed; // Bytes synced to the destination's storage -> a rerun resumes here
+  uint64_t done;      // Copy complete and synced -> a rerun skips it
 };
 
-typedef struct Str8Node Str8Node;
-struct Str8Node
+typedef struct JournalFile JournalFile;
+struct JournalFile
 {
-  Str8Node *next;
-  Str8 str;
+  uint64_t magic;
+  uint64_t slot_count;
+  uint64_t src_hash;     // Source identity (path, size, mtime) -> a different source
+  uint64_t src_size;     // restarts the journal from scratch
+  uint64_t src_mtime_ns;
+  JournalSlot slots[JOURNAL_SLOTS];
 };
 
-typedef struct Str8List Str8List;
-struct Str8List
+typedef struct Journal Journal;
+struct Journal
 {
-  Str8Node *head;
-  Str8Node *tail;
+  JournalFile *file; // NULL when disabled
 };
 
-#define str8_from_buf(buf)  (Str8){ (uint8_t *)(buf), sizeof(buf) }
-#define str8_from_lit(lit)  (Str8){ (uint8_t *)(lit), sizeof(lit) - 1 }
-#define str8_from_lit_term(lit)  (Str8){ (uint8_t *)(lit), sizeof(lit) }     /* Preserve null terminator */
-#define str8_from_cstr(ptr) (Str8){ (uint8_t *)(ptr), str_len(ptr) }         /* Assumes null terminated char* */
-#define str8_from_cstr_term(ptr) (Str8){ (uint8_t *)(ptr), str_len(ptr) + 1} /* Preserve null terminator */
+static Journal journal_open(Str8 path, Str8 src);
+static void journal_close(Journal *journal);
+static JournalSlot *journal_slot(Journal *journal, Str8 dest);
+static int32_t journal_resumes(JournalSlot *slot);
+static void journal_reset(Journal *journal);
 
-static Str8       str8_push(Arena *arena, uint64_t size);
-static Str8       str8_pushf(Arena *arena, char *fmt, ...);
-static Str8       str8_push_copy(Arena *arena, Str8 str);
-static Str8Node * str8_list_push(Arena *arena, Str8List *list);
-static Str8       str8_append(Arena *arena, Str8 lhs, Str8 rhs);
-static uint64_t   str8_snprintf(Str8 str, char *fmt, ...);
 
-static int32_t str8_equals(Str8 lhs, Str8 rhs);
-static int32_t str8_equals_insensitive(Str8 lhs, Str8 rhs);
-static int32_t str8_match(Str8 lhs, Str8 rhs, uint64_t n);
-static int32_t str8_match_insensitive(Str8 lhs, Str8 rhs, uint64_t n);
+//==================================================
+// Tuner (Copy parameters learned per destination device)
+//==================================================
 
-static uint64_t str8_index(Str8 str, uint8_t ch);
-static uint64_t str8_index_last(Str8 str, uint8_t ch);
-static uint64_t str8_index_last_slash(Str8 str);
-static uint64_t str8_index_substr(Str8 str, Str8 sub);
-static uint64_t str8_index_substr_last(Str8 str, Str8 sub);
+#define TUNE_MAGIC 0x324e555442524f42ull /* "BROBTUN2" */
+#define TUNE_SLOTS 1024
+#define TUNE_FS_SLOTS 64
+#define TUNE_BUF_MIN_SHIFT 16              /* Buffer sizes from 64KB... */
+#define TUNE_BUF_STEPS 8                   /* ...doubling up to 8MB */
+#define TUNE_THREAD_STEPS 7                /* 1, 2, 4 ... 64 chunk threads (1 = sequential copy) */
+#define TUNE_EXPLORE_EVERY 8               /* One sample in 8 tries a neighbour of the best setting */
+#define TUNE_SAMPLE_MIN_BYTES (1ull << 20) /* Smaller copies measure open latency, not throughput */
 
-static Str8 str8_skip(Str8 str, uint64_t n);
-static Str8 str8_prefix(Str8 str, uint64_t n);
-static Str8 str8_postfix(Str8 str, uint64_t n);
+// One slot per destination device (st_dev), shared by every brocopy process through the mmap'd file.
+// Rates are EWMAs in KB/s, 0 = never tried. Races between processes only lose a sample.
+typedef struct TuneSlot TuneSlot;
+struct TuneSlot
+{
+  uint64_t hash;                            // Of the device, 0 = free slot
+  uint64_t samples;                         // Measured copies, drives the exploration
+  uint32_t buf_rates[TUNE_BUF_STEPS];       // Per buffer size
+  uint32_t thread_rates[TUNE_THREAD_STEPS]; // Per chunk thread count, copies big enough to chunk only
+};
+
+// Copy backend calibrated for a filesystem type (--backend auto)
+typedef struct TuneFs TuneFs;
+struct TuneFs
+{
+  uint64_t hash;    // Of the statfs f_type, 0 = free slot
+  uint64_t backend; // CopyBackendId + 1, 0 = not calibrated yet
+};
+
+typedef struct TuneFile TuneFile;
+struct TuneFile
+{
+  uint64_t magic;
+  uint64_t slot_count;
+  TuneSlot slots[TUNE_SLOTS];
+  TuneFs fs[TUNE_FS_SLOTS];
+};
+
+typedef struct Tuner Tuner;
+struct Tuner
+{
+  TuneFile *file; // NULL when disabled -> fixed buffers, every chunk thread, calibrations kept per process
+};
+
+// Parameters of one copy, handed back to tune_record with its throughput
+typedef struct TuneChoice TuneChoice;
+struct TuneChoice
+{
+  TuneSlot *slot;       // NULL = nothing to learn from this copy
+  uint64_t buf_size;    // 0 = the copy loop's own default
+  uint32_t threads;     // Chunk threads, 1 = sequential
+  uint32_t buf_step;
+  uint32_t thread_step;
+  int32_t chunkable;    // Big enough to chunk -> the thread count was part of the choice
+};
 
-static Str8 str8_buffer_file(Arena *arena, Str8 path);
-static void str8_normalize_slash(Str8 str);
+static Tuner tune_open(Str8 path);
+static void tune_close(Tuner *tuner);
+static void tune_pick(Tuner *tuner, uint64_t dev, uint64_t blksize, uint64_t size, int32_t chunkable,
+                      uint32_t max_threads, TuneChoice *choice);
+static void tune_record(TuneChoice *choice, uint64_t bytes, uint64_t xfer_us);
+static uint32_t tune_fs_backend(Tuner *tuner, uint64_t fs_type);
+static void tune_fs_calibrated(Tuner *tuner, uint64_t fs_type, uint32_t backend);
 
 
 //==================================================
-// C Strings
+// LZ4 (Frame encoder for compressed destinations)
 //==================================================
 
-int32_t str_match(char *str0, char *str1, int32_t len, int32_t insensitive);
-uint32_t str_append(char *buf, char *s, uint32_t size);
-char *index(char *buf_p, char ch);
+#define LZ4_BLOCK_SIZE (4ull << 20) /* Frame block maximum size 7 */
+#define LZ4_BLOCK_BOUND(size) ((size) + (size)/255 + 16)
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_LAST_LITERALS 5 /* A block ends with at least 5 literals */
+#define LZ4_MF_LIMIT 12     /* and its last match starts at least 12 bytes before its end */
+
+// Streaming XXH32 (the frame's header and content checksums)
+typedef struct Xxh32 Xxh32;
+struct Xxh32
+{
+  uint32_t v[4];
+  uint64_t total;
+  uint8_t tail[16]; // Bytes short of a 16 byte stripe
+  uint32_t tail_size;
+};
+
+static Xxh32 xxh32_begin(uint32_t seed);
+static void xxh32_update(Xxh32 *state, uint8_t *ptr, uint64_t size);
+static uint32_t xxh32_end(Xxh32 *state);
+static uint64_t lz4_compress_block(uint8_t *src, uint64_t size, uint8_t *dest, uint32_t *table);
+static int32_t lz4_is_target(Str8 path);
+static int32_t lz4_compress_file(Str8 src, int32_t dest_fd, uint32_t *crc, uint64_t *size);
+
+//==================================================
+// Broadcast (Routing table + copy pipeline shared by main.c and libbrocopy.c)
+//==================================================
+
+#define ROUTES_MAX_KEYS 1000 /* Per job, and rows taken by an all paths job */
+
+// Outcome of a destination copy -> also what a CopyWorker reports through its pipe
+typedef enum CopyStatus CopyStatus;
+enum CopyStatus
+{
+  COPY_FAILED = 0,
+  COPY_OK,
+  COPY_TIMEOUT,
+  COPY_SKIPPED,  // Never attempted, job deadline already expired
+  COPY_MISMATCH, // Copied, but reading it back did not give the source's checksum
+};
+
+// Child process copying the destinations of a list, starting at some node, and reporting
+// one CopyStatus per destination. Lets the parent abandon a copy stuck in open/write.
+typedef struct CopyWorker CopyWorker;
+struct CopyWorker
+{
+#ifndef _WIN32
+  pid_t pid;
+#endif
+  int32_t fd; // Read end of the report pipe, -1 when no worker is running
+};
+
+// What a CopyWorker writes per destination -> well under PIPE_BUF, so reads never see half of one
+typedef struct CopyReport CopyReport;
+struct CopyReport
+{
+  uint32_t status;
+  uint64_t start_us; // Same clock as the parent -> lets it trace the worker's copies
+  uint32_t hashed;   // `crc` is the source's CRC32C (hashed while copying it)
+  uint32_t crc;
+  CopyMetrics metrics;
+};
+
+#define COPY_CHUNK_SIZE (64ull << 20) /* Default range per thread of a chunked copy */
+#define COPY_CHUNK_THREADS 4          /* Default threads per chunked copy, 1 = always sequential */
+#define COPY_CHUNK_THREADS_MAX 64
+#define COPY_BEHIND_WINDOW (8ull << 20) /* --nocache: writeback started per 8MB, dropped one window later */
+#define COPY_PREFETCH_BYTES (8ull << 20) /* Head of the source read ahead while the CSV is parsed */
+#define COPY_MMAP_WINDOW (64ull << 20)    /* Source mapped this much at a time */
+#define COPY_RANGE_STEP (8ull << 20)      /* Per copy_file_range call -> journal and --nocache keep up */
+#define COPY_CALIBRATE_BYTES (4ull << 20) /* Slice copied by each backend to calibrate a filesystem */
+
+#ifndef _WIN32
+// --nocache write-behind of one sequential stream: [dropped, kicked) is being written back by the
+// kernel while we fill [kicked, offset), and is dropped from the page cache once that window is full
+typedef struct CopyBehind CopyBehind;
+struct CopyBehind
+{
+  uint64_t dropped;
+  uint64_t kicked;
+};
+
+// A sequential copy, moved by one of the copy_backends. Both file offsets sit at `offset`, so a
+// copy can switch backends midway (calibration, fallback when one isn't supported).
+typedef struct CopyRun CopyRun;
+struct CopyRun
+{
+  int32_t src_fd;
+  int32_t dest_fd;
+  uint64_t offset;
+  uint64_t end;       // Stop here, UINT64_MAX = at EOF
+  uint64_t size;      // Regular source -> its size when opened, 0 otherwise
+  uint8_t *buf;
+  uint64_t buf_size;  // Read/write granularity
+  uint32_t *crc;      // Running CRC32C of the source, NULL = not hashing
+  JournalSlot *slot;  // Journaled -> offsets committed every JOURNAL_COMMIT_BYTES synced
+  uint64_t commit_at;
+  int32_t nocache;    // Write-behind through `behind`, dropping `drop_fd` too (-1 = keep the source)
+  int32_t drop_fd;
+  CopyBehind behind;
+  uint64_t bytes;     // Written
+  int32_t err;
+};
+
+// 1 = reached `end` (or EOF), 0 = failed (`err`), -1 = can't work here and copied nothing
+typedef int32_t CopyBackendFn(CopyRun *run);
+
+typedef struct CopyBackend CopyBackend;
+struct CopyBackend
+{
+  CopyBackendFn *copy;
+  int32_t hashes; // Sees the bytes -> usable while hashing the source
+};
+
+// One regular file copied as ranges of `chunk_size` by several threads (pread/pwrite into a
+// destination already sized to the source). Sources under two chunks are copied sequentially.
+typedef struct CopyChunks CopyChunks;
+struct CopyChunks
+{
+  int32_t src_fd;
+  int32_t dest_fd;
+  uint64_t start;       // First byte to copy (a resumed copy starts at its committed offset)
+  uint64_t end;         // Source size
+  uint64_t chunk_size;
+  uint64_t chunk_count;
+  uint64_t buf_size;    // Per thread, 0 = the default stack buffer
+  uint64_t next;        // Atomic, next chunk to claim
+  uint64_t bytes;       // Atomic, bytes written
+  int32_t err;          // Atomic, errno of the first failure -> the other threads stop
+  uint32_t *crcs;       // CRC32C per chunk, combined in order at the end. NULL = not hashing
+  JournalSlot *slot;    // Journaled -> the written prefix is committed as chunks complete
+  uint8_t *done;        // Per chunk, under `lock`
+  uint64_t done_prefix; // Chunks [0, done_prefix) are written, under `lock`
+  uint64_t commit_at;   // Next offset worth a commit, under `lock`
+  int32_t nocache;      // Drop written chunks from the page cache (and read ones if `drop_src`)
+  int32_t drop_src;
+  pthread_mutex_t lock;
+};
+#endif
+
+// The CSV, buffered once. Matching scans it row by row, unless it was indexed (loaded once
+// and matched many times) -> then each key is a binary search over the rows.
+typedef struct Routes Routes;
+struct Routes
+{
+  Str8 csv;       // Rows only, header skipped
+  uint64_t *rows; // Row start offsets into `csv`, sorted by key (insensitive). NULL = not indexed
+  uint64_t count;
+};
+
+// One job: copy `src` to every path, with the circuit breaker, timeouts and metrics
+typedef struct Broadcast Broadcast;
+struct Broadcast
+{
+  Str8 src;               // Null terminated
+  int32_t src_fd;         // Open `src` from broadcast_open_source, taken by its first copy. -1 = none
+  Str8Array *paths;       // Null terminated and normalized, reordered by broadcast_partition
+  uint64_t timeout_ms;    // Per destination, 0 = no timeout
+  uint64_t deadline_ms;   // Whole job (from `start_ms`), 0 = no deadline
+  uint64_t start_ms;      // os_now_us()/1000 at the start of the job
+  int32_t mkdir;
+  Log *log;
+  HealthCache *health;    // Unmapped = no circuit breaker
+  Metrics *metrics;       // Per destination results (reserve paths->count) + stats
+  int32_t checksum;       // Hash the source while copying it (once) -> src_crc
+  int32_t verify;         // Read copied destinations back and compare against src_crc (implies checksum)
+  int32_t src_hashed;     // `src_crc` is known
+  uint32_t src_crc;
+  uint32_t *dest_crcs;    // Read back CRC32C per metrics->dests entry, set by broadcast_verify
+  Journal *journal;       // Unmapped = no journal
+  uint64_t chunk_size;    // Chunked copies of big regular files, 0 = COPY_CHUNK_SIZE
+  uint32_t chunk_threads; // 0 = COPY_CHUNK_THREADS, 1 = sequential
+  int32_t nocache;        // Keep copies out of the page cache (write-behind + DONTNEED)
+  Tuner *tune;            // Unmapped = fixed buffers and `chunk_threads`, otherwise its upper bound
+  uint32_t backend;       // CopyBackendId of sequential copies, 0 = read/write
+  Str8Array *held;        // Receives the destinations broadcast_partition skipped, NULL = dropped
+  uint64_t src_size;      // Set by broadcast_copy
+  Str8 lz4_path;          // Source compressed once for every .lz4 destination (temp file), empty = none
+  uint32_t lz4_crc;       // CRC32C and size of that frame -> what its copies must read back as
+  uint64_t lz4_size;
+};
+
+#define VERIFY_THREADS 8
+
+typedef enum VerifyVerdict VerifyVerdict;
+enum VerifyVerdict
+{
+  VERIFY_SKIPPED = 0, // Not copied, or not a regular file (FIFOs can't be read back)
+  VERIFY_MATCH,
+  VERIFY_MISMATCH,
+  VERIFY_UNREADABLE,
+};
+
+// Shared by the verify threads, each claims the next destination
+typedef struct VerifyTask VerifyTask;
+struct VerifyTask
+{
+  Broadcast *job;
+  uint8_t *verdicts; // VerifyVerdict per metrics->dests entry
+  uint64_t next;     // Atomic
+};
+
+static Routes routes_from_csv(Str8 csv);
+static int32_t routes_index(Routes *routes, Arena *arena);
+static uint64_t routes_match(Routes *routes, Str8Array *keys, Str8Array *paths);
+static uint64_t routes_all(Routes *routes, Str8Array *paths, uint64_t max);
+static int32_t broadcast_open_source(Str8 src);
+static int32_t copy_backend_find(Str8 name);
+static uint64_t broadcast_partition(Broadcast *job);
+static uint64_t broadcast_resume(Broadcast *job);
+static Str8 broadcast_source(Broadcast *job, Str8 dest);
+static int32_t broadcast_expected(Broadcast *job, Str8 dest, uint32_t *crc, uint64_t *size);
+static int32_t broadcast_hash_source(Broadcast *job);
+static int32_t broadcast_compress(Broadcast *job, Arena *arena);
+static uint64_t broadcast_copy(Broadcast *job, Arena *arena);
+static uint64_t broadcast_verify(Broadcast *job, Arena *arena);
+static int32_t broadcast_manifest(Broadcast *job, Str8 path);
+
+
+//==================================================
+// Backends (fifo:, exec:, unix: stream destinations)
+//==================================================
+
+#define STREAM_SEND_MAX (1ull << 20) /* Per wakeup and destination -> a fast consumer can't starve the others */
+#define STREAM_RETRY_MS 10           /* Poll interval while a FIFO has no reader or a command is exiting */
+#define STREAM_EVENTS 64
+#define STREAM_IDLE_MAX_MS 30000     /* Without -t: a stream that makes no progress (no reader, nothing accepted) this long is abandoned */
+
+typedef enum StreamState StreamState;
+enum StreamState
+{
+  STREAM_OPENING = 0, // No reader on the FIFO yet, or the socket is still connecting
+  STREAM_SENDING,
+  STREAM_EXITING,     // exec: all sent, waiting for the command's exit status
+  STREAM_DONE,
+};
+
+// A destination fed by the event loop: non-blocking, zero copy where the kernel allows it
+typedef struct DestStream DestStream;
+struct DestStream
+{
+  Str8 path;         // As in the CSV, scheme included
+  Str8 target;       // After the scheme -> FIFO path, shell command or socket path
+  uint32_t backend;  // Index into dest_backends
+  uint32_t state;    // StreamState
+  int32_t fd;        // -1 when closed
+#ifndef _WIN32
+  pid_t pid;         // exec: the command, 0 = none
+#endif
+  int32_t exit_code; // exec: non-zero exit status (128 + signal if killed)
+  uint64_t offset;   // Bytes of the source sent
+  uint64_t start_us;
+  uint64_t progress_us; // Last open, send or EOF -> STREAM_IDLE_MAX_MS counts from there
+  CopyMetrics copy;
+};
+
+// The URI scheme of a destination decides how it is opened, fed and finished. Each call
+// returns 1 = done, 0 = failed (stream->copy.err set), -1 = would block, call again later.
+typedef struct DestBackend DestBackend;
+struct DestBackend
+{
+  char *scheme;
+  int32_t (*open)(DestStream *stream);
+  int32_t (*send)(DestStream *stream, int32_t src_fd, uint64_t src_size);
+  int32_t (*finish)(DestStream *stream);
+};
+
+// Child process feeding every stream of a job while the parent copies the files. Reports one
+// StreamReport per stream, in the order they end.
+typedef struct StreamWorker StreamWorker;
+struct StreamWorker
+{
+  DestStream *streams;  // The parent's copy -> STREAM_DONE once recorded
+  uint64_t count;
+  uint64_t amt_pending; // Not recorded yet
+#ifndef _WIN32
+  pid_t pid;
+#endif
+  int32_t fd;           // Read end of the report pipe, -1 when no worker is running
+};
+
+// What a StreamWorker writes per stream -> well under PIPE_BUF, like a CopyReport
+typedef struct StreamReport StreamReport;
+struct StreamReport
+{
+  uint64_t idx;       // Into StreamWorker.streams
+  uint32_t status;    // CopyStatus
+  int32_t exit_code;  // exec: non-zero exit status
+  uint64_t start_us;  // Same clock as the parent -> lets it trace the stream
+  CopyMetrics copy;
+};
+
+static int32_t dest_backend_find(Str8 path);
+static void broadcast_record(Broadcast *job, Str8 dest_path, CopyMetrics *copy, CopyStatus result);
+static void broadcast_streams_start(Broadcast *job, Arena *arena, StreamWorker *worker);
+static uint64_t broadcast_streams_collect(Broadcast *job, StreamWorker *worker, int32_t wait);
+
+
+//==================================================
+// Spool (Failed destinations retried in the background, --drain)
+//==================================================
+
+#define SPOOL_HEADER "brocopy-spool 1"
+#define SPOOL_BACKOFF_BASE_MS 30000       /* 30s after the failed broadcast... */
+#define SPOOL_BACKOFF_MAX_MS (60*60*1000) /* ...doubling up to 1h */
+#define SPOOL_ATTEMPTS_MAX 16             /* Then the destination is given up (logged) */
+#define SPOOL_DRAIN_THREADS 4             /* Spooled jobs retried at once (--drain-concurrency) */
+#define SPOOL_POLL_MAX_MS 60000           /* Longest --drain sleep -> newly spooled jobs get noticed */
+#define SPOOL_ARENA_RESERVE (4ull << 30)  /* Per retried job: its file, paths, metrics, directory cache */
+
+// One destination left to copy -> a "dest <attempts> <next_at_ms> <path>" line of its job file
+typedef struct SpoolDest SpoolDest;
+struct SpoolDest
+{
+  Str8 path;
+  uint64_t attempts;   // Failed so far, the original broadcast included
+  uint64_t next_at_ms; // Wall clock, survives reboots
+};
+
+// <dir>/<id>.job: where the snapshot of the source is (<dir>/<id>.src) and its destinations left
+typedef struct SpoolJob SpoolJob;
+struct SpoolJob
+{
+  Str8 src;  // Snapshot
+  Str8 orig; // Source it was taken from, for the log
+  SpoolDest *dests;
+  uint64_t count;
+};
+
+// One --drain round: the due job files, claimed by the drain threads
+typedef struct SpoolDrain SpoolDrain;
+struct SpoolDrain
+{
+  Broadcast *proto; // Options of every retry (log, health, timeouts...)
+  Str8Array jobs;
+  uint64_t next;    // Atomic
+  uint64_t retried; // Atomic, jobs actually retried (not locked by another drain)
+};
+
+static uint64_t spool_push(Str8 dir, Broadcast *job);
+static int32_t spool_drain(Str8 dir, Broadcast *proto, uint32_t threads);
 
 #endif // BROCOPY_H
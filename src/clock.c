@@ -0,0 +1,39 @@
+#ifndef BROCOPY_BASE_H
+#include "base.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Clock
+//==================================================
+
+// Monotonic microseconds, only meaningful as a difference (timeouts, metrics, trace zones)
+static uint64_t
+os_now_us(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter, freq;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&freq);
+  return (uint64_t)(counter.QuadPart / freq.QuadPart)*1000000 + (uint64_t)(counter.QuadPart % freq.QuadPart)*1000000 / freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000;
+#endif
+}
+
+// Wall clock milliseconds since the epoch -> what files shared across processes and reboots store
+static uint64_t
+os_wall_ms(void)
+{
+#ifdef _WIN32
+  FILETIME ft;
+  GetSystemTimeAsFileTime(&ft);
+  uint64_t ticks = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime; // 100ns since 1601
+  return ticks/10000 - 11644473600000ull;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec*1000 + (uint64_t)ts.tv_nsec/1000000;
+#endif
+}
@@ -1,5 +1,5 @@
-#ifndef BROCOPY_H
-#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#ifndef BROCOPY_BASE_H
+#include "base.h" // only to make it possible to use -fsyntax-only
 #endif
 
 // Return 1 if the cstrings match up to `len` chars, zero otherwise
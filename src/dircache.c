@@ -0,0 +1,136 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Directory cache (Parent dir fds for openat + mkdir memo)
+//==================================================
+/*
+   Destinations tend to live under a handful of (deep) directories. Each parent is resolved
+   once into an O_PATH fd and files are created relative to it with openat(), so the kernel
+   only walks the last component per destination. The same table memoizes directories known
+   to exist, so --mkdir only calls mkdir() for components it hasn't seen yet.
+*/
+
+#ifndef _WIN32
+
+#ifndef O_PATH
+#define O_PATH O_RDONLY // Non Linux -> a plain read-only directory fd works the same for openat
+#endif
+
+static DirCache
+dircache_alloc(Arena *arena, int32_t mkdir)
+{
+  DirCache cache = {0};
+  cache.arena = arena;
+  cache.mkdir = mkdir;
+  cache.slots = (DirEntry*)arena_push(arena, DIRCACHE_SLOTS*sizeof(DirEntry));
+  if (cache.slots) { memset(cache.slots, 0, DIRCACHE_SLOTS*sizeof(DirEntry)); }
+  return cache;
+}
+
+// Find (or insert) the entry for `dir` -> NULL if the cache is disabled or full
+static DirEntry *
+dircache_entry(DirCache *cache, Str8 dir)
+{
+  if (!cache->slots) { return NULL; }
+
+  uint64_t hash = str8_hash(dir);
+  for (uint64_t i = 0; i < DIRCACHE_SLOTS; ++i)
+  {
+    DirEntry *entry = &cache->slots[(hash + i) & (DIRCACHE_SLOTS - 1)];
+    if (entry->hash == hash && str8_equals(entry->path, dir)) { return entry; }
+    if (entry->hash == 0)
+    {
+      if (cache->count >= DIRCACHE_SLOTS / 2) { return NULL; } // Keep probes short
+
+      Str8 path = str8_push_copy_term(cache->arena, dir);
+      if (!path.ptr) { return NULL; }
+
+      entry->hash = hash;
+      entry->path = path;
+      entry->fd = -1;
+      entry->known = 0;
+      ++cache->count;
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+// mkdir -p `dir` (a mutable, null terminated copy), skipping every component already known to exist
+static void
+dircache_mkdir_parents(DirCache *cache, Str8 dir)
+{
+  for (uint64_t i = 1; i <= dir.size; ++i)
+  {
+    if (i < dir.size && dir.ptr[i] != OS_SLASH) { continue; }
+
+    DirEntry *entry = dircache_entry(cache, str8_prefix(dir, i));
+    if (entry && entry->known) { continue; }
+
+    dir.ptr[i] = '\0';
+    int32_t ok = (mkdir((char*)dir.ptr, 0777) == 0 || errno == EEXIST);
+    if (i < dir.size) { dir.ptr[i] = OS_SLASH; }
+
+    if (!ok) { break; }
+    if (entry) { entry->known = 1; }
+  }
+}
+
+// Open `path` for writing (create, truncate unless resuming) relative to its cached parent -> fd or -1 (errno set)
+static int32_t
+dircache_open_file(DirCache *cache, Str8 path, int32_t truncate)
+{
+  int32_t flags = O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0);
+  uint64_t slash = (path.size > 0) ? str8_index_last(path, OS_SLASH) : path.size;
+  if (slash >= path.size) { return open((char*)path.ptr, flags, 0666); } // Relative to cwd already
+
+  Str8 dir = str8_prefix(path, (slash == 0) ? 1 : slash); // "/file" -> parent is "/"
+  Str8 name = str8_skip(path, slash + 1);
+
+  DirEntry *entry = dircache_entry(cache, dir);
+  if (entry && entry->fd < 0 && cache->open_fds < DIRCACHE_MAX_FDS)
+  {
+    entry->fd = open((char*)entry->path.ptr, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (entry->fd < 0 && errno == ENOENT && cache->mkdir)
+    {
+      dircache_mkdir_parents(cache, entry->path);
+      entry->fd = open((char*)entry->path.ptr, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+
+    if (entry->fd >= 0)
+    {
+      entry->known = 1;
+      ++cache->open_fds;
+    }
+  }
+
+  if (entry && entry->fd >= 0)
+  {
+    return openat(entry->fd, (char*)name.ptr, flags, 0666);
+  }
+
+  // No fd to spare (or the parent couldn't be opened) -> full path lookup
+  if (cache->mkdir && !(entry && entry->known))
+  {
+    Str8 dir_copy = entry ? entry->path : str8_push_copy_term(cache->arena, dir);
+    if (dir_copy.ptr) { dircache_mkdir_parents(cache, dir_copy); }
+  }
+  return open((char*)path.ptr, flags, 0666);
+}
+
+static void
+dircache_release(DirCache *cache)
+{
+  for (uint64_t i = 0; cache->slots && i < DIRCACHE_SLOTS; ++i)
+  {
+    if (cache->slots[i].fd >= 0 && cache->slots[i].hash != 0) { close(cache->slots[i].fd); }
+  }
+  cache->slots = NULL;
+  cache->count = 0;
+  cache->open_fds = 0;
+}
+
+#endif
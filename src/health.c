@@ -0,0 +1,177 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Health cache (Destination circuit breaker)
+//==================================================
+/*
+   Closed    -> copy. A failure opens the circuit for HEALTH_BACKOFF_BASE_MS << (failures - 1).
+   Open      -> skip until `retry_at_ms`.
+   Half-open -> backoff elapsed: the first process to CAS `retry_at_ms` forward probes the
+                destination, concurrent jobs keep seeing it open until the probe reports back.
+*/
+
+#ifndef _WIN32
+
+static uint64_t
+health_backoff_ms(uint64_t failures)
+{
+  if (failures == 0) { return 0; }
+  uint64_t shift = failures - 1;
+  if (shift > 20) { return HEALTH_BACKOFF_MAX_MS; }
+
+  uint64_t backoff = (uint64_t)HEALTH_BACKOFF_BASE_MS << shift;
+  return (backoff > HEALTH_BACKOFF_MAX_MS) ? HEALTH_BACKOFF_MAX_MS : backoff;
+}
+
+// Linear probe for `hash` -> claim a free slot when `claim` is set, NULL if absent (or table full)
+static HealthSlot *
+health_slot(HealthFile *file, uint64_t hash, int32_t claim)
+{
+  for (uint64_t i = 0; i < HEALTH_SLOTS; ++i)
+  {
+    HealthSlot *slot = &file->slots[(hash + i) % HEALTH_SLOTS];
+    uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+    if (slot_hash == hash) { return slot; }
+    if (slot_hash == 0)
+    {
+      if (!claim) { return NULL; }
+
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+          expected == hash)
+      {
+        return slot;
+      }
+      // Lost the slot to another destination, keep probing
+    }
+  }
+
+  return NULL;
+}
+
+static HealthCache
+health_open(Str8 path)
+{
+  HealthCache cache = {0};
+
+  int fd = open((char*)path.ptr, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) { return cache; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size < sizeof(HealthFile) && ftruncate(fd, sizeof(HealthFile)) != 0))
+  {
+    close(fd);
+    return cache;
+  }
+
+  void *map = mmap(NULL, sizeof(HealthFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file referenced
+  if (map == MAP_FAILED) { return cache; }
+
+  HealthFile *file = (HealthFile*)map;
+  uint64_t expected = 0;
+  if (__atomic_compare_exchange_n(&file->magic, &expected, HEALTH_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  { // Fresh (zero filled) file
+    __atomic_store_n(&file->slot_count, HEALTH_SLOTS, __ATOMIC_RELEASE);
+  }
+  else if (expected != HEALTH_MAGIC || __atomic_load_n(&file->slot_count, __ATOMIC_ACQUIRE) != HEALTH_SLOTS)
+  { // Not a health file (or a different layout), leave it alone
+    munmap(map, sizeof(HealthFile));
+    return cache;
+  }
+
+  cache.file = file;
+  return cache;
+}
+
+static void
+health_close(HealthCache *cache)
+{
+  if (cache->file)
+  {
+    munmap(cache->file, sizeof(HealthFile));
+    cache->file = NULL;
+  }
+}
+
+// Decide whether `dest` should be attempted -> `info` receives a snapshot of its slot
+static HealthState
+health_check(HealthCache *cache, Str8 dest, HealthSlot *info)
+{
+  *info = (HealthSlot){0};
+  if (!cache->file) { return HEALTH_CLOSED; }
+
+  HealthSlot *slot = health_slot(cache->file, str8_hash(dest), 0);
+  if (!slot) { return HEALTH_CLOSED; }
+
+  info->hash = slot->hash;
+  info->failures = __atomic_load_n(&slot->failures, __ATOMIC_ACQUIRE);
+  info->last_failure_ms = __atomic_load_n(&slot->last_failure_ms, __ATOMIC_ACQUIRE);
+  info->retry_at_ms = __atomic_load_n(&slot->retry_at_ms, __ATOMIC_ACQUIRE);
+  if (info->failures == 0) { return HEALTH_CLOSED; }
+
+  uint64_t now_ms = os_wall_ms();
+  if (now_ms < info->retry_at_ms) { return HEALTH_OPEN; }
+
+  // Push retry_at forward as if this probe already failed -> exactly one process gets to probe
+  uint64_t probe_until = now_ms + health_backoff_ms(info->failures + 1);
+  if (__atomic_compare_exchange_n(&slot->retry_at_ms, &info->retry_at_ms, probe_until, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    return HEALTH_HALF_OPEN;
+  }
+
+  return HEALTH_OPEN;
+}
+
+// Report the outcome of a copy to `dest` -> `info` receives the updated slot
+static void
+health_record(HealthCache *cache, Str8 dest, int32_t ok, HealthSlot *info)
+{
+  *info = (HealthSlot){0};
+  if (!cache->file) { return; }
+
+  HealthSlot *slot = health_slot(cache->file, str8_hash(dest), !ok);
+  if (!slot) { return; } // Never failed (or table full), nothing to track
+
+  info->hash = slot->hash;
+  if (ok)
+  { // `info->failures` keeps the streak that just ended
+    info->last_failure_ms = __atomic_load_n(&slot->last_failure_ms, __ATOMIC_ACQUIRE);
+    info->failures = __atomic_exchange_n(&slot->failures, 0, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&slot->retry_at_ms, 0, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    uint64_t now_ms = os_wall_ms();
+    info->failures = __atomic_add_fetch(&slot->failures, 1, __ATOMIC_ACQ_REL);
+    info->last_failure_ms = now_ms;
+    info->retry_at_ms = now_ms + health_backoff_ms(info->failures);
+    __atomic_store_n(&slot->last_failure_ms, info->last_failure_ms, __ATOMIC_RELEASE);
+    __atomic_store_n(&slot->retry_at_ms, info->retry_at_ms, __ATOMIC_RELEASE);
+  }
+}
+
+#else // No shared mapping on Windows yet -> the cache stays disabled
+
+static HealthCache health_open(Str8 path) { (void)path; return (HealthCache){0}; }
+static void health_close(HealthCache *cache) { cache->file = NULL; }
+
+static HealthState
+health_check(HealthCache *cache, Str8 dest, HealthSlot *info)
+{
+  (void)cache; (void)dest;
+  *info = (HealthSlot){0};
+  return HEALTH_CLOSED;
+}
+
+static void
+health_record(HealthCache *cache, Str8 dest, int32_t ok, HealthSlot *info)
+{
+  (void)cache; (void)dest; (void)ok;
+  *info = (HealthSlot){0};
+}
+
+#endif
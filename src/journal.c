@@ -0,0 +1,125 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Journal (Crash-resumable broadcast progress)
+//==================================================
+/*
+   An mmap'd file (like the health cache) holding, per destination, the bytes known to be on
+   its storage and whether it is complete. A destination's offset only moves forward after an
+   fdatasync(), so a rerun after a crash (or kill, or power loss) can trust it: completed
+   destinations are skipped, partial ones continue at `committed` (the tail past it is dropped).
+
+   The journal belongs to one source: when the path, size or mtime differ from the recorded
+   ones it starts over. A job that copies everything resets it, so it never outlives the job.
+*/
+
+#ifndef _WIN32
+
+// Mark the journal as belonging to `src` (st) with no progress
+static void
+journal_start(JournalFile *file, uint64_t src_hash, struct stat *st)
+{
+  __atomic_store_n(&file->magic, 0, __ATOMIC_RELEASE); // A crash mid-reset leaves an invalid journal, never a mixed one
+  memset(file->slots, 0, sizeof(file->slots));
+  file->slot_count = JOURNAL_SLOTS;
+  file->src_hash = src_hash;
+  file->src_size = (uint64_t)st->st_size;
+  file->src_mtime_ns = (uint64_t)st->st_mtim.tv_sec*1000000000ull + (uint64_t)st->st_mtim.tv_nsec;
+  __atomic_store_n(&file->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+}
+
+static Journal
+journal_open(Str8 path, Str8 src)
+{
+  Journal journal = {0};
+
+  struct stat src_st;
+  if (stat((char*)src.ptr, &src_st) != 0) { return journal; }
+
+  int fd = open((char*)path.ptr, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) { return journal; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size < sizeof(JournalFile) && ftruncate(fd, sizeof(JournalFile)) != 0))
+  {
+    close(fd);
+    return journal;
+  }
+
+  void *map = mmap(NULL, sizeof(JournalFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file referenced
+  if (map == MAP_FAILED) { return journal; }
+
+  JournalFile *file = (JournalFile*)map;
+  uint64_t src_hash = str8_hash(str8_from_cstr((char*)src.ptr));
+  uint64_t src_mtime_ns = (uint64_t)src_st.st_mtim.tv_sec*1000000000ull + (uint64_t)src_st.st_mtim.tv_nsec;
+  if (__atomic_load_n(&file->magic, __ATOMIC_ACQUIRE) != JOURNAL_MAGIC || file->slot_count != JOURNAL_SLOTS ||
+      file->src_hash != src_hash || file->src_size != (uint64_t)src_st.st_size || file->src_mtime_ns != src_mtime_ns)
+  { // New, another layout or another source -> nothing to resume
+    journal_start(file, src_hash, &src_st);
+  }
+
+  journal.file = file;
+  return journal;
+}
+
+static void
+journal_close(Journal *journal)
+{
+  if (journal->file)
+  {
+    munmap(journal->file, sizeof(JournalFile));
+    journal->file = NULL;
+  }
+}
+
+// Find (or claim) the slot of `dest` -> NULL if the journal is disabled or full
+static JournalSlot *
+journal_slot(Journal *journal, Str8 dest)
+{
+  if (!journal || !journal->file) { return NULL; }
+
+  uint64_t hash = str8_hash(dest);
+  for (uint64_t i = 0; i < JOURNAL_SLOTS; ++i)
+  {
+    JournalSlot *slot = &journal->file->slots[(hash + i) % JOURNAL_SLOTS];
+    uint64_t expected = 0;
+    if (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ||
+        expected == hash)
+    {
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+// Whether a copy through `slot` would continue a partial one (and so not read the whole source)
+static int32_t
+journal_resumes(JournalSlot *slot)
+{
+  return slot && __atomic_load_n(&slot->committed, __ATOMIC_ACQUIRE) > 0;
+}
+
+// Forget all progress (the job completed) -> the next job starts fresh even with the same source
+static void
+journal_reset(Journal *journal)
+{
+  if (!journal || !journal->file) { return; }
+
+  JournalFile *file = journal->file;
+  __atomic_store_n(&file->magic, 0, __ATOMIC_RELEASE);
+  memset(file->slots, 0, sizeof(file->slots));
+}
+
+#else // No shared mapping on Windows yet (and CopyFile can't resume) -> the journal stays disabled
+
+static Journal journal_open(Str8 path, Str8 src) { (void)path; (void)src; return (Journal){0}; }
+static void journal_close(Journal *journal) { journal->file = NULL; }
+static JournalSlot *journal_slot(Journal *journal, Str8 dest) { (void)journal; (void)dest; return NULL; }
+static int32_t journal_resumes(JournalSlot *slot) { (void)slot; return 0; }
+static void journal_reset(Journal *journal) { (void)journal; }
+
+#endif
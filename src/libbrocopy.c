@@ -0,0 +1,394 @@
+/*==============================================================================
+  libbrocopy -> see libbrocopy.h for the API.
+
+  Unity build of the same modules as main.c. A BrocopyTable owns what every
+  broadcast shares: the buffered CSV and its row index (read only once opened),
+  the log (records are written whole, from any thread), and the mmap'd health
+  and stats files (atomics only). What a single broadcast needs (the keys,
+  the matched paths, the metrics/results and the directory cache) lives in a
+  BrocopyContext taken from the table's pool and cleared, not freed, on
+  release -> the reservations are reused by the next broadcast.
+  ==============================================================================*/
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <process.h>
+#include <sys/stat.h>
+#include <windows.h>
+#define MAX_PATH 260
+#else
+#define _GNU_SOURCE /* Exposes functions like readlink (hidden by -std=c99) and Linux extras like O_PATH */
+#define MAX_PATH 4096
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include <time.h>
+#include "brocopy.h"
+#include "arena.c"
+#include "clock.c"
+#include "cstring.c"
+#include "string.c"
+#include "string_simd.c"
+#include "checksum.c"
+#include "health.c"
+#include "journal.c"
+#include "tune.c"
+#include "dircache.c"
+#include "trace.c"
+#include "log.c"
+#include "metrics.c"
+#include "lz4.c"
+#include "broadcast.c"
+#include "backend.c"
+#include "spool.c"
+#include "libbrocopy.h"
+
+#define BROCOPY_TABLE_RESERVE (64ull << 30)  /* CSV + row index */
+#define BROCOPY_CONTEXT_RESERVE (4ull << 30) /* Per broadcast: results, metrics, directory cache */
+#define BROCOPY_POOL_SIZE 16                 /* Concurrent broadcasts served without a new reservation */
+
+// BrocopyStatus mirrors CopyStatus
+typedef char brocopy_status_check[(BROCOPY_OK == (int)COPY_OK && BROCOPY_MISMATCH == (int)COPY_MISMATCH) ? 1 : -1];
+
+typedef struct BrocopyContext BrocopyContext;
+struct BrocopyContext
+{
+  Arena arena;
+  Str8Array keys;
+  Str8Array paths;
+  Str8Array held; // Circuit open destinations, spooled along with the failed ones
+  int32_t busy;   // Pool slot taken (atomic)
+  int32_t pooled; // 0 = allocated because the pool was exhausted, freed on release
+};
+
+struct BrocopyTable
+{
+  Arena arena;
+  Routes routes;
+  Log log;
+  HealthCache health;
+  Tuner tune;
+  Metrics stats; // Only owns the mapping, each broadcast records through its own Metrics
+  Str8 manifest_path;
+  Str8 spool_path;
+  BrocopyContext pool[BROCOPY_POOL_SIZE];
+};
+
+static int32_t
+brocopy_context_init(BrocopyContext *context)
+{
+  context->arena = arena_alloc(BROCOPY_CONTEXT_RESERVE);
+  context->keys = str8_array_alloc();
+  context->paths = str8_array_alloc();
+  context->held = str8_array_alloc();
+  return context->arena.base && context->keys.bytes.base && context->paths.bytes.base && context->held.bytes.base;
+}
+
+static void
+brocopy_context_free(BrocopyContext *context)
+{
+  arena_free(&context->arena);
+  str8_array_free(&context->keys);
+  str8_array_free(&context->paths);
+  str8_array_free(&context->held);
+}
+
+static BrocopyContext *
+brocopy_context_acquire(BrocopyTable *table)
+{
+  for (uint64_t i = 0; i < BROCOPY_POOL_SIZE; ++i)
+  {
+    BrocopyContext *context = &table->pool[i];
+    int32_t expected = 0;
+    if (__atomic_compare_exchange_n(&context->busy, &expected, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    { // Reserved on first use
+      if (!context->arena.base && !brocopy_context_init(context))
+      {
+        brocopy_context_free(context);
+        __atomic_store_n(&context->busy, 0, __ATOMIC_RELEASE);
+        return NULL;
+      }
+      return context;
+    }
+  }
+
+  BrocopyContext *context = (BrocopyContext*)calloc(1, sizeof(BrocopyContext));
+  if (context && !brocopy_context_init(context))
+  {
+    brocopy_context_free(context);
+    free(context);
+    context = NULL;
+  }
+  return context;
+}
+
+static void
+brocopy_context_release(BrocopyContext *context)
+{
+  if (!context->pooled)
+  {
+    brocopy_context_free(context);
+    free(context);
+    return;
+  }
+
+  arena_clear(&context->arena);
+  str8_array_clear(&context->keys);
+  str8_array_clear(&context->paths);
+  str8_array_clear(&context->held);
+  __atomic_store_n(&context->busy, 0, __ATOMIC_RELEASE);
+}
+
+//==================================================
+// API
+//==================================================
+
+BrocopyTable *
+brocopy_open(const BrocopyConfig *config)
+{
+  if (!config || !config->csv_path) { return NULL; }
+
+  BrocopyTable *table = (BrocopyTable*)calloc(1, sizeof(BrocopyTable));
+  if (!table) { return NULL; }
+  table->arena = arena_alloc(BROCOPY_TABLE_RESERVE);
+  table->log.fd = -1;
+  for (uint64_t i = 0; i < BROCOPY_POOL_SIZE; ++i) { table->pool[i].pooled = 1; }
+
+  Str8 csv_path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->csv_path));
+  str8_normalize_slash(csv_path);
+  Str8 csv = csv_path.ptr ? str8_buffer_file(&table->arena, csv_path) : (Str8){0};
+  if (!csv.ptr)
+  {
+    brocopy_close(table);
+    return NULL;
+  }
+
+  table->routes = routes_from_csv(csv);
+  routes_index(&table->routes, &table->arena); // No room -> still works, matching scans the CSV
+
+  // Async (where available): the flusher's lock is what makes the shared log safe across threads
+  Str8 log_path = config->log_path ? str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->log_path)) : (Str8){0};
+  str8_normalize_slash(log_path);
+  if (!log_open(&table->log, log_path, config->log_echo, config->log_json, 1))
+  {
+    brocopy_close(table);
+    return NULL;
+  }
+#ifdef _WIN32
+  free(table->log.buf); // No flusher thread -> unbuffered, every record is its own write
+  table->log.buf = NULL;
+#endif
+
+  if (config->health_path)
+  {
+    Str8 path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->health_path));
+    str8_normalize_slash(path);
+    table->health = health_open(path);
+    if (!table->health.file)
+    {
+      log_printf(&table->log, LOG_WARN, "Could not map health file \"%s\". Circuit breaker disabled.", (char*)path.ptr);
+    }
+  }
+
+  if (config->tune_path)
+  {
+    Str8 path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->tune_path));
+    str8_normalize_slash(path);
+    table->tune = tune_open(path);
+    if (!table->tune.file)
+    {
+      log_printf(&table->log, LOG_WARN, "Could not map tuning file \"%s\". Copy parameters are fixed.", (char*)path.ptr);
+    }
+  }
+
+  if (config->stats_path)
+  {
+    Str8 path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->stats_path));
+    str8_normalize_slash(path);
+    if (!metrics_stats_open(&table->stats, path))
+    {
+      log_printf(&table->log, LOG_WARN, "Could not map stats file \"%s\". Latency history disabled.", (char*)path.ptr);
+    }
+  }
+
+  if (config->manifest_path)
+  {
+    table->manifest_path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->manifest_path));
+    str8_normalize_slash(table->manifest_path);
+  }
+
+  if (config->spool_path)
+  {
+    table->spool_path = str8_push_copy_term(&table->arena, str8_from_cstr((char*)config->spool_path));
+    str8_normalize_slash(table->spool_path);
+  }
+
+  log_printf(&table->log, LOG_INFO, "Routing table \"%s\" loaded (%" PRIu64 " bytes, %" PRIu64 " rows indexed)",
+             (char*)csv_path.ptr, csv.size, table->routes.count);
+  return table;
+}
+
+void
+brocopy_close(BrocopyTable *table)
+{
+  if (!table) { return; }
+
+  for (uint64_t i = 0; i < BROCOPY_POOL_SIZE; ++i) { brocopy_context_free(&table->pool[i]); }
+  metrics_stats_close(&table->stats);
+  health_close(&table->health);
+  tune_close(&table->tune);
+  log_close(&table->log);
+  arena_free(&table->arena);
+  free(table);
+}
+
+int32_t
+brocopy_broadcast(BrocopyTable *table, const char *src, const char **keys, uint64_t key_count,
+                  const BrocopyOptions *options, BrocopyJob *job)
+{
+  BrocopyOptions defaults = {0};
+  if (!job) { return 0; }
+  *job = (BrocopyJob){0};
+  if (!table || !src || (!keys && key_count > 0)) { return 0; }
+  if (!options) { options = &defaults; }
+  int32_t backend = options->backend ? copy_backend_find(str8_from_cstr((char*)options->backend)) : COPY_BACKEND_RW;
+  if (backend < 0) { return 0; }
+
+  uint64_t start_ms = os_now_us() / 1000;
+  BrocopyContext *context = brocopy_context_acquire(table);
+  if (!context) { return 0; }
+  job->context = context;
+
+  Str8 src_path = str8_push_copy_term(&context->arena, str8_from_cstr((char*)src));
+  str8_normalize_slash(src_path);
+  int32_t src_fd = broadcast_open_source(src_path); // Reads ahead while the keys are matched
+
+  uint64_t amt_paths = 0;
+  if (options->all_paths)
+  {
+    amt_paths = routes_all(&table->routes, &context->paths, ROUTES_MAX_KEYS);
+  }
+  else
+  {
+    if (key_count > ROUTES_MAX_KEYS)
+    {
+      log_printf(&table->log, LOG_WARN, "Too many keys passed (%" PRIu64 "). Truncated to MAX_KEYS=%d", key_count, ROUTES_MAX_KEYS);
+      key_count = ROUTES_MAX_KEYS;
+    }
+    for (uint64_t i = 0; i < key_count; ++i)
+    {
+      if (keys[i] && !str8_array_push(&context->keys, str8_from_cstr((char*)keys[i]))) { break; }
+    }
+    str8_array_sort(&context->keys, 1);
+    str8_array_dedup(&context->keys, 1);
+    amt_paths = routes_match(&table->routes, &context->keys, &context->paths);
+  }
+  log_printf(&table->log, LOG_INFO, "Broadcasting \"%s\" to %" PRIu64 " paths", (char*)src_path.ptr, amt_paths);
+
+  Metrics metrics = metrics_begin();
+  metrics.stats = table->stats.stats;
+
+  Journal journal = {0};
+  if (options->journal_path)
+  {
+    Str8 path = str8_push_copy_term(&context->arena, str8_from_cstr((char*)options->journal_path));
+    str8_normalize_slash(path);
+    journal = journal_open(path, src_path);
+    if (!journal.file)
+    {
+      log_printf(&table->log, LOG_WARN, "Could not map journal \"%s\". Copies will not be resumable.", (char*)path.ptr);
+    }
+  }
+
+  Broadcast broadcast = {0};
+  broadcast.src = src_path;
+  broadcast.src_fd = src_fd;
+  broadcast.paths = &context->paths;
+  broadcast.timeout_ms = options->timeout_ms;
+  broadcast.deadline_ms = options->deadline_ms;
+  broadcast.start_ms = start_ms;
+  broadcast.mkdir = options->mkdir;
+  broadcast.log = &table->log;
+  broadcast.health = &table->health;
+  broadcast.metrics = &metrics;
+  broadcast.checksum = (table->manifest_path.ptr != NULL);
+  broadcast.verify = options->verify;
+  broadcast.journal = &journal;
+  broadcast.chunk_size = options->chunk_size;
+  broadcast.nocache = options->nocache;
+  broadcast.tune = &table->tune;
+  broadcast.backend = (uint32_t)backend;
+  broadcast.held = table->spool_path.ptr ? &context->held : NULL;
+  broadcast.chunk_threads = (options->chunk_threads > COPY_CHUNK_THREADS_MAX) ? COPY_CHUNK_THREADS_MAX : options->chunk_threads;
+
+  uint64_t amt_open = broadcast_partition(&broadcast);
+  broadcast_resume(&broadcast);
+  metrics_reserve(&metrics, &context->arena, context->paths.count);
+  BrocopyResult *results = (BrocopyResult*)arena_push(&context->arena, (context->paths.count + 1)*sizeof(BrocopyResult));
+  if (!metrics.dests || !results)
+  {
+    if (src_fd >= 0) { log_os_close(src_fd); }
+    journal_close(&journal);
+    brocopy_job_release(table, job);
+    return 0;
+  }
+
+  uint64_t amt_ok = broadcast_copy(&broadcast, &context->arena);
+  amt_ok -= broadcast_verify(&broadcast, &context->arena);
+  if (table->manifest_path.ptr && !broadcast_manifest(&broadcast, table->manifest_path))
+  {
+    log_printf(&table->log, LOG_WARN, "Could not write manifest to \"%s\".", (char*)table->manifest_path.ptr);
+  }
+  if (table->spool_path.ptr) { spool_push(table->spool_path, &broadcast); }
+  if (amt_ok == metrics.count && amt_open == 0) { journal_reset(&journal); }
+  journal_close(&journal);
+
+  for (uint64_t i = 0; i < metrics.count; ++i)
+  {
+    MetricsDest *dest = &metrics.dests[i];
+    results[i].dest = (char*)dest->path.ptr;
+    results[i].status = dest->copy.status;
+    results[i].err = dest->copy.err;
+    results[i].bytes = dest->copy.bytes;
+    results[i].open_us = dest->copy.open_us;
+    results[i].xfer_us = dest->copy.xfer_us;
+    results[i].crc32c = broadcast.dest_crcs ? broadcast.dest_crcs[i] : 0;
+  }
+  job->src_crc32c = broadcast.src_crc;
+  job->src_hashed = broadcast.src_hashed;
+  job->results = results;
+  job->count = metrics.count;
+  return 1;
+}
+
+void
+brocopy_job_release(BrocopyTable *table, BrocopyJob *job)
+{
+  (void)table;
+  if (!job || !job->context) { return; }
+  brocopy_context_release((BrocopyContext*)job->context);
+  *job = (BrocopyJob){0};
+}
+
+const char *
+brocopy_status_name(uint32_t status)
+{
+  return (status <= COPY_MISMATCH) ? copy_status_names[status] : "unknown";
+}
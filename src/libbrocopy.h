@@ -0,0 +1,128 @@
+/*==============================================================================
+  libbrocopy -> the brocopy pipeline, in process.
+
+  Load a routing table (the .csv) once, then broadcast a file to the paths of
+  some keys as many times as needed, from as many threads as needed:
+
+      BrocopyConfig config = { .csv_path = "/bar/cfg/paths.csv", .log_path = "/var/log/bro.txt" };
+      BrocopyTable *table = brocopy_open(&config);
+
+      const char *keys[] = { "foo", "bar" };
+      BrocopyOptions options = { .timeout_ms = 2000, .mkdir = 1 };
+      BrocopyJob job;
+      if (brocopy_broadcast(table, "/foo/bar/baz/file.txt", keys, 2, &options, &job))
+      {
+        for (uint64_t i = 0; i < job.count; ++i) { ... job.results[i].dest, .status ... }
+      }
+      brocopy_job_release(table, &job);
+
+      brocopy_close(table);
+
+  Build: cc -std=c99 -O2 -pthread -c src/libbrocopy.c && ar rcs libbrocopy.a libbrocopy.o
+  Only the functions below are exported, everything else stays static to libbrocopy.o.
+  ==============================================================================*/
+
+#ifndef LIBBROCOPY_H
+#define LIBBROCOPY_H
+
+#include <stdint.h>
+
+// Fields are only ever appended to the structs below, and a zeroed field keeps the previous
+// version's behavior -> bumped with every addition.
+//   1: table, broadcast, results
+//   2: checksums (verify, manifest), journal, chunked copies, nocache, tuning, backends, spool
+#define BROCOPY_API_VERSION 2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct BrocopyTable BrocopyTable; // Opaque, immutable once opened
+
+// Same values as the CLI's metrics "outcome"
+typedef enum BrocopyStatus BrocopyStatus;
+enum BrocopyStatus
+{
+  BROCOPY_FAILED = 0,
+  BROCOPY_OK,
+  BROCOPY_TIMEOUT,  // Abandoned after BrocopyOptions.timeout_ms (partial file removed)
+  BROCOPY_SKIPPED,  // Never attempted, BrocopyOptions.deadline_ms already expired
+  BROCOPY_MISMATCH, // Copied, but BrocopyOptions.verify read back a different checksum
+};
+
+// Resources shared by every broadcast on a table -> NULL paths disable them
+typedef struct BrocopyConfig BrocopyConfig;
+struct BrocopyConfig
+{
+  const char *csv_path;      // Routing table, "key,path" rows after a header row (required)
+  const char *log_path;      // Log file, opened in append mode
+  const char *health_path;   // Shared circuit breaker file (see --health)
+  const char *stats_path;    // Shared latency histograms (see --stats)
+  int32_t log_json;          // JSON lines instead of text
+  int32_t log_echo;          // Also write log records to stdout
+  const char *manifest_path; // CRC32C of every source and copy, appended per broadcast (see --manifest)
+  const char *tune_path;     // Shared tuning file, buffer size and chunk threads per device (see --tune)
+  const char *spool_path;    // Undelivered destinations are left there for `brocopy --drain` (see --spool)
+};
+
+typedef struct BrocopyOptions BrocopyOptions;
+struct BrocopyOptions
+{
+  uint64_t timeout_ms;      // Per destination, 0 = no timeout. Copies then run in a forked worker, which
+                            // starts threads for chunked copies (fine with glibc and musl)
+  uint64_t deadline_ms;     // Whole broadcast, 0 = no deadline
+  int32_t mkdir;            // Create missing parent directories
+  int32_t all_paths;        // Ignore the keys, copy to every path of the table
+  int32_t verify;           // Read every copy back and compare it with the source's CRC32C
+  const char *journal_path; // Resume journal of this src (see --journal), one per concurrent broadcast
+  uint64_t chunk_size;      // Regular files of 2+ chunks are copied as parallel ranges, 0 = 64MB
+  uint32_t chunk_threads;   // Threads per chunked copy, 0 = 4, 1 = always sequential (max 64)
+  int32_t nocache;          // Keep the copies (and the source, once copied) out of the page cache
+  const char *backend;      // Sequential copies: "rw" (NULL), "mmap", "copy_file_range" or "auto" (see --backend)
+};
+
+typedef struct BrocopyResult BrocopyResult;
+struct BrocopyResult
+{
+  const char *dest; // Normalized destination path
+  uint32_t status;  // BrocopyStatus
+  int32_t err;      // errno (GetLastError on Windows) of the failed step, 0 if none
+  uint64_t bytes;   // Bytes written
+  uint64_t open_us; // Source + destination open
+  uint64_t xfer_us; // Read/write loop + close
+  uint32_t crc32c;  // Read back checksum (verify), 0 if not verified
+};
+
+// Results of one broadcast, valid until brocopy_job_release. Destinations skipped by the
+// circuit breaker, or completed by an earlier run of the journal, have no result.
+typedef struct BrocopyJob BrocopyJob;
+struct BrocopyJob
+{
+  BrocopyResult *results;
+  uint64_t count;
+  void *context;       // Internal, returned to the table's pool on release
+  uint32_t src_crc32c; // Source checksum, valid if src_hashed (verify or a manifest, and one complete copy)
+  int32_t src_hashed;
+};
+
+// NULL if the CSV could not be read (or no memory)
+BrocopyTable *brocopy_open(const BrocopyConfig *config);
+
+// Every job must have been released
+void brocopy_close(BrocopyTable *table);
+
+// Copy `src` to the paths of `keys` (case insensitive, repeated keys copy once). Thread safe.
+// Return 1 when `job` holds results (even if some copies failed), 0 on bad arguments or no memory.
+int32_t brocopy_broadcast(BrocopyTable *table, const char *src, const char **keys, uint64_t key_count,
+                          const BrocopyOptions *options, BrocopyJob *job);
+
+void brocopy_job_release(BrocopyTable *table, BrocopyJob *job);
+
+// "failed", "ok", "timeout", "skipped" or "mismatch"
+const char *brocopy_status_name(uint32_t status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBBROCOPY_H
@@ -0,0 +1,326 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Log (Atomic records on an O_APPEND fd)
+//==================================================
+/*
+   Many brocopy processes append to the same log file. Each record is formatted once, into a
+   per-thread buffer, then queued whole; the queue goes out with a single write() on an O_APPEND
+   fd, so records from different processes never interleave mid-line (and a short job usually
+   lands as one block). With `async` a flusher thread does the writes, off the copy path.
+
+   Text layout (default):  Warning: Too many keys passed (1200). Truncated to MAX_KEYS=1000
+   JSON lines (--log-json): {"ts":"2026-10-18T10:11:17.123Z","pid":4242,"level":"warn","msg":"Too many..."}
+*/
+
+#ifdef _WIN32
+#define log_os_open(path) _open((path), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE)
+#define log_os_write _write
+#define log_os_close _close
+#define log_os_getpid _getpid
+#else
+#define log_os_open(path) open((path), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666)
+#define log_os_write write
+#define log_os_close close
+#define log_os_getpid getpid
+#endif
+
+static THREAD_LOCAL uint8_t tl_log_msg[LOG_RECORD_MAX];
+static THREAD_LOCAL uint8_t tl_log_record[LOG_RECORD_MAX*2]; // Worst case JSON escaping
+
+static void
+log_os_write_all(int32_t fd, uint8_t *ptr, uint64_t size)
+{
+  while (size > 0)
+  {
+    int64_t written = log_os_write(fd, ptr, (uint32_t)size);
+    if (written <= 0) { return; } // Nothing sensible to do about a broken log
+    ptr += written;
+    size -= (uint64_t)written;
+  }
+}
+
+#ifndef _WIN32
+static void *
+log_flusher(void *param)
+{
+  Log *log = (Log*)param;
+  pthread_mutex_lock(&log->mutex);
+  for (;;)
+  {
+    if (log->size == 0 && !log->stop)
+    {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += (LOG_FLUSH_INTERVAL_MS % 1000) * 1000000L;
+      until.tv_sec += LOG_FLUSH_INTERVAL_MS / 1000 + until.tv_nsec / 1000000000L;
+      until.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&log->cond, &log->mutex, &until);
+    }
+
+    if (log->size > 0)
+    { // Swap buffers and write outside the lock
+      uint8_t *pending = log->buf;
+      uint64_t size = log->size;
+      log->buf = log->back;
+      log->back = pending;
+      log->size = 0;
+
+      pthread_mutex_unlock(&log->mutex);
+      TRACE_ZONE_BEGIN(zone, "log_write");
+      log_os_write_all(log->fd, pending, size);
+      TRACE_ZONE_END(zone);
+      pthread_mutex_lock(&log->mutex);
+      pthread_cond_broadcast(&log->cond); // Producers waiting for room
+    }
+    else if (log->stop)
+    {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&log->mutex);
+  return NULL;
+}
+#endif
+
+// `path` may be empty -> stdout only. Return 0 if the file couldn't be opened.
+static int32_t
+log_open(Log *log, Str8 path, int32_t echo, int32_t json, int32_t async)
+{
+  *log = (Log){0};
+  log->fd = -1;
+  log->echo = echo;
+  log->json = json;
+  log->pid = (int32_t)log_os_getpid();
+  log->buf = (uint8_t*)malloc(LOG_BUFFER_SIZE);
+
+  if (path.ptr)
+  {
+    log->fd = log_os_open((char*)path.ptr);
+    if (log->fd < 0)
+    {
+      free(log->buf);
+      log->buf = NULL;
+      return 0;
+    }
+  }
+
+#ifndef _WIN32
+  if (async && log->fd >= 0 && log->buf)
+  {
+    log->back = (uint8_t*)malloc(LOG_BUFFER_SIZE);
+    pthread_mutex_init(&log->mutex, NULL);
+    pthread_cond_init(&log->cond, NULL);
+    log->async = (log->back && pthread_create(&log->flusher, NULL, log_flusher, log) == 0);
+  }
+#else
+  (void)async;
+#endif
+
+  return 1;
+}
+
+// Queue a complete record -> never split across writes
+static void
+log_append(Log *log, uint8_t *record, uint64_t size)
+{
+  if (log->fd < 0) { return; }
+  if (!log->buf || size > LOG_BUFFER_SIZE)
+  {
+    log_os_write_all(log->fd, record, size);
+    return;
+  }
+
+#ifndef _WIN32
+  if (log->async)
+  {
+    pthread_mutex_lock(&log->mutex);
+    while (log->size + size > LOG_BUFFER_SIZE)
+    {
+      pthread_cond_signal(&log->cond);
+      pthread_cond_wait(&log->cond, &log->mutex);
+    }
+    memcpy(log->buf + log->size, record, size);
+    log->size += size;
+    if (log->size > LOG_BUFFER_SIZE / 2) { pthread_cond_signal(&log->cond); }
+    pthread_mutex_unlock(&log->mutex);
+    return;
+  }
+#endif
+
+  if (log->size + size > LOG_BUFFER_SIZE) { log_flush(log); }
+  memcpy(log->buf + log->size, record, size);
+  log->size += size;
+}
+
+// Text layout -> "[Warning: |Error: ]msg\n"
+static uint64_t
+log_format_text(LogLevel level, Str8 msg)
+{
+  Str8 prefix = (level == LOG_WARN)  ? str8_from_lit("Warning: ") :
+                (level == LOG_ERROR) ? str8_from_lit("Error: ")   : (Str8){0};
+  memcpy(tl_log_record, prefix.ptr, prefix.size);
+  memcpy(tl_log_record + prefix.size, msg.ptr, msg.size);
+  tl_log_record[prefix.size + msg.size] = '\n';
+  return prefix.size + msg.size + 1;
+}
+
+static uint64_t
+log_format_json(Log *log, LogLevel level, Str8 msg)
+{
+  char *level_name = (level == LOG_WARN) ? "warn" : (level == LOG_ERROR) ? "error" : "info";
+  char ts[32];
+#ifdef _WIN32
+  time_t now = time(NULL);
+  strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+#else
+  struct timespec now;
+  struct tm tm;
+  clock_gettime(CLOCK_REALTIME, &now);
+  gmtime_r(&now.tv_sec, &tm);
+  uint64_t len = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+  snprintf(ts + len, sizeof(ts) - len, ".%03ldZ", now.tv_nsec / 1000000L);
+#endif
+
+  int32_t head = snprintf((char*)tl_log_record, sizeof(tl_log_record),
+                          "{\"ts\":\"%s\",\"pid\":%d,\"level\":\"%s\",\"msg\":\"", ts, log->pid, level_name);
+  uint64_t size = (uint64_t)head;
+
+  for (uint64_t i = 0; i < msg.size; ++i)
+  {
+    uint8_t ch = msg.ptr[i];
+    if (ch == '"' || ch == '\\')
+    {
+      tl_log_record[size++] = '\\';
+      tl_log_record[size++] = ch;
+    }
+    else if (ch < 0x20)
+    { // Control chars -> \u00XX
+      static char hex[] = "0123456789abcdef";
+      memcpy(tl_log_record + size, "\\u00", 4);
+      tl_log_record[size + 4] = hex[ch >> 4];
+      tl_log_record[size + 5] = hex[ch & 0xf];
+      size += 6;
+    }
+    else
+    {
+      tl_log_record[size++] = ch;
+    }
+  }
+
+  memcpy(tl_log_record + size, "\"}\n", 3);
+  return size + 3;
+}
+
+static void
+log_printf(Log *log, LogLevel level, char *fmt, ...)
+{
+  va_list args;
+  va_start(args, fmt);
+  int32_t len = vsnprintf((char*)tl_log_msg, sizeof(tl_log_msg), fmt, args);
+  va_end(args);
+  if (len < 0) { return; }
+
+  Str8 msg = { tl_log_msg, ((uint64_t)len < sizeof(tl_log_msg)) ? (uint64_t)len : sizeof(tl_log_msg) - 1 };
+  uint64_t size = log->json ? log_format_json(log, level, msg) : log_format_text(level, msg);
+  log_append(log, tl_log_record, size);
+
+  if (log->echo)
+  {
+    uint64_t text_size = log->json ? log_format_text(level, msg) : size;
+    fwrite(tl_log_record, 1, text_size, stdout);
+  }
+}
+
+// Text layout opens each job with a separator, the date and the arguments
+static void
+log_job_begin(Log *log, int32_t argc, char **argv)
+{
+  Scratch tmp = scratch_get(NULL, 0);
+
+  struct tm *t = localtime(&(time_t){time(NULL)});
+  Str8 time_str = str8_push(tmp.arena, 32);
+  strftime((char*)time_str.ptr, time_str.size, "%Y-%m-%d %H:%M:%S", t);
+
+  Str8Builder builder = str8_builder_begin(tmp.arena);
+  str8_builder_push(&builder, str8_from_lit("Args:"));
+  for (int32_t i = 1; i < argc; ++i)
+  {
+    str8_builder_push_char(&builder, ' ');
+    str8_builder_push(&builder, str8_from_cstr(argv[i]));
+  }
+  Str8 args = str8_builder_end(&builder, 1);
+
+  if (!log->json)
+  {
+    log_append(log, (uint8_t*)LOG_SEP_LINE, sizeof(LOG_SEP_LINE) - 1);
+    log_append(log, time_str.ptr, str_len((char*)time_str.ptr));
+    log_append(log, (uint8_t*)"\n", 1);
+  }
+  int32_t echo = log->echo;
+  log->echo = 0; // Arguments were typed by the caller, no need to echo them
+  log_printf(log, LOG_INFO, "%.*s", (int)args.size, (char*)args.ptr);
+  log->echo = echo;
+
+  scratch_end(tmp);
+}
+
+static void
+log_job_end(Log *log)
+{
+  if (!log->json) { log_append(log, (uint8_t*)LOG_SEP_LINE, sizeof(LOG_SEP_LINE) - 1); }
+  log_flush(log);
+}
+
+// Write out everything queued so far (waits for the flusher in async mode)
+static void
+log_flush(Log *log)
+{
+  TRACE_ZONE_BEGIN(zone, "log_flush");
+#ifndef _WIN32
+  if (log->async)
+  {
+    pthread_mutex_lock(&log->mutex);
+    while (log->size > 0)
+    {
+      pthread_cond_signal(&log->cond);
+      pthread_cond_wait(&log->cond, &log->mutex);
+    }
+    pthread_mutex_unlock(&log->mutex);
+    TRACE_ZONE_END(zone);
+    return;
+  }
+#endif
+
+  if (log->fd >= 0 && log->size > 0) { log_os_write_all(log->fd, log->buf, log->size); }
+  log->size = 0;
+  fflush(stdout);
+  TRACE_ZONE_END(zone);
+}
+
+static void
+log_close(Log *log)
+{
+#ifndef _WIN32
+  if (log->async)
+  {
+    pthread_mutex_lock(&log->mutex);
+    log->stop = 1;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+    pthread_join(log->flusher, NULL);
+    pthread_mutex_destroy(&log->mutex);
+    pthread_cond_destroy(&log->cond);
+    log->async = 0;
+    free(log->back);
+  }
+#endif
+
+  log_flush(log);
+  if (log->fd >= 0) { log_os_close(log->fd); }
+  free(log->buf);
+  *log = (Log){0};
+  log->fd = -1;
+}
@@ -0,0 +1,306 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// LZ4 (Frame encoder for compressed destinations)
+//==================================================
+/*
+   Just enough of LZ4 to write what `lz4 -d` (or any LZ4 frame reader) decompresses: a frame of
+   independent LZ4_BLOCK_SIZE blocks with the content size and the XXH32 content checksum in the
+   frame. Matches are found greedily through a hash of the next 4 bytes, like LZ4's fast mode
+   with acceleration 1 -> fast, and the ratio of `lz4 -1`, give or take.
+
+   Blocks that don't shrink are stored as they are, so the output never grows by more than the
+   frame overhead.
+*/
+
+#define XXH32_P1 2654435761u
+#define XXH32_P2 2246822519u
+#define XXH32_P3 3266489917u
+#define XXH32_P4 668265263u
+#define XXH32_P5 374761393u
+
+static uint32_t
+xxh32_rotl(uint32_t x, uint32_t r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t
+xxh32_read32(uint8_t *ptr)
+{ // Little endian, unaligned
+  return (uint32_t)ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+static uint32_t
+xxh32_round(uint32_t acc, uint32_t input)
+{
+  return xxh32_rotl(acc + input*XXH32_P2, 13)*XXH32_P1;
+}
+
+static Xxh32
+xxh32_begin(uint32_t seed)
+{
+  Xxh32 state = {0};
+  state.v[0] = seed + XXH32_P1 + XXH32_P2;
+  state.v[1] = seed + XXH32_P2;
+  state.v[2] = seed;
+  state.v[3] = seed - XXH32_P1;
+  return state;
+}
+
+static void
+xxh32_update(Xxh32 *state, uint8_t *ptr, uint64_t size)
+{
+  state->total += size;
+  if (state->tail_size)
+  { // Complete the stripe left over by the previous update
+    uint64_t fill = 16 - state->tail_size;
+    fill = (fill < size) ? fill : size;
+    memcpy(state->tail + state->tail_size, ptr, fill);
+    state->tail_size += (uint32_t)fill;
+    ptr += fill;
+    size -= fill;
+    if (state->tail_size < 16) { return; }
+    for (uint32_t i = 0; i < 4; ++i) { state->v[i] = xxh32_round(state->v[i], xxh32_read32(state->tail + 4*i)); }
+    state->tail_size = 0;
+  }
+
+  for (; size >= 16; ptr += 16, size -= 16)
+  {
+    for (uint32_t i = 0; i < 4; ++i) { state->v[i] = xxh32_round(state->v[i], xxh32_read32(ptr + 4*i)); }
+  }
+  memcpy(state->tail, ptr, size);
+  state->tail_size = (uint32_t)size;
+}
+
+static uint32_t
+xxh32_end(Xxh32 *state)
+{
+  uint32_t hash = (state->total >= 16)
+    ? xxh32_rotl(state->v[0], 1) + xxh32_rotl(state->v[1], 7) + xxh32_rotl(state->v[2], 12) + xxh32_rotl(state->v[3], 18)
+    : state->v[2] + XXH32_P5; // v[2] is still the seed
+  hash += (uint32_t)state->total;
+
+  uint32_t i = 0;
+  for (; i + 4 <= state->tail_size; i += 4)
+  {
+    hash = xxh32_rotl(hash + xxh32_read32(state->tail + i)*XXH32_P3, 17)*XXH32_P4;
+  }
+  for (; i < state->tail_size; ++i)
+  {
+    hash = xxh32_rotl(hash + state->tail[i]*XXH32_P5, 11)*XXH32_P1;
+  }
+
+  hash ^= hash >> 15;
+  hash *= XXH32_P2;
+  hash ^= hash >> 13;
+  hash *= XXH32_P3;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static uint32_t
+lz4_hash(uint32_t sequence)
+{
+  return (sequence*XXH32_P1) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length's 255 runs after its token nibble (which holds 15)
+static uint8_t *
+lz4_push_length(uint8_t *out, uint64_t length)
+{
+  for (; length >= 255; length -= 255) { *out++ = 255; }
+  *out++ = (uint8_t)length;
+  return out;
+}
+
+static uint8_t *
+lz4_push_sequence(uint8_t *out, uint8_t *literals, uint64_t literal_size, uint64_t offset, uint64_t match_size)
+{
+  uint8_t *token = out++;
+  *token = (uint8_t)(((literal_size < 15) ? literal_size : 15) << 4);
+  if (literal_size >= 15) { out = lz4_push_length(out, literal_size - 15); }
+  memcpy(out, literals, literal_size);
+  out += literal_size;
+  if (match_size == 0) { return out; } // Last sequence -> literals only
+
+  *out++ = (uint8_t)offset;
+  *out++ = (uint8_t)(offset >> 8);
+  match_size -= LZ4_MIN_MATCH;
+  *token |= (uint8_t)((match_size < 15) ? match_size : 15);
+  if (match_size >= 15) { out = lz4_push_length(out, match_size - 15); }
+  return out;
+}
+
+// Compress one independent block into `dest` (LZ4_BLOCK_BOUND(size) bytes) -> compressed size.
+// `table` holds 1 << LZ4_HASH_BITS positions and is reset here.
+static uint64_t
+lz4_compress_block(uint8_t *src, uint64_t size, uint8_t *dest, uint32_t *table)
+{
+  uint8_t *out = dest;
+  uint64_t anchor = 0;
+  memset(table, 0, sizeof(uint32_t) << LZ4_HASH_BITS);
+
+  if (size >= LZ4_MF_LIMIT + 1)
+  {
+    uint64_t match_limit = size - LZ4_LAST_LITERALS; // Matches end before the last 5 bytes
+    uint64_t search_limit = size - LZ4_MF_LIMIT;      // and start before the last 12
+    uint64_t ip = 1;
+    uint64_t misses = 0;
+
+    while (ip < search_limit)
+    {
+      uint32_t sequence = xxh32_read32(src + ip);
+      uint32_t *slot = &table[lz4_hash(sequence)];
+      uint64_t ref = *slot;
+      *slot = (uint32_t)ip;
+      if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || xxh32_read32(src + ref) != sequence)
+      { // Step further the longer nothing matched -> incompressible data goes by fast
+        ip += 1 + (misses++ >> 6);
+        continue;
+      }
+      misses = 0;
+
+      while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) { --ip; --ref; }
+      uint64_t match_size = LZ4_MIN_MATCH;
+      while (ip + match_size + 8 <= match_limit)
+      {
+        uint64_t a;
+        uint64_t b;
+        memcpy(&a, src + ip + match_size, 8);
+        memcpy(&b, src + ref + match_size, 8);
+        if (a != b)
+        {
+          match_size += (uint64_t)__builtin_ctzll(a ^ b) >> 3; // Little endian -> lowest byte first
+          goto extended;
+        }
+        match_size += 8;
+      }
+      while (ip + match_size < match_limit && src[ip + match_size] == src[ref + match_size]) { ++match_size; }
+    extended:
+
+      out = lz4_push_sequence(out, src + anchor, ip - anchor, ip - ref, match_size);
+      ip += match_size;
+      anchor = ip;
+      if (ip - 2 < search_limit) { table[lz4_hash(xxh32_read32(src + ip - 2))] = (uint32_t)(ip - 2); }
+    }
+  }
+
+  out = lz4_push_sequence(out, src + anchor, size - anchor, 0, 0);
+  return (uint64_t)(out - dest);
+}
+
+// Whether a destination gets the compressed source -> the .lz4 suffix rule
+static int32_t
+lz4_is_target(Str8 path)
+{
+  Str8 suffix = str8_from_lit(".lz4");
+  return path.size > suffix.size && str8_compare(str8_postfix(path, suffix.size), suffix, 1) == 0;
+}
+
+static int32_t
+lz4_write_all(int32_t fd, uint8_t *ptr, uint64_t size)
+{
+  while (size > 0)
+  {
+    int64_t written = log_os_write(fd, ptr, (uint32_t)((size < (1u << 30)) ? size : (1u << 30)));
+    if (written <= 0) { return 0; }
+    ptr += written;
+    size -= (uint64_t)written;
+  }
+  return 1;
+}
+
+// Write `src` as an LZ4 frame to `dest_fd` -> 0 (errno set) on failure. `crc` and `size` describe the
+// frame itself, what its copies will hash to.
+static int32_t
+lz4_compress_file(Str8 src, int32_t dest_fd, uint32_t *crc, uint64_t *size)
+{
+  int32_t result = 0;
+  *crc = 0;
+  *size = 0;
+
+#ifdef _WIN32
+  int32_t src_fd = _open((char*)src.ptr, _O_RDONLY | _O_BINARY);
+  struct _stat64 st;
+  if (src_fd < 0 || _fstat64(src_fd, &st) != 0)
+#else
+  int32_t src_fd = open((char*)src.ptr, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (src_fd < 0 || fstat(src_fd, &st) != 0)
+#endif
+  {
+    if (src_fd >= 0) { log_os_close(src_fd); }
+    return 0;
+  }
+
+  uint8_t *in = (uint8_t*)malloc(LZ4_BLOCK_SIZE);
+  uint8_t *out = (uint8_t*)malloc(4 + LZ4_BLOCK_BOUND(LZ4_BLOCK_SIZE));
+  uint32_t *table = (uint32_t*)malloc(sizeof(uint32_t) << LZ4_HASH_BITS);
+  if (!in || !out || !table) { goto done; }
+
+  // Frame descriptor: version 01, independent blocks, content size + content checksum, 4MB blocks
+  uint8_t header[4 + 2 + 8 + 1];
+  uint64_t content_size = (uint64_t)st.st_size;
+  header[0] = 0x04; header[1] = 0x22; header[2] = 0x4d; header[3] = 0x18; // 0x184D2204
+  header[4] = (1 << 6) | (1 << 5) | (1 << 3) | (1 << 2);
+  header[5] = 7 << 4;
+  for (uint32_t i = 0; i < 8; ++i) { header[6 + i] = (uint8_t)(content_size >> (8*i)); }
+  Xxh32 descriptor = xxh32_begin(0);
+  xxh32_update(&descriptor, header + 4, 10);
+  header[14] = (uint8_t)(xxh32_end(&descriptor) >> 8);
+  if (!lz4_write_all(dest_fd, header, sizeof(header))) { goto done; }
+  *crc = crc32c(*crc, header, sizeof(header));
+  *size += sizeof(header);
+
+  Xxh32 content = xxh32_begin(0);
+  for (;;)
+  {
+    uint64_t filled = 0;
+    while (filled < LZ4_BLOCK_SIZE)
+    { // Whole blocks, a short read is not the end
+#ifdef _WIN32
+      int64_t b_read = _read(src_fd, in + filled, (unsigned)(LZ4_BLOCK_SIZE - filled));
+#else
+      int64_t b_read = read(src_fd, in + filled, LZ4_BLOCK_SIZE - filled);
+      if (b_read < 0 && errno == EINTR) { continue; }
+#endif
+      if (b_read < 0) { goto done; }
+      if (b_read == 0) { break; }
+      filled += (uint64_t)b_read;
+    }
+    if (filled == 0) { break; }
+    xxh32_update(&content, in, filled);
+
+    uint64_t block_size = lz4_compress_block(in, filled, out + 4, table);
+    uint32_t block_header = (uint32_t)block_size;
+    if (block_size >= filled)
+    { // Didn't shrink -> stored, flagged by the high bit
+      memcpy(out + 4, in, filled);
+      block_size = filled;
+      block_header = (uint32_t)filled | 0x80000000u;
+    }
+    for (uint32_t i = 0; i < 4; ++i) { out[i] = (uint8_t)(block_header >> (8*i)); }
+    if (!lz4_write_all(dest_fd, out, 4 + block_size)) { goto done; }
+    *crc = crc32c(*crc, out, 4 + block_size);
+    *size += 4 + block_size;
+  }
+
+  // End mark + content checksum
+  uint8_t footer[8] = {0};
+  uint32_t checksum = xxh32_end(&content);
+  for (uint32_t i = 0; i < 4; ++i) { footer[4 + i] = (uint8_t)(checksum >> (8*i)); }
+  if (!lz4_write_all(dest_fd, footer, sizeof(footer))) { goto done; }
+  *crc = crc32c(*crc, footer, sizeof(footer));
+  *size += sizeof(footer);
+  result = 1;
+
+done:
+  free(in);
+  free(out);
+  free(table);
+  log_os_close(src_fd);
+  return result;
+}
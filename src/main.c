@@ -29,29 +29,100 @@
   tries to copy "/foo/bar/baz/file.txt" to every path defined in "/bar/cfg/paths.csv".
   ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  Example call:
+                brocopy --timeout 2000 --deadline 10000 /foo/bar/baz/file.txt \
+                /bar/cfg/paths.csv foo bar baz
+
+  Copies run in a worker process: a destination that takes longer than 2s (e.g. a
+  dead network mount) is abandoned, its partial file removed, and the job moves on
+  to the next one. After 10s the remaining destinations are skipped altogether.
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  Example call:
+                brocopy --health /var/tmp/brohealth.bin -t 2000 /foo/bar/baz/file.txt \
+                /bar/cfg/paths.csv foo bar baz
+
+  Every job sharing "/var/tmp/brohealth.bin" remembers destinations that failed (or
+  timed out) recently and skips them, backing off exponentially (5s, 10s, 20s...
+  up to 30min) before a single job probes them again, after the healthy ones.
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  Example call:
+                brocopy -log /var/log/brocopy.jsonl --log-json --log-async \
+                /foo/bar/baz/file.txt /bar/cfg/paths.csv foo bar baz
+
+  Many jobs can share one log: every record is appended with a single write(), so
+  lines from concurrent jobs never interleave. Here they are JSON lines (ts, pid,
+  level, msg), written by a background thread instead of the copy loop.
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+  Example call:
+                brocopy --spool /var/spool/brocopy -rm /foo/bar/baz/file.txt \
+                /bar/cfg/paths.csv foo bar baz
+                brocopy --drain /var/spool/brocopy -t 2000
+
+  The first job leaves the destinations it could not copy to in the spool, with a
+  snapshot of the source (removed right after). The second retries them, backing
+  off per destination, and returns once every one was delivered or given up on.
+  ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+
   -> J. Paulo Seibt - https://jpseibt.github.io
   ==============================================================================*/
 
 #ifdef _WIN32
 #include <io.h>
 #include <fcntl.h>
+#include <process.h>
+#include <sys/stat.h>
 #include <windows.h>
 #define MAX_PATH 260
 #else
-#define _POSIX_C_SOURCE 200809L /* Exposes functions like readlink, hidden by -std=c99 */
+#define _GNU_SOURCE /* Exposes functions like readlink (hidden by -std=c99) and Linux extras like O_PATH */
 #define MAX_PATH 4096
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #endif
 
 #include <time.h>
 #include "brocopy.h"
 #include "arena.c"
+#include "clock.c"
 #include "cstring.c"
 #include "string.c"
-
-#define ARENA_SIZE 1048576 /* 1MB */
-#define MAX_KEYS 1000
-#define LOG_SEP_LINE "==================================================\n"
+#include "string_simd.c"
+#include "checksum.c"
+#include "health.c"
+#include "journal.c"
+#include "tune.c"
+#include "dircache.c"
+#include "trace.c"
+#include "log.c"
+#include "metrics.c"
+#include "lz4.c"
+#include "broadcast.c"
+#include "backend.c"
+#include "spool.c"
+
+#define ARENA_RESERVE_SIZE (64ull << 30) /* 64GB of address space, committed on demand */
 #define HELP_TEXT \
     "Usage: broadcast_pjob.exe [options] <src_path> <csv_path> <key> [<key> ...]\n" \
     "Args:\n" \
@@ -59,15 +130,38 @@
     "     <csv_path>\tPath to the .csv file defining copy destination.\n" \
     "     <key>...  \tOne or more keys to match in the .csv first column (ignored if --all-csv-paths option is passed).\n" \
     "Options:\n" \
-    "     -h, --help          \tShow this information.\n" \
-    "     -log <path>         \tPath to the log file (opened in append mode).\n" \
-    "     -v, --verbose       \tWrite log messages to stdout.\n" \
-    "     -a, --all-csv-paths \tCopy source file to all paths defined in the CSV.\n" \
-    "     -rm, --remove-src   \tTry to remove file at <src_path>.\n"
+    "     -h, --help              \tShow this information.\n" \
+    "     -log <path>             \tPath to the log file (opened in append mode).\n" \
+    "     -v, --verbose           \tWrite log messages to stdout.\n" \
+    "     --log-json              \tWrite the log file as JSON lines (ts, pid, level, msg).\n" \
+    "     --log-async             \tWrite the log file from a background thread.\n" \
+    "     -a, --all-csv-paths     \tCopy source file to all paths defined in the CSV.\n" \
+    "     -rm, --remove-src       \tTry to remove file at <src_path>.\n" \
+    "     -t, --timeout <ms>      \tAbandon a destination copy after <ms> milliseconds (partial file is removed).\n" \
+    "     --deadline <ms>         \tStop the whole job after <ms> milliseconds, remaining destinations are skipped.\n" \
+    "     --health <path>         \tShared destination health file: skip recently failed destinations (with backoff).\n" \
+    "     --chunk-size <bytes>    \tCopy regular files of 2+ chunks as parallel ranges of <bytes> (default 64MB).\n" \
+    "     --chunk-threads <n>     \tThreads per chunked copy (default 4, 1 = always sequential).\n" \
+    "     --nocache               \tKeep the copies (and the source, once copied) out of the page cache.\n" \
+    "     --tune <path>           \tShared tuning file: learn the buffer size and chunk threads per destination device.\n" \
+    "     --backend <name>        \tHow sequential copies move bytes: rw (default), mmap, copy_file_range, or auto\n" \
+    "                             \t(calibrated once per filesystem type, kept in the --tune file if any).\n" \
+    "     --mkdir                 \tCreate missing parent directories of destination paths.\n" \
+    "     --verify                \tRead every copy back and compare its CRC32C with the source's (hashed once, while copying).\n" \
+    "     --journal <path>        \tRecord per destination progress in <path>: a rerun skips completed copies and resumes partial ones.\n" \
+    "     --manifest <path>       \tAppend the CRC32C of the source and of every copy to <path> (e.g. next to the log).\n" \
+    "     --spool <dir>           \tLeave undelivered destinations (and a snapshot of the source) in <dir> for --drain.\n" \
+    "     --drain <dir>           \tRetry the destinations spooled in <dir> with backoff until it is empty (no <src_path>,\n" \
+    "                             \t<csv_path> or keys; the copy options apply to the retries).\n" \
+    "     --drain-concurrency <n> \tSpooled jobs retried at once (default 4).\n" \
+    "     --metrics <path>        \tWrite per destination timings (Prometheus textfile if <path> ends in .prom, JSON otherwise).\n" \
+    "     --stats <path>          \tShared stats file: aggregate destination latency histograms across runs.\n" \
+    "     --trace <path>          \tWrite a Chrome trace (chrome://tracing, ui.perfetto.dev) of the job's hot paths.\n"
 
 
 // NOTE: The Str8.ptr is safe to use as a C string if constructed using
-// str8_pushf or str8_snprintf -> vsnprintf always null-terminates
+// str8_pushf or str8_snprintf -> vsnprintf always null-terminates, or
+// str8_builder_end(.., 1) / str8_push_copy_term
 
 typedef struct Config Config;
 struct Config
@@ -75,27 +169,65 @@ struct Config
   Str8 src_path;
   Str8 csv_path;
   Str8 log_path;
-  Str8List keys;
+  Str8 health_path;
+  Str8 metrics_path;
+  Str8 stats_path;
+  Str8 trace_path;
+  Str8 manifest_path;
+  Str8 journal_path;
+  Str8 tune_path;
+  Str8 spool_path;
+  Str8 drain_path;
+  Str8Array keys;
+  uint64_t timeout_ms;    // Per destination, 0 = no timeout
+  uint64_t deadline_ms;   // Whole job (measured from startup), 0 = no deadline
+  uint64_t chunk_size;    // 0 = COPY_CHUNK_SIZE
+  uint64_t chunk_threads; // 0 = COPY_CHUNK_THREADS
+  uint64_t drain_threads; // 0 = SPOOL_DRAIN_THREADS
+  uint32_t backend;       // CopyBackendId
   int32_t verbose;
+  int32_t log_json;
+  int32_t log_async;
   int32_t all_csv_paths;
   int32_t remove_src;
+  int32_t mkdir;
+  int32_t verify;
+  int32_t nocache;
+};
+
+// An option followed by a path, or by a number in [min, max]
+typedef struct ArgOption ArgOption;
+struct ArgOption
+{
+  char *name;
+  Str8 *path;
+  uint64_t *value;
+  uint64_t min;
+  uint64_t max;
+  char *expects; // For the error message
 };
 
 // Prototypes
 static Str8 os_get_exe_path(Arena *arena);
-static void log_date_hour(Arena *scratch, FILE *stream);
-static int32_t set_paths_list_from_keys(Arena *arena, Str8List *paths_list, Str8List *keys_list, Str8 stream);
-static int32_t set_paths_list_all_csv(Arena *arena, Str8List *paths_list, Str8 stream);
-static int32_t copy_file(Str8 data, Str8 dest);
+static int32_t drain_spool(Config *config, Log *log, Metrics *metrics);
 
 int main(int argc, char *argv[])
 {
-  Arena arena = arena_alloc(ARENA_SIZE);
+  uint64_t job_start_ms = os_now_us() / 1000;
+  Metrics metrics = metrics_begin();
+  TRACE_ZONE_BEGIN(args_zone, "parse_args");
+  Arena arena = arena_alloc(ARENA_RESERVE_SIZE);
   Config config = {0};
-  FILE *log_stream = 0;
+  Log log = {0};
   int32_t amt_keys = 0;
   int32_t amt_paths = 0;
 
+  if (!arena.base)
+  {
+    fprintf(stderr, "Error: Could not reserve %llu bytes of address space for the arena.\n", ARENA_RESERVE_SIZE);
+    return 1;
+  }
+
   //==================================================
   // Process args
   //==================================================
@@ -106,13 +238,38 @@ int main(int argc, char *argv[])
     return 0;
   }
 
+  // Matched by full name, like the flags below
+  ArgOption arg_options[] =
+  {
+    { "-log",                &config.log_path,      NULL, 0, 0, "a path" },
+    { "--health",            &config.health_path,   NULL, 0, 0, "a path" },
+    { "--metrics",           &config.metrics_path,  NULL, 0, 0, "a path" },
+    { "--stats",             &config.stats_path,    NULL, 0, 0, "a path" },
+    { "--trace",             &config.trace_path,    NULL, 0, 0, "a path" },
+    { "--manifest",          &config.manifest_path, NULL, 0, 0, "a path" },
+    { "--journal",           &config.journal_path,  NULL, 0, 0, "a path" },
+    { "--tune",              &config.tune_path,     NULL, 0, 0, "a path" },
+    { "--spool",             &config.spool_path,    NULL, 0, 0, "a path" },
+    { "--drain",             &config.drain_path,    NULL, 0, 0, "a path" },
+    { "-t",                  NULL, &config.timeout_ms,    0, UINT64_MAX, "a number of milliseconds" },
+    { "--timeout",           NULL, &config.timeout_ms,    0, UINT64_MAX, "a number of milliseconds" },
+    { "--deadline",          NULL, &config.deadline_ms,   0, UINT64_MAX, "a number of milliseconds" },
+    { "--chunk-size",        NULL, &config.chunk_size,    1, UINT64_MAX, "a number of bytes" },
+    { "--chunk-threads",     NULL, &config.chunk_threads, 1, COPY_CHUNK_THREADS_MAX, "a number of threads" },
+    { "--drain-concurrency", NULL, &config.drain_threads, 1, COPY_CHUNK_THREADS_MAX, "a number of jobs" },
+  };
+
   for (int32_t i = 1; i < argc; ++i)
   {
     Str8 curr_arg = str8_from_cstr_term(argv[i]);
+    ArgOption *option = NULL;
+    for (uint64_t o = 0; o < sizeof(arg_options)/sizeof(arg_options[0]) && !option; ++o)
+    {
+      if (str8_equals(str8_from_cstr_term(arg_options[o].name), curr_arg)) { option = &arg_options[o]; }
+    }
     /*
        Obs: str8_from_cstr_term() macro is used to ensure null termination primarily for path arguments,
-            but if changing the approach for curr_arg Str8 construction, remember to change this line at
-            config.keys node insertion:
+            keys are pushed from argv[i] itself (str8_array_push adds its own terminator).
     */
 
     if (str8_equals(str8_from_lit_term("-h"), curr_arg) || str8_equals(str8_from_lit_term("--help"), curr_arg))
@@ -121,24 +278,18 @@ int main(int argc, char *argv[])
       arena_free(&arena);
       return 1;
     }
-    else if (str8_equals(str8_from_lit_term("-log"), curr_arg))
-    {
-      if (++i >= argc)
-      {
-        fprintf(stderr, "Error: -log requires a path.\n");
-        arena_free(&arena);
-        return 1;
-      }
-      else
-      {
-        config.log_path = str8_pushf(&arena, argv[i]);
-        str8_normalize_slash(config.log_path);
-      }
-    }
     else if (str8_equals(str8_from_lit_term("-v"), curr_arg) || str8_equals(str8_from_lit_term("--verbose"), curr_arg))
     {
       config.verbose = 1;
     }
+    else if (str8_equals(str8_from_lit_term("--log-json"), curr_arg))
+    {
+      config.log_json = 1;
+    }
+    else if (str8_equals(str8_from_lit_term("--log-async"), curr_arg))
+    {
+      config.log_async = 1;
+    }
     else if (str8_equals(str8_from_lit_term("-a"), curr_arg) || str8_equals(str8_from_lit_term("--all-csv-paths"), curr_arg))
     {
       config.all_csv_paths = 1;
@@ -147,6 +298,46 @@ int main(int argc, char *argv[])
     {
       config.remove_src = 1;
     }
+    else if (str8_equals(str8_from_lit_term("--mkdir"), curr_arg))
+    {
+      config.mkdir = 1;
+    }
+    else if (str8_equals(str8_from_lit_term("--verify"), curr_arg))
+    {
+      config.verify = 1;
+    }
+    else if (str8_equals(str8_from_lit_term("--nocache"), curr_arg))
+    {
+      config.nocache = 1;
+    }
+    else if (str8_equals(str8_from_lit_term("--backend"), curr_arg))
+    {
+      int32_t backend = (++i < argc) ? copy_backend_find(str8_from_cstr(argv[i])) : -1;
+      if (backend < 0)
+      {
+        fprintf(stderr, "Error: --backend requires rw, mmap, copy_file_range or auto.\n");
+        arena_free(&arena);
+        return 1;
+      }
+      config.backend = (uint32_t)backend;
+    }
+    else if (option)
+    {
+      if (++i >= argc || (option->value && (!str8_parse_u64(str8_from_cstr(argv[i]), option->value) ||
+                                            *option->value < option->min || *option->value > option->max)))
+      {
+        fprintf(stderr, "Error: %s requires %s", option->name, option->expects);
+        if (option->value && option->max != UINT64_MAX) { fprintf(stderr, " (%" PRIu64 "-%" PRIu64 ")", option->min, option->max); }
+        fprintf(stderr, ".\n");
+        arena_free(&arena);
+        return 1;
+      }
+      if (option->path)
+      {
+        *option->path = str8_push_copy_term(&arena, str8_from_cstr(argv[i]));
+        str8_normalize_slash(*option->path);
+      }
+    }
     else
     { // Positional args
       if (config.src_path.ptr == 0)
@@ -166,22 +357,20 @@ int main(int argc, char *argv[])
       }
       else
       { // <key>
-        Str8Node *new_node = str8_list_push(&arena, &config.keys);
-        if (!new_node)
+        if (!config.keys.bytes.base) { config.keys = str8_array_alloc(); }
+        if (!str8_array_push(&config.keys, str8_from_cstr(argv[i])))
         { // Highly unlikely, but still
           fprintf(stderr, "Error: Arena full. Aborting...\n");
           arena_free(&arena);
           return 1;
         }
-        new_node->str = curr_arg;
-        new_node->str.size -= 1; // "Forget" null terminator from str8_from_cstr_term() macro
         ++amt_keys;
       }
     }
   }
 
-  // Check src and csv paths
-  if (config.src_path.ptr == 0 || config.csv_path.ptr == 0)
+  // Check src and csv paths (--drain takes neither)
+  if (!config.drain_path.ptr && (config.src_path.ptr == 0 || config.csv_path.ptr == 0))
   {
     fprintf(stderr, "Error: Missing <src_path> or <csv_path>.\n");
     fprintf(stderr, HELP_TEXT);
@@ -189,254 +378,323 @@ int main(int argc, char *argv[])
     return 1;
   }
 
-  { // Check if src and csv paths are accessible
+  // Check if src and csv paths are accessible -> both handles are kept, the source reading ahead
+  // from here on while the log is opened and the CSV parsed
+  int32_t src_fd = -1;
+  FILE *csv_file = NULL;
+  if (!config.drain_path.ptr)
+  {
+#ifdef _WIN32
     FILE *src_check = fopen((char*)config.src_path.ptr, "r");
-    FILE *csv_check = fopen((char*)config.csv_path.ptr, "r");
-    if (!src_check || !csv_check)
+    int32_t src_ok = (src_check != NULL);
+    if (src_check) { fclose(src_check); }
+#else
+    src_fd = broadcast_open_source(config.src_path);
+    int32_t src_ok = (src_fd >= 0);
+#endif
+    csv_file = fopen((char*)config.csv_path.ptr, "rb");
+    if (!src_ok || !csv_file)
     {
-      if (src_check) { fclose(src_check); }
-      if (csv_check) { fclose(csv_check); }
+      if (src_fd >= 0) { log_os_close(src_fd); }
+      if (csv_file) { fclose(csv_file); }
       fprintf(stderr, "Error: \"%s\" or \"%s\" are inaccessible.\n", (char*)config.src_path.ptr, (char*)config.csv_path.ptr);
       arena_free(&arena);
       return 1;
     }
-    fclose(src_check);
-    fclose(csv_check);
   }
 
-  // Check log file
-  if (config.log_path.ptr)
+  if (config.trace_path.ptr && !trace_enable())
   {
-    log_stream = fopen((char*)config.log_path.ptr, "a");
-    if (!log_stream)
-    {
-      fprintf(stderr, "Warning: Could not open log file at \"%s\". Fallback to default (at executable dir).\n", config.log_path.ptr);
+    fprintf(stderr, "Warning: Tracing is not available in this build, ignoring --trace.\n");
+    config.trace_path = (Str8){0};
+  }
+  TRACE_ZONE_END(args_zone);
 
-      // Set log_path to exe /head/brolog.txt (%:h/brolog.txt).
-      Str8 exe_path = os_get_exe_path(&arena);
-      config.log_path = str8_pushf(&arena, "%.*s%cbrolog.txt",
-                                   (int)str8_index_last_slash(exe_path), (char*)exe_path.ptr, OS_SLASH);
-      log_stream = fopen((char*)config.log_path.ptr, "a");
-    }
+  // Check log file
+  TRACE_ZONE_BEGIN(log_zone, "log_open");
+  if (!log_open(&log, config.log_path, config.verbose, config.log_json, config.log_async))
+  {
+    fprintf(stderr, "Warning: Could not open log file at \"%s\". Fallback to default (at executable dir).\n", config.log_path.ptr);
+
+    // Set log_path to exe /head/brolog.txt (%:h/brolog.txt).
+    Str8 exe_path = os_get_exe_path(&arena);
+    Str8Builder builder = str8_builder_begin(&arena);
+    str8_builder_push(&builder, str8_prefix(exe_path, str8_index_last_slash(exe_path)));
+    str8_builder_push_char(&builder, OS_SLASH);
+    str8_builder_push(&builder, str8_from_lit("brolog.txt"));
+    config.log_path = str8_builder_end(&builder, 1);
+    log_open(&log, config.log_path, config.verbose, config.log_json, config.log_async);
   }
 
-  if (config.verbose) { fprintf(stdout, "Logging at \"%s\".\n", config.log_path.ptr); }
+  if (config.verbose && log.fd >= 0) { fprintf(stdout, "Logging at \"%s\".\n", config.log_path.ptr); }
 
   // Init logging
-  log_date_hour(&arena, log_stream);
-  fprintf(log_stream, "Args:");
-  for (int32_t i = 1; i < argc; ++i)
+  log_job_begin(&log, argc, argv);
+  TRACE_ZONE_END(log_zone);
+
+  if (config.stats_path.ptr && !metrics_stats_open(&metrics, config.stats_path))
   {
-    fprintf(log_stream, " %s", argv[i]);
+    log_printf(&log, LOG_WARN, "Could not map stats file \"%s\". Latency history disabled.", (char*)config.stats_path.ptr);
   }
-  fprintf(log_stream, "\n");
 
-  if (amt_keys > MAX_KEYS)
+  if (amt_keys > ROUTES_MAX_KEYS)
   {
-    fprintf(log_stream, "Warning: Too many keys passed (%d). Truncated to MAX_KEYS=%d\n", amt_keys, MAX_KEYS);
-    if (config.verbose) { fprintf(stdout, "Warning: Too many keys passed (%d). Truncated to MAX_KEYS=%d\n", amt_keys, MAX_KEYS); }
-    amt_keys = MAX_KEYS;
+    log_printf(&log, LOG_WARN, "Too many keys passed (%d). Truncated to MAX_KEYS=%d", amt_keys, ROUTES_MAX_KEYS);
+    config.keys.count = ROUTES_MAX_KEYS;
+  }
+
+  if (amt_keys > 0)
+  { // Sorted and unique -> each CSV row is a binary search, and a repeated key copies only once
+    str8_array_sort(&config.keys, 1);
+    amt_keys = (int32_t)str8_array_dedup(&config.keys, 1);
+  }
+
+  metrics_phase_end(&metrics, METRICS_PHASE_ARGS);
+
+  if (config.drain_path.ptr)
+  { // --drain: no broadcast of its own, only the spooled ones
+    int32_t drained = drain_spool(&config, &log, &metrics);
+    log_flush(&log);
+    if (config.trace_path.ptr && !trace_write(config.trace_path))
+    {
+      log_printf(&log, LOG_WARN, "Could not write trace to \"%s\".", (char*)config.trace_path.ptr);
+    }
+    metrics_stats_close(&metrics);
+    log_job_end(&log);
+    log_close(&log);
+    arena_free(&arena);
+    return drained ? 0 : 1;
   }
 
   //==================================================
   // Buffer and parse .csv stream
   //==================================================
-  Str8 csv_stream_buf = str8_buffer_file(&arena, config.csv_path);
+  TRACE_ZONE_BEGIN(buffer_zone, "str8_buffer_stream");
+  Str8 csv_stream_buf = str8_buffer_stream(&arena, csv_file);
+  fclose(csv_file);
+  TRACE_ZONE_END_DETAIL(buffer_zone, config.csv_path);
   if (csv_stream_buf.ptr == 0)
   {
-    fprintf(log_stream, "Error: could not buffer the CSV. Aborting...\n");
-    if (config.verbose) { fprintf(stdout, "Error: could not buffer the CSV. Aborting...\n"); }
-    fprintf(log_stream, LOG_SEP_LINE);
-    fclose(log_stream);
+    log_printf(&log, LOG_ERROR, "Could not buffer the CSV. Aborting...");
+    if (src_fd >= 0) { log_os_close(src_fd); }
+    metrics_stats_close(&metrics);
+    log_job_end(&log);
+    log_close(&log);
     arena_free(&arena);
     return 1;
   }
 
-  fprintf(log_stream, "Bytes read from CSV (\"%s\"): %lu\n", (char*)config.csv_path.ptr, csv_stream_buf.size);
-  if (config.verbose) { fprintf(stdout, "Bytes read from CSV (\"%s\"): %lu\n", (char*)config.csv_path.ptr, csv_stream_buf.size); }
+  log_printf(&log, LOG_INFO, "Bytes read from CSV (\"%s\"): %" PRIu64, (char*)config.csv_path.ptr, csv_stream_buf.size);
 
-  Str8List paths = {0};
+  Routes routes = routes_from_csv(csv_stream_buf);
+  Str8Array paths = str8_array_alloc();
   if (amt_keys > 0)
   {
-    amt_paths = set_paths_list_from_keys(&arena, &paths, &config.keys, csv_stream_buf);
-    fprintf(log_stream, "Amount of matches in CSV from arg keys: %d out of %d\n", amt_paths, amt_keys);
-    if (config.verbose) { fprintf(stdout, "Amount of matches in CSV from arg keys: %d out of %d\n", amt_paths, amt_keys); }
+    TRACE_ZONE_BEGIN(parse_zone, "routes_match");
+    amt_paths = (int32_t)routes_match(&routes, &config.keys, &paths);
+    TRACE_ZONE_END(parse_zone);
+    log_printf(&log, LOG_INFO, "Amount of matches in CSV from arg keys: %d out of %d", amt_paths, amt_keys);
   }
   else
   {
-    amt_paths = set_paths_list_all_csv(&arena, &paths, csv_stream_buf);
-    fprintf(log_stream, "Amount of paths parsed in CSV: %d\n", amt_paths);
-    if (config.verbose) { fprintf(stdout, "Amount of paths parsed in CSV: %d\n", amt_paths); }
+    TRACE_ZONE_BEGIN(parse_zone, "routes_all");
+    amt_paths = (int32_t)routes_all(&routes, &paths, ROUTES_MAX_KEYS);
+    TRACE_ZONE_END(parse_zone);
+    log_printf(&log, LOG_INFO, "Amount of paths parsed in CSV: %d", amt_paths);
   }
+  metrics_phase_end(&metrics, METRICS_PHASE_CSV);
 
   //==================================================
-  // Copy files in paths list
+  // Circuit breaker -> skip recently failed destinations, probe the recovering ones last
   //==================================================
-  Str8 dest_path = str8_push(&arena, MAX_PATH);
-  int32_t result = 0;
-
-  for (Str8Node *curr_node = paths.head; curr_node != NULL; curr_node = curr_node->next)
+  HealthCache health = {0};
+  if (config.health_path.ptr)
   {
-    str8_snprintf(dest_path, "%.*s", (int)curr_node->str.size, (char*)curr_node->str.ptr);
-    str8_normalize_slash(dest_path);
-
-#ifdef _WIN32
-    result = CopyFile((char*)config.src_path.ptr, (char*)dest_path.ptr, FALSE);
-#else
-    result = copy_file(config.src_path, dest_path);
-#endif
+    health = health_open(config.health_path);
+    if (!health.file)
+    {
+      log_printf(&log, LOG_WARN, "Could not map health file \"%s\". Circuit breaker disabled.", (char*)config.health_path.ptr);
+    }
+  }
 
-    if (result)
+  Journal journal = {0};
+  if (config.journal_path.ptr)
+  {
+    journal = journal_open(config.journal_path, config.src_path);
+    if (!journal.file)
     {
-      fprintf(log_stream, "\"%s\" copied to \"%s\"\n", (char*)config.src_path.ptr, (char*)dest_path.ptr);
-      if (config.verbose) { fprintf(stdout, "\"%s\" copied to \"%s\"\n", (char*)config.src_path.ptr, (char*)dest_path.ptr); }
+      log_printf(&log, LOG_WARN, "Could not map journal \"%s\". Copies will not be resumable.", (char*)config.journal_path.ptr);
     }
-    else
+  }
+
+  Tuner tune = {0};
+  if (config.tune_path.ptr)
+  {
+    tune = tune_open(config.tune_path);
+    if (!tune.file)
     {
-      fprintf(log_stream, "Failed to copy \"%s\" to \"%s\"\n", (char*)config.src_path.ptr, (char*)dest_path.ptr);
-      if (config.verbose) { fprintf(stdout, "Failed to copy \"%s\" to \"%s\"\n", (char*)config.src_path.ptr, (char*)dest_path.ptr); }
+      log_printf(&log, LOG_WARN, "Could not map tuning file \"%s\". Copy parameters are fixed.", (char*)config.tune_path.ptr);
     }
   }
 
+  Broadcast job = {0};
+  job.src = config.src_path;
+  job.src_fd = src_fd;
+  job.paths = &paths;
+  job.timeout_ms = config.timeout_ms;
+  job.deadline_ms = config.deadline_ms;
+  job.start_ms = job_start_ms;
+  job.mkdir = config.mkdir;
+  job.log = &log;
+  job.health = &health;
+  job.metrics = &metrics;
+  job.checksum = (config.manifest_path.ptr != NULL);
+  job.verify = config.verify;
+  job.journal = &journal;
+  job.chunk_size = config.chunk_size;
+  job.chunk_threads = (uint32_t)config.chunk_threads;
+  job.nocache = config.nocache;
+  job.tune = &tune;
+  job.backend = config.backend;
+  Str8Array held = {0};
+  if (config.spool_path.ptr)
+  { // Circuit open destinations are spooled too
+    held = str8_array_alloc();
+    job.held = &held;
+  }
+  uint64_t amt_open = broadcast_partition(&job);
+  amt_paths -= (int32_t)amt_open;
+  amt_paths -= (int32_t)broadcast_resume(&job);
+
+  //==================================================
+  // Copy files in paths list
+  //==================================================
+  log_flush(&log); // Records up to here reach the file before the first (slow) copy
+  metrics_reserve(&metrics, &arena, paths.count);
+  metrics_phase_end(&metrics, METRICS_PHASE_HEALTH);
+
+  uint64_t amt_ok = broadcast_copy(&job, &arena);
+  amt_ok -= broadcast_verify(&job, &arena);
+  if (config.manifest_path.ptr && !broadcast_manifest(&job, config.manifest_path))
+  {
+    log_printf(&log, LOG_WARN, "Could not write manifest to \"%s\".", (char*)config.manifest_path.ptr);
+  }
+  if (config.spool_path.ptr)
+  { // Before -rm: the retries need a snapshot of the source
+    spool_push(config.spool_path, &job);
+  }
+  if (amt_ok == metrics.count && amt_open == 0)
+  { // Every destination is done -> nothing left to resume
+    journal_reset(&journal);
+  }
+  journal_close(&journal);
+  tune_close(&tune);
+  health_close(&health);
+  metrics_phase_end(&metrics, METRICS_PHASE_COPY);
+
   // Attempt to remove tmp file
   if (config.remove_src)
   {
     int32_t result = remove((char*)config.src_path.ptr);
     if (result == 0)
     {
-      fprintf(log_stream, "File \"%s\" removed successfully.\n", (char*)config.src_path.ptr);
-      if (config.verbose) { fprintf(stdout, "File \"%s\" removed successfully.\n", (char*)config.src_path.ptr); }
+      log_printf(&log, LOG_INFO, "File \"%s\" removed successfully.", (char*)config.src_path.ptr);
     }
     else
     {
-      fprintf(log_stream, "Could not remove \"%s\".\n", (char*)config.src_path.ptr);
-      if (config.verbose) { fprintf(stdout, "Could not remove \"%s\".\n", (char*)config.src_path.ptr); }
+      log_printf(&log, LOG_WARN, "Could not remove \"%s\".", (char*)config.src_path.ptr);
     }
   }
 
-  fprintf(log_stream, LOG_SEP_LINE);
-  fclose(log_stream);
-  arena_free(&arena);
-  return 0;
-}
+  metrics_phase_end(&metrics, METRICS_PHASE_CLEANUP);
+  TRACE_ZONE_BEGIN(metrics_zone, "metrics_write");
+  if (config.metrics_path.ptr && !metrics_write(&metrics, config.metrics_path, copy_status_names))
+  {
+    log_printf(&log, LOG_WARN, "Could not write metrics to \"%s\".", (char*)config.metrics_path.ptr);
+  }
+  TRACE_ZONE_END(metrics_zone);
 
+  log_flush(&log); // Its zone lands in the trace, and the flusher thread goes idle
+  if (config.trace_path.ptr && !trace_write(config.trace_path))
+  {
+    log_printf(&log, LOG_WARN, "Could not write trace to \"%s\".", (char*)config.trace_path.ptr);
+  }
+  metrics_stats_close(&metrics);
+  str8_array_free(&paths); // Metrics point into it
+  if (held.bytes.base) { str8_array_free(&held); }
+  str8_array_free(&config.keys);
 
-static Str8
-os_get_exe_path(Arena *arena)
-{
-  Str8 result = {0};
-  char buf[MAX_PATH];
+  log_job_end(&log);
+  log_close(&log);
 
-#ifdef _WIN32
-  uint32_t len = GetModuleFileName(NULL, buf, sizeof(buf));
-#else
-  uint64_t len = readlink("/proc/self/exe", buf, sizeof(buf));
+#ifdef ARENA_INSTRUMENT
+  arena_stats_print(config.verbose ? stdout : stderr);
 #endif
 
-  buf[len] = '\0';
-  result = str8_pushf(arena, buf);
-
-  return result;
+  arena_free(&arena);
+  return 0;
 }
 
-static void
-log_date_hour(Arena *scratch, FILE *stream)
-{
-  Scratch tmp = scratch_start(scratch);
-
-  struct tm *t = localtime(&(time_t){time(NULL)});
-  Str8 time_str = str8_push(scratch, 32);
-  strftime((char*)time_str.ptr, time_str.size, "%Y-%m-%d %H:%M:%S", t);
-
-  fprintf(stream, LOG_SEP_LINE);
-  fprintf(stream, "%s\n", time_str.ptr);
 
-  scratch_end(tmp);
-}
-
-// Return number of paths that where succesfully matched from keys list
+// --drain: the copy options of `config` apply to every retry of the spool
 static int32_t
-set_paths_list_from_keys(Arena *arena, Str8List *paths_list, Str8List *keys_list, Str8 stream)
+drain_spool(Config *config, Log *log, Metrics *metrics)
 {
-  // Skip .csv header row
-  Str8 cursor = str8_skip(stream, str8_index(stream, '\n') + 1);
-  int32_t amt_paths = 0;
-
-  while (cursor.size > 0)
+  HealthCache health = {0};
+  if (config->health_path.ptr)
   {
-    Str8 line = str8_prefix(cursor, str8_index(cursor, '\n'));
-    Str8 key_slice = str8_prefix(line, str8_index(line, ','));
-    Str8 path_slice = str8_postfix(line, line.size - str8_index(line, ',') - 1);
-
-    for (Str8Node *key_node = keys_list->head; key_node != NULL; key_node = key_node->next)
+    health = health_open(config->health_path);
+    if (!health.file)
     {
-      if (str8_equals_insensitive(key_node->str, key_slice))
-      {
-        Str8Node *new_node = str8_list_push(arena, paths_list);
-        if (!new_node) { return 0; }
-        new_node->str = str8_pushf(arena, "%.*s", (int)str8_index(path_slice, '\r'), path_slice.ptr);
-        ++amt_paths;
-      }
+      log_printf(log, LOG_WARN, "Could not map health file \"%s\". Circuit breaker disabled.", (char*)config->health_path.ptr);
     }
-
-    cursor = str8_skip(cursor, line.size + 1);
   }
 
-  return amt_paths;
-}
-
-// Return number of paths that where succesfully parsed from stream
-static int32_t
-set_paths_list_all_csv(Arena *arena, Str8List *paths_list, Str8 stream)
-{
-  // Skip .csv header row
-  Str8 cursor = str8_skip(stream, str8_index(stream, '\n') + 1);
-  int32_t amt_paths = 0;
-
-  while (cursor.size > 0)
+  Tuner tune = {0};
+  if (config->tune_path.ptr)
   {
-    Str8 line = str8_prefix(cursor, str8_index(cursor, '\n'));
-    Str8 path_slice = str8_postfix(line, line.size - str8_index(line, ',') - 1);
-
-    Str8Node *new_node = str8_list_push(arena, paths_list);
-    if (!new_node) { return 0; }
-    new_node->str = str8_pushf(arena, "%.*s", (int)str8_index(path_slice, '\r'), path_slice.ptr);
-
-    if (++amt_paths > MAX_KEYS) { break; }
-    cursor = str8_skip(cursor, line.size + 1);
+    tune = tune_open(config->tune_path);
+    if (!tune.file)
+    {
+      log_printf(log, LOG_WARN, "Could not map tuning file \"%s\". Copy parameters are fixed.", (char*)config->tune_path.ptr);
+    }
   }
 
-  return amt_paths;
+  Broadcast proto = {0};
+  proto.src_fd = -1;
+  proto.timeout_ms = config->timeout_ms;
+  proto.deadline_ms = config->deadline_ms; // Per retried job
+  proto.mkdir = config->mkdir;
+  proto.log = log;
+  proto.health = &health;
+  proto.metrics = metrics;
+  proto.verify = config->verify;
+  proto.chunk_size = config->chunk_size;
+  proto.chunk_threads = (uint32_t)config->chunk_threads;
+  proto.nocache = config->nocache;
+  proto.tune = &tune;
+  proto.backend = config->backend;
+  int32_t result = spool_drain(config->drain_path, &proto, (uint32_t)config->drain_threads);
+
+  tune_close(&tune);
+  health_close(&health);
+  return result;
 }
 
-
-static int32_t
-copy_file(Str8 src, Str8 dest)
+static Str8
+os_get_exe_path(Arena *arena)
 {
-  uint8_t buf[64*1024];
-  int32_t result = 1;
-  uint64_t b_read, b_written;
+  Str8 result = {0};
+  char buf[MAX_PATH];
 
-  FILE *src_stream = fopen((char*)src.ptr, "rb");
-  FILE *dest_stream = fopen((char*)dest.ptr, "wb");
-  if (!src_stream || !dest_stream)
-  {
-    if (src_stream) { fclose(src_stream); }
-    if (dest_stream) { fclose(dest_stream); }
-    return 0;
-  }
+#ifdef _WIN32
+  uint32_t len = GetModuleFileName(NULL, buf, sizeof(buf));
+#else
+  uint64_t len = readlink("/proc/self/exe", buf, sizeof(buf));
+#endif
 
-  while ((b_read = fread(buf, 1, sizeof(buf), src_stream)) > 0)
-  {
-    b_written = fwrite(buf, 1, b_read, dest_stream);
-    if (b_read != b_written)
-    {
-      result = 0;
-      break;
-    }
-  }
+  if (len > sizeof(buf)) { len = 0; } // readlink failed (-1)
+  result = str8_push_copy_term(arena, (Str8){ (uint8_t*)buf, len });
 
-  fclose(src_stream);
-  fclose(dest_stream);
   return result;
 }
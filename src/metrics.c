@@ -0,0 +1,471 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Metrics (Per destination timings + mmap'd latency histograms)
+//==================================================
+/*
+   Every job collects the open/transfer time, bytes and errno of each destination plus the time
+   spent in each phase, and metrics_write() dumps them when the job ends:
+     <path>.prom -> Prometheus textfile collector format (node_exporter --collector.textfile)
+     otherwise   -> JSON summary
+   The file is written next to `path` and renamed over it, so collectors never read half a job.
+
+   With a stats file, destination latencies are also aggregated across runs in log-linear
+   histograms (STATS_SUB_BUCKETS linear steps per power of two microseconds), mmap'd and updated
+   with atomics like the health cache, so concurrent jobs share them.
+*/
+
+static Metrics
+metrics_begin(void)
+{
+  Metrics metrics = {0};
+  metrics.mark_us = os_now_us();
+  return metrics;
+}
+
+// Charge the time since the previous phase ended to `phase`
+static void
+metrics_phase_end(Metrics *metrics, MetricsPhase phase)
+{
+  uint64_t now_us = os_now_us();
+  metrics->phase_us[phase] += now_us - metrics->mark_us;
+  metrics->mark_us = now_us;
+}
+
+// Room for `count` destinations -> records past it still reach the stats file, not the report
+static void
+metrics_reserve(Metrics *metrics, Arena *arena, uint64_t count)
+{
+  metrics->dests = (MetricsDest*)arena_push(arena, count*sizeof(MetricsDest));
+  metrics->capacity = metrics->dests ? count : 0;
+  metrics->count = 0;
+}
+
+// Bucket index of a latency: exact below STATS_SUB_BUCKETS, then STATS_SUB_BUCKETS steps per power of two
+static uint64_t
+stats_bucket(uint64_t us)
+{
+  if (us < STATS_SUB_BUCKETS) { return us; }
+
+  uint64_t msb = 0;
+  while (us >> (msb + 1)) { ++msb; }
+  uint64_t sub = (us >> (msb - 2)) & (STATS_SUB_BUCKETS - 1);
+  uint64_t bucket = (msb - 1)*STATS_SUB_BUCKETS + sub;
+  return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+// Smallest latency that falls in `bucket`
+static uint64_t
+stats_bucket_floor(uint64_t bucket)
+{
+  if (bucket < STATS_SUB_BUCKETS) { return bucket; }
+
+  uint64_t msb = bucket / STATS_SUB_BUCKETS + 1;
+  uint64_t sub = bucket % STATS_SUB_BUCKETS;
+  return (STATS_SUB_BUCKETS + sub) << (msb - 2);
+}
+
+// Upper bound of the bucket holding the `quantile` (per mille) sample
+static uint64_t
+stats_quantile_us(StatsSlot *slot, uint64_t quantile)
+{
+  uint64_t count = 0;
+  uint32_t buckets[STATS_BUCKETS];
+  for (uint64_t i = 0; i < STATS_BUCKETS; ++i)
+  {
+    buckets[i] = __atomic_load_n(&slot->buckets[i], __ATOMIC_RELAXED);
+    count += buckets[i];
+  }
+  if (count == 0) { return 0; }
+
+  uint64_t rank = (count*quantile + 999) / 1000;
+  uint64_t seen = 0;
+  for (uint64_t i = 0; i < STATS_BUCKETS; ++i)
+  {
+    seen += buckets[i];
+    if (seen >= rank) { return stats_bucket_floor(i + 1); }
+  }
+  return stats_bucket_floor(STATS_BUCKETS);
+}
+
+#ifndef _WIN32
+
+// Linear probe for `hash` -> claim a free slot when `claim` is set, NULL if absent (or table full)
+static StatsSlot *
+stats_slot(StatsFile *file, uint64_t hash, Str8 name, int32_t claim)
+{
+  for (uint64_t i = 0; i < STATS_SLOTS; ++i)
+  {
+    StatsSlot *slot = &file->slots[(hash + i) % STATS_SLOTS];
+    uint64_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+
+    if (slot_hash == hash) { return slot; }
+    if (slot_hash == 0)
+    {
+      if (!claim) { return NULL; }
+
+      uint64_t expected = 0;
+      if (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      { // Keep the end of the path, it tells shares apart better than the mount prefix
+        Str8 tail = (name.size < STATS_NAME_SIZE) ? name : str8_skip(name, name.size - (STATS_NAME_SIZE - 1));
+        memcpy(slot->name, tail.ptr, tail.size);
+        return slot;
+      }
+      if (expected == hash) { return slot; }
+      // Lost the slot to another destination, keep probing
+    }
+  }
+
+  return NULL;
+}
+
+static int32_t
+metrics_stats_open(Metrics *metrics, Str8 path)
+{
+  int fd = open((char*)path.ptr, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) { return 0; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size < sizeof(StatsFile) && ftruncate(fd, sizeof(StatsFile)) != 0))
+  {
+    close(fd);
+    return 0;
+  }
+
+  void *map = mmap(NULL, sizeof(StatsFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file referenced
+  if (map == MAP_FAILED) { return 0; }
+
+  StatsFile *file = (StatsFile*)map;
+  uint64_t expected = 0;
+  if (__atomic_compare_exchange_n(&file->magic, &expected, STATS_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  { // Fresh (zero filled) file
+    __atomic_store_n(&file->slot_count, STATS_SLOTS, __ATOMIC_RELEASE);
+  }
+  else if (expected != STATS_MAGIC || __atomic_load_n(&file->slot_count, __ATOMIC_ACQUIRE) != STATS_SLOTS)
+  { // Not a stats file (or a different layout), leave it alone
+    munmap(map, sizeof(StatsFile));
+    return 0;
+  }
+
+  metrics->stats = file;
+  return 1;
+}
+
+static void
+metrics_stats_close(Metrics *metrics)
+{
+  if (metrics->stats)
+  {
+    munmap(metrics->stats, sizeof(StatsFile));
+    metrics->stats = NULL;
+  }
+}
+
+static void
+stats_record(StatsFile *file, Str8 dest, CopyMetrics *copy, int32_t ok)
+{
+  StatsSlot *slot = stats_slot(file, str8_hash(dest), dest, 1);
+  if (!slot) { return; } // Table full
+
+  uint64_t latency_us = copy->open_us + copy->xfer_us;
+  __atomic_add_fetch(&slot->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&slot->bytes, copy->bytes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&slot->total_us, latency_us, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&slot->buckets[stats_bucket(latency_us)], 1, __ATOMIC_RELAXED);
+  if (!ok) { __atomic_add_fetch(&slot->failures, 1, __ATOMIC_RELAXED); }
+}
+
+static StatsSlot *
+stats_find(StatsFile *file, Str8 dest)
+{
+  return file ? stats_slot(file, str8_hash(dest), dest, 0) : NULL;
+}
+
+#else // No shared mapping on Windows yet -> only per job metrics
+
+static int32_t metrics_stats_open(Metrics *metrics, Str8 path) { (void)path; metrics->stats = NULL; return 0; }
+static void metrics_stats_close(Metrics *metrics) { metrics->stats = NULL; }
+static void stats_record(StatsFile *file, Str8 dest, CopyMetrics *copy, int32_t ok) { (void)file; (void)dest; (void)copy; (void)ok; }
+static StatsSlot * stats_find(StatsFile *file, Str8 dest) { (void)file; (void)dest; return NULL; }
+
+#endif
+
+static void
+metrics_record(Metrics *metrics, Str8 dest, CopyMetrics *copy, int32_t ok)
+{
+  if (metrics->count < metrics->capacity)
+  {
+    metrics->dests[metrics->count++] = (MetricsDest){ dest, *copy };
+  }
+  if (metrics->stats) { stats_record(metrics->stats, dest, copy, ok); }
+}
+
+//==================================================
+// Report formatting
+//==================================================
+
+// Quote-safe for both JSON strings and Prometheus label values
+static void
+metrics_push_escaped(Str8Builder *builder, Str8 str)
+{
+  for (uint64_t i = 0; i < str.size; ++i)
+  {
+    uint8_t ch = str.ptr[i];
+    if (ch == '"' || ch == '\\')
+    {
+      str8_builder_push_char(builder, '\\');
+      str8_builder_push_char(builder, ch);
+    }
+    else if (ch == '\n') { str8_builder_push(builder, str8_from_lit("\\n")); }
+    else if (ch < 0x20)  { str8_builder_push_char(builder, '?'); }
+    else                 { str8_builder_push_char(builder, ch); }
+  }
+}
+
+// Microseconds -> "S.ffffff"
+static void
+metrics_push_seconds(Str8Builder *builder, uint64_t us)
+{
+  uint8_t frac[6];
+  uint64_t rem = us % 1000000;
+  for (int32_t i = 5; i >= 0; --i)
+  {
+    frac[i] = (uint8_t)('0' + rem % 10);
+    rem /= 10;
+  }
+
+  str8_builder_push_u64(builder, us / 1000000);
+  str8_builder_push_char(builder, '.');
+  str8_builder_push(builder, (Str8){ frac, sizeof(frac) });
+}
+
+static char *metrics_phase_names[METRICS_PHASE_COUNT] = { "args", "csv", "health", "copy", "cleanup" };
+
+// `{dest="...",outcome="..."}`
+static void
+metrics_push_labels(Str8Builder *builder, MetricsDest *dest, char **status_names)
+{
+  str8_builder_push(builder, str8_from_lit("{dest=\""));
+  metrics_push_escaped(builder, dest->path);
+  str8_builder_push(builder, str8_from_lit("\",outcome=\""));
+  str8_builder_push(builder, str8_from_cstr(status_names[dest->copy.status]));
+  str8_builder_push(builder, str8_from_lit("\"}"));
+}
+
+static void
+metrics_push_prometheus(Str8Builder *builder, Metrics *metrics, char **status_names, uint8_t *seen)
+{
+  str8_builder_push(builder, str8_from_lit("# HELP brocopy_phase_seconds Time spent in each phase of the last job.\n"
+                                           "# TYPE brocopy_phase_seconds gauge\n"));
+  for (uint64_t i = 0; i < METRICS_PHASE_COUNT; ++i)
+  {
+    str8_builder_push(builder, str8_from_lit("brocopy_phase_seconds{phase=\""));
+    str8_builder_push(builder, str8_from_cstr(metrics_phase_names[i]));
+    str8_builder_push(builder, str8_from_lit("\"} "));
+    metrics_push_seconds(builder, metrics->phase_us[i]);
+    str8_builder_push_char(builder, '\n');
+  }
+
+  struct { Str8 name; Str8 help; } gauges[] =
+  {
+    { str8_from_lit("brocopy_dest_open_seconds"), str8_from_lit("Time to open the source and destination.") },
+    { str8_from_lit("brocopy_dest_transfer_seconds"), str8_from_lit("Time spent writing and closing the destination.") },
+    { str8_from_lit("brocopy_dest_bytes"), str8_from_lit("Bytes written to the destination.") },
+    { str8_from_lit("brocopy_dest_errno"), str8_from_lit("errno of the failed step, 0 on success.") },
+  };
+
+  for (uint64_t g = 0; g < sizeof(gauges)/sizeof(gauges[0]); ++g)
+  {
+    str8_builder_push(builder, str8_from_lit("# HELP "));
+    str8_builder_push(builder, gauges[g].name);
+    str8_builder_push_char(builder, ' ');
+    str8_builder_push(builder, gauges[g].help);
+    str8_builder_push(builder, str8_from_lit("\n# TYPE "));
+    str8_builder_push(builder, gauges[g].name);
+    str8_builder_push(builder, str8_from_lit(" gauge\n"));
+
+    for (uint64_t i = 0; i < metrics->count; ++i)
+    {
+      MetricsDest *dest = &metrics->dests[i];
+      if (seen[i]) { continue; } // A series can only appear once
+
+      str8_builder_push(builder, gauges[g].name);
+      metrics_push_labels(builder, dest, status_names);
+      str8_builder_push_char(builder, ' ');
+      if (g == 0)      { metrics_push_seconds(builder, dest->copy.open_us); }
+      else if (g == 1) { metrics_push_seconds(builder, dest->copy.xfer_us); }
+      else if (g == 2) { str8_builder_push_u64(builder, dest->copy.bytes); }
+      else             { str8_builder_push_u64(builder, (uint64_t)dest->copy.err); }
+      str8_builder_push_char(builder, '\n');
+    }
+  }
+
+  if (!metrics->stats) { return; }
+
+  str8_builder_push(builder, str8_from_lit("# HELP brocopy_dest_latency_seconds Copy latency of the destination across every job sharing the stats file.\n"
+                                           "# TYPE brocopy_dest_latency_seconds histogram\n"));
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  {
+    StatsSlot *slot = seen[i] ? NULL : stats_find(metrics->stats, metrics->dests[i].path);
+    if (!slot) { continue; }
+
+    // Only powers of two as `le` bounds -> a few dozen series per destination instead of STATS_BUCKETS
+    uint64_t cumulative = 0;
+    for (uint64_t b = 0; b < STATS_BUCKETS; ++b)
+    {
+      cumulative += __atomic_load_n(&slot->buckets[b], __ATOMIC_RELAXED);
+      if ((b + 1) % STATS_SUB_BUCKETS != 0 && b + 1 > 2) { continue; }
+
+      str8_builder_push(builder, str8_from_lit("brocopy_dest_latency_seconds_bucket{dest=\""));
+      metrics_push_escaped(builder, metrics->dests[i].path);
+      str8_builder_push(builder, str8_from_lit("\",le=\""));
+      metrics_push_seconds(builder, stats_bucket_floor(b + 1));
+      str8_builder_push(builder, str8_from_lit("\"} "));
+      str8_builder_push_u64(builder, cumulative);
+      str8_builder_push_char(builder, '\n');
+    }
+
+    Str8 series[] = { str8_from_lit("_bucket"), str8_from_lit("_sum"), str8_from_lit("_count") };
+    for (uint64_t s = 0; s < 3; ++s)
+    {
+      str8_builder_push(builder, str8_from_lit("brocopy_dest_latency_seconds"));
+      str8_builder_push(builder, series[s]);
+      str8_builder_push(builder, str8_from_lit("{dest=\""));
+      metrics_push_escaped(builder, metrics->dests[i].path);
+      str8_builder_push(builder, (s == 0) ? str8_from_lit("\",le=\"+Inf\"} ") : str8_from_lit("\"} "));
+      if (s == 1) { metrics_push_seconds(builder, __atomic_load_n(&slot->total_us, __ATOMIC_RELAXED)); }
+      else        { str8_builder_push_u64(builder, cumulative); }
+      str8_builder_push_char(builder, '\n');
+    }
+  }
+
+  str8_builder_push(builder, str8_from_lit("# HELP brocopy_dest_failures_total Failed copies to the destination across every job sharing the stats file.\n"
+                                           "# TYPE brocopy_dest_failures_total counter\n"));
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  {
+    StatsSlot *slot = seen[i] ? NULL : stats_find(metrics->stats, metrics->dests[i].path);
+    if (!slot) { continue; }
+
+    str8_builder_push(builder, str8_from_lit("brocopy_dest_failures_total{dest=\""));
+    metrics_push_escaped(builder, metrics->dests[i].path);
+    str8_builder_push(builder, str8_from_lit("\"} "));
+    str8_builder_push_u64(builder, __atomic_load_n(&slot->failures, __ATOMIC_RELAXED));
+    str8_builder_push_char(builder, '\n');
+  }
+}
+
+static void
+metrics_push_json(Str8Builder *builder, Metrics *metrics, char **status_names)
+{
+  str8_builder_push(builder, str8_from_lit("{\n  \"phases_us\": {"));
+  for (uint64_t i = 0; i < METRICS_PHASE_COUNT; ++i)
+  {
+    str8_builder_push(builder, (i == 0) ? str8_from_lit(" \"") : str8_from_lit(", \""));
+    str8_builder_push(builder, str8_from_cstr(metrics_phase_names[i]));
+    str8_builder_push(builder, str8_from_lit("\": "));
+    str8_builder_push_u64(builder, metrics->phase_us[i]);
+  }
+  str8_builder_push(builder, str8_from_lit(" },\n  \"destinations\": ["));
+
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  {
+    MetricsDest *dest = &metrics->dests[i];
+    str8_builder_push(builder, (i == 0) ? str8_from_lit("\n    {\"dest\": \"") : str8_from_lit(",\n    {\"dest\": \""));
+    metrics_push_escaped(builder, dest->path);
+    str8_builder_push(builder, str8_from_lit("\", \"outcome\": \""));
+    str8_builder_push(builder, str8_from_cstr(status_names[dest->copy.status]));
+    str8_builder_push(builder, str8_from_lit("\", \"open_us\": "));
+    str8_builder_push_u64(builder, dest->copy.open_us);
+    str8_builder_push(builder, str8_from_lit(", \"transfer_us\": "));
+    str8_builder_push_u64(builder, dest->copy.xfer_us);
+    str8_builder_push(builder, str8_from_lit(", \"bytes\": "));
+    str8_builder_push_u64(builder, dest->copy.bytes);
+    str8_builder_push(builder, str8_from_lit(", \"errno\": "));
+    str8_builder_push_u64(builder, (uint64_t)dest->copy.err);
+
+    StatsSlot *slot = stats_find(metrics->stats, dest->path);
+    if (slot)
+    { // History across runs
+      str8_builder_push(builder, str8_from_lit(", \"history\": {\"count\": "));
+      str8_builder_push_u64(builder, __atomic_load_n(&slot->count, __ATOMIC_RELAXED));
+      str8_builder_push(builder, str8_from_lit(", \"failures\": "));
+      str8_builder_push_u64(builder, __atomic_load_n(&slot->failures, __ATOMIC_RELAXED));
+      str8_builder_push(builder, str8_from_lit(", \"p50_us\": "));
+      str8_builder_push_u64(builder, stats_quantile_us(slot, 500));
+      str8_builder_push(builder, str8_from_lit(", \"p99_us\": "));
+      str8_builder_push_u64(builder, stats_quantile_us(slot, 990));
+      str8_builder_push_char(builder, '}');
+    }
+    str8_builder_push_char(builder, '}');
+  }
+
+  str8_builder_push(builder, str8_from_lit("\n  ]\n}\n"));
+}
+
+// Dump the job -> Prometheus textfile if `path` ends in ".prom", JSON otherwise.
+// `status_names` maps CopyMetrics.status to the outcome label. Return 0 on failure.
+static int32_t
+metrics_write(Metrics *metrics, Str8 path, char **status_names)
+{
+  Scratch tmp = scratch_get(NULL, 0);
+  int32_t result = 0;
+
+  // Repeated destinations (possible with --all-csv-paths) would be duplicate Prometheus series
+  uint8_t *seen = (uint8_t*)arena_push(tmp.arena, metrics->count + 1);
+  uint64_t set_size = 64;
+  while (set_size < metrics->count*2) { set_size <<= 1; }
+  uint64_t *set = (uint64_t*)arena_push(tmp.arena, set_size*sizeof(uint64_t));
+  if (!seen || !set)
+  {
+    scratch_end(tmp);
+    return 0;
+  }
+  memset(set, 0, set_size*sizeof(uint64_t));
+  for (uint64_t i = 0; i < metrics->count; ++i)
+  { // Hash set of path indices (+1), collisions fall back to comparing the paths
+    Str8 dest = metrics->dests[i].path;
+    uint64_t slot = str8_hash(dest) & (set_size - 1);
+    seen[i] = 0;
+    while (set[slot] && !(seen[i] = str8_equals(metrics->dests[set[slot] - 1].path, dest)))
+    {
+      slot = (slot + 1) & (set_size - 1);
+    }
+    if (!seen[i]) { set[slot] = i + 1; }
+  }
+
+  Str8Builder builder = str8_builder_begin(tmp.arena);
+  if (str8_equals(str8_postfix(path, 5), str8_from_lit(".prom")))
+  {
+    metrics_push_prometheus(&builder, metrics, status_names, seen);
+  }
+  else
+  {
+    metrics_push_json(&builder, metrics, status_names);
+  }
+  Str8 report = str8_builder_end(&builder, 0);
+
+  // Write a sibling and rename it over `path` -> readers see the previous report or this one
+  Str8Builder tmp_builder = str8_builder_begin(tmp.arena);
+  str8_builder_push(&tmp_builder, path);
+  str8_builder_push(&tmp_builder, str8_from_lit(".tmp"));
+  Str8 tmp_path = str8_builder_end(&tmp_builder, 1);
+
+  FILE *stream = (report.ptr && tmp_path.ptr) ? fopen((char*)tmp_path.ptr, "wb") : NULL;
+  if (stream)
+  {
+    result = (fwrite(report.ptr, 1, report.size, stream) == report.size);
+    result = (fclose(stream) == 0) && result;
+#ifdef _WIN32
+    result = result && MoveFileExA((char*)tmp_path.ptr, (char*)path.ptr, MOVEFILE_REPLACE_EXISTING);
+#else
+    result = result && (rename((char*)tmp_path.ptr, (char*)path.ptr) == 0);
+#endif
+    if (!result) { remove((char*)tmp_path.ptr); }
+  }
+
+  scratch_end(tmp);
+  return result;
+}
@@ -0,0 +1,429 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Spool (Failed destinations retried in the background, --drain)
+//==================================================
+/*
+   A broadcast with --spool <dir> leaves what it could not deliver in <dir>, and returns:
+      <id>.src  snapshot of the source (the original may be removed, or replaced by the next job)
+      <id>.job  text, one line per destination left ("dest <attempts> <next_at_ms> <path>")
+   `brocopy --drain <dir>` retries the due destinations of every job file, a few jobs at a time,
+   backing off exponentially per destination until it is delivered or SPOOL_ATTEMPTS_MAX is hit,
+   and exits once the spool is empty. Job files are rewritten whole (rename) under flock, so
+   several drains (and new broadcasts) can share a spool.
+*/
+
+#ifndef _WIN32
+
+static uint64_t
+spool_backoff_ms(uint64_t attempts)
+{
+  if (attempts == 0) { return 0; }
+  uint64_t shift = attempts - 1;
+  if (shift > 20) { return SPOOL_BACKOFF_MAX_MS; }
+
+  uint64_t backoff = (uint64_t)SPOOL_BACKOFF_BASE_MS << shift;
+  return (backoff > SPOOL_BACKOFF_MAX_MS) ? SPOOL_BACKOFF_MAX_MS : backoff;
+}
+
+// Write `content` to `path` through a synced temporary file -> readers see the old file or the new one
+static int32_t
+spool_write_file(Str8 path, Str8 content)
+{
+  Scratch tmp = scratch_get(NULL, 0);
+  Str8 tmp_path = str8_pushf(tmp.arena, "%s.tmp", (char*)path.ptr);
+  int32_t fd = open((char*)tmp_path.ptr, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  int32_t result = (fd >= 0);
+  for (uint64_t off = 0; result && off < content.size;)
+  {
+    ssize_t b_written = write(fd, content.ptr + off, (size_t)(content.size - off));
+    if (b_written < 0 && errno == EINTR) { continue; }
+    if (b_written <= 0) { result = 0; }
+    else { off += (uint64_t)b_written; }
+  }
+  if (fd >= 0 && (fsync(fd) != 0 || close(fd) != 0)) { result = 0; }
+  if (result) { result = (rename((char*)tmp_path.ptr, (char*)path.ptr) == 0); }
+  if (!result) { unlink((char*)tmp_path.ptr); }
+  scratch_end(tmp);
+  return result;
+}
+
+// Copy the source aside -> it must outlive the job (--remove-src, the next print job)
+static int32_t
+spool_snapshot(Str8 src, Str8 dest)
+{
+  uint8_t buf[64*1024];
+  int32_t src_fd = open((char*)src.ptr, O_RDONLY | O_CLOEXEC);
+  int32_t dest_fd = (src_fd >= 0) ? open((char*)dest.ptr, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644) : -1;
+  int32_t result = (dest_fd >= 0);
+  if (result)
+  { // In kernel (or a reflink) when the spool shares the source's filesystem
+    CopyRun run = {0};
+    run.src_fd = src_fd;
+    run.dest_fd = dest_fd;
+    run.end = UINT64_MAX;
+    run.buf = buf;
+    run.buf_size = sizeof(buf);
+    result = copy_backend_range(&run);
+    if (result < 0) { result = copy_backend_rw(&run); }
+    result = (result > 0 && fsync(dest_fd) == 0);
+  }
+  if (src_fd >= 0) { close(src_fd); }
+  if (dest_fd >= 0 && close(dest_fd) != 0) { result = 0; }
+  if (!result && dest_fd >= 0) { unlink((char*)dest.ptr); }
+  return result;
+}
+
+static Str8
+spool_job_format(Arena *arena, SpoolJob *job)
+{
+  Str8Builder builder = str8_builder_begin(arena);
+  str8_builder_push(&builder, str8_from_lit(SPOOL_HEADER "\nsrc "));
+  str8_builder_push(&builder, job->src);
+  str8_builder_push(&builder, str8_from_lit("\norig "));
+  str8_builder_push(&builder, job->orig);
+  str8_builder_push_char(&builder, '\n');
+  for (uint64_t i = 0; i < job->count; ++i)
+  {
+    str8_builder_push(&builder, str8_from_lit("dest "));
+    str8_builder_push_u64(&builder, job->dests[i].attempts);
+    str8_builder_push_char(&builder, ' ');
+    str8_builder_push_u64(&builder, job->dests[i].next_at_ms);
+    str8_builder_push_char(&builder, ' ');
+    str8_builder_push(&builder, job->dests[i].path);
+    str8_builder_push_char(&builder, '\n');
+  }
+  return str8_builder_end(&builder, 1);
+}
+
+// Parse a job file -> 0 if it isn't one. Strings are null terminated copies on `arena`.
+static int32_t
+spool_job_load(Arena *arena, Str8 path, SpoolJob *job)
+{
+  *job = (SpoolJob){0};
+  Str8 content = str8_buffer_file(arena, path);
+  uint64_t capacity = 0;
+  for (uint64_t i = 0; i < content.size; ++i) { capacity += (content.ptr[i] == '\n'); }
+  job->dests = (SpoolDest*)arena_push(arena, (capacity + 1)*sizeof(SpoolDest));
+  if (!job->dests) { return 0; }
+
+  int32_t header = 0;
+  while (content.size > 0)
+  {
+    uint64_t eol = str8_index(content, '\n');
+    Str8 line = str8_prefix(content, eol);
+    content = str8_skip(content, eol + 1);
+
+    if (!header)
+    {
+      if (!str8_equals(line, str8_from_lit(SPOOL_HEADER))) { return 0; }
+      header = 1;
+    }
+    else if (str8_match(line, str8_from_lit("src "), 4))
+    {
+      job->src = str8_push_copy_term(arena, str8_skip(line, 4));
+    }
+    else if (str8_match(line, str8_from_lit("orig "), 5))
+    {
+      job->orig = str8_push_copy_term(arena, str8_skip(line, 5));
+    }
+    else if (str8_match(line, str8_from_lit("dest "), 5))
+    {
+      SpoolDest *dest = &job->dests[job->count];
+      Str8 rest = str8_skip(line, 5);
+      uint64_t space = str8_index(rest, ' ');
+      if (!str8_parse_u64(str8_prefix(rest, space), &dest->attempts)) { return 0; }
+      rest = str8_skip(rest, space + 1);
+      space = str8_index(rest, ' ');
+      if (!str8_parse_u64(str8_prefix(rest, space), &dest->next_at_ms)) { return 0; }
+      dest->path = str8_push_copy_term(arena, str8_skip(rest, space + 1));
+      if (dest->path.size == 0) { return 0; }
+      ++job->count;
+    }
+  }
+
+  return header && job->src.size > 0;
+}
+
+// Spool the destinations of `job` that were not delivered (failed, timed out, skipped, mismatched,
+// circuit open) with a snapshot of its source. Return the number spooled.
+static uint64_t
+spool_push(Str8 dir, Broadcast *job)
+{
+  static uint64_t spool_seq; // Atomic, tells apart the jobs a process spools within one ms
+  Scratch tmp = scratch_get(NULL, 0);
+  uint64_t amt_held = job->held ? job->held->count : 0;
+  SpoolJob spooled = {0};
+  spooled.dests = (SpoolDest*)arena_push(tmp.arena, (job->metrics->count + amt_held + 1)*sizeof(SpoolDest));
+  if (!spooled.dests)
+  {
+    scratch_end(tmp);
+    return 0;
+  }
+
+  uint64_t now_ms = os_wall_ms();
+  for (uint64_t i = 0; i < job->metrics->count; ++i)
+  {
+    MetricsDest *dest = &job->metrics->dests[i];
+    if (dest->copy.status == COPY_OK) { continue; }
+    spooled.dests[spooled.count++] = (SpoolDest){ dest->path, 1, now_ms + spool_backoff_ms(1) };
+  }
+  for (uint64_t i = 0; i < amt_held; ++i)
+  { // Not attempted -> first retry once the circuit would let it through anyway
+    spooled.dests[spooled.count++] = (SpoolDest){ str8_array_get(job->held, i), 0, now_ms + spool_backoff_ms(1) };
+  }
+  if (spooled.count == 0)
+  {
+    scratch_end(tmp);
+    return 0;
+  }
+
+  uint64_t seq = __atomic_fetch_add(&spool_seq, 1, __ATOMIC_RELAXED);
+  Str8 id = str8_pushf(tmp.arena, "%s%c%" PRIu64 "-%d-%" PRIu64, (char*)dir.ptr, OS_SLASH, now_ms, (int)getpid(), seq);
+  spooled.src = str8_pushf(tmp.arena, "%s.src", (char*)id.ptr);
+  spooled.orig = str8_from_cstr((char*)job->src.ptr); // Without the terminator a CLI path keeps
+  Str8 job_path = str8_pushf(tmp.arena, "%s.job", (char*)id.ptr);
+
+  uint64_t result = spooled.count;
+  if (!spool_snapshot(job->src, spooled.src))
+  {
+    log_printf(job->log, LOG_ERROR, "Could not snapshot \"%s\" into the spool \"%s\" (error %d), %" PRIu64 " destinations lost",
+               (char*)job->src.ptr, (char*)dir.ptr, errno, spooled.count);
+    result = 0;
+  }
+  else if (!spool_write_file(job_path, spool_job_format(tmp.arena, &spooled)))
+  {
+    log_printf(job->log, LOG_ERROR, "Could not write \"%s\" (error %d), %" PRIu64 " destinations lost",
+               (char*)job_path.ptr, errno, spooled.count);
+    unlink((char*)spooled.src.ptr);
+    result = 0;
+  }
+  else
+  {
+    log_printf(job->log, LOG_INFO, "Spooled %" PRIu64 " undelivered destinations of \"%s\" (\"%s\", retried by --drain)",
+               spooled.count, (char*)job->src.ptr, (char*)job_path.ptr);
+  }
+
+  scratch_end(tmp);
+  return result;
+}
+
+// Retry the due destinations of one job file, then rewrite it (or remove it with its snapshot once
+// nothing is left). Return 0 if another drain holds it (or it vanished).
+static int32_t
+spool_retry(Broadcast *proto, Str8 path)
+{
+  int32_t fd = open((char*)path.ptr, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { return 0; }
+
+  struct stat locked_st;
+  struct stat path_st;
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &locked_st) != 0 || stat((char*)path.ptr, &path_st) != 0 ||
+      locked_st.st_ino != path_st.st_ino)
+  { // Busy, or rewritten by the drain we waited for -> its next round
+    close(fd);
+    return 0;
+  }
+
+  Arena arena = arena_alloc(SPOOL_ARENA_RESERVE);
+  SpoolJob spooled;
+  if (!spool_job_load(&arena, path, &spooled))
+  {
+    log_printf(proto->log, LOG_ERROR, "\"%s\" is not a spool job file, set aside as .bad", (char*)path.ptr);
+    rename((char*)path.ptr, (char*)str8_pushf(&arena, "%s.bad", (char*)path.ptr).ptr);
+    close(fd);
+    arena_free(&arena);
+    return 1;
+  }
+
+  uint64_t now_ms = os_wall_ms();
+  Str8Array due = str8_array_alloc();
+  Str8Array held = str8_array_alloc();
+  for (uint64_t i = 0; i < spooled.count; ++i)
+  {
+    if (spooled.dests[i].next_at_ms <= now_ms) { str8_array_push(&due, spooled.dests[i].path); }
+  }
+  log_printf(proto->log, LOG_INFO, "Retrying %" PRIu64 " of %" PRIu64 " spooled destinations of \"%s\" (\"%s\")",
+             due.count, spooled.count, (char*)spooled.orig.ptr, (char*)path.ptr);
+
+  Metrics metrics = metrics_begin();
+  metrics.stats = proto->metrics ? proto->metrics->stats : NULL;
+  Broadcast job = *proto;
+  job.src = spooled.src;
+  job.src_fd = -1;
+  job.paths = &due;
+  job.start_ms = os_now_us() / 1000;
+  job.metrics = &metrics;
+  job.journal = NULL;
+  job.held = &held;
+  broadcast_partition(&job);
+  metrics_reserve(&metrics, &arena, due.count);
+  broadcast_copy(&job, &arena);
+  broadcast_verify(&job, &arena);
+
+  uint64_t amt_left = 0;
+  for (uint64_t i = 0; i < spooled.count; ++i)
+  {
+    SpoolDest dest = spooled.dests[i];
+    if (dest.next_at_ms <= now_ms)
+    {
+      CopyMetrics *copy = NULL;
+      for (uint64_t j = 0; j < metrics.count && !copy; ++j)
+      {
+        if (str8_equals(metrics.dests[j].path, dest.path)) { copy = &metrics.dests[j].copy; }
+      }
+
+      if (copy && copy->status == COPY_OK)
+      {
+        log_printf(proto->log, LOG_INFO, "Delivered \"%s\" to \"%s\" after %" PRIu64 " failed attempts (spool)",
+                   (char*)spooled.orig.ptr, (char*)dest.path.ptr, dest.attempts);
+        continue;
+      }
+      if (copy && ++dest.attempts >= SPOOL_ATTEMPTS_MAX)
+      {
+        log_printf(proto->log, LOG_ERROR, "Giving up on \"%s\" to \"%s\" after %" PRIu64 " attempts (spool)",
+                   (char*)spooled.orig.ptr, (char*)dest.path.ptr, dest.attempts);
+        continue;
+      }
+      // Failed, or held back by the circuit breaker (not an attempt)
+      dest.next_at_ms = now_ms + spool_backoff_ms(dest.attempts ? dest.attempts : 1);
+    }
+    spooled.dests[amt_left++] = dest;
+  }
+  spooled.count = amt_left;
+
+  if (amt_left == 0)
+  {
+    unlink((char*)path.ptr);
+    unlink((char*)spooled.src.ptr);
+  }
+  else if (!spool_write_file(path, spool_job_format(&arena, &spooled)))
+  {
+    log_printf(proto->log, LOG_ERROR, "Could not update \"%s\" (error %d), its retries will repeat", (char*)path.ptr, errno);
+  }
+
+  close(fd); // Releases the lock, after the rename
+  str8_array_free(&held);
+  str8_array_free(&due);
+  arena_free(&arena);
+  return 1;
+}
+
+static void *
+spool_drain_thread(void *param)
+{
+  SpoolDrain *drain = (SpoolDrain*)param;
+  for (;;)
+  {
+    uint64_t idx = __atomic_fetch_add(&drain->next, 1, __ATOMIC_RELAXED);
+    if (idx >= drain->jobs.count) { break; }
+    if (spool_retry(drain->proto, str8_array_get(&drain->jobs, idx)))
+    {
+      __atomic_fetch_add(&drain->retried, 1, __ATOMIC_RELAXED);
+    }
+  }
+  scratch_thread_release();
+  return NULL;
+}
+
+// Earliest retry of a job file (read without its lock, a stale answer only shifts a round) -> 0 if unreadable
+static int32_t
+spool_job_next_at(Str8 path, uint64_t *next_at_ms)
+{
+  Scratch tmp = scratch_get(NULL, 0);
+  SpoolJob spooled;
+  int32_t result = spool_job_load(tmp.arena, path, &spooled);
+  *next_at_ms = result ? UINT64_MAX : 0;
+  for (uint64_t i = 0; i < spooled.count; ++i)
+  {
+    if (spooled.dests[i].next_at_ms < *next_at_ms) { *next_at_ms = spooled.dests[i].next_at_ms; }
+  }
+  if (result && spooled.count == 0) { *next_at_ms = 0; } // Nothing left -> a retry cleans it up
+  scratch_end(tmp);
+  return result;
+}
+
+// Retry the spool in rounds until it is empty: each round, up to `threads` due jobs at once, then
+// sleep until the next one is due. Return 0 if `dir` can't be read.
+static int32_t
+spool_drain(Str8 dir, Broadcast *proto, uint32_t threads)
+{
+  threads = threads ? threads : SPOOL_DRAIN_THREADS;
+  for (;;)
+  {
+    DIR *handle = opendir((char*)dir.ptr);
+    if (!handle)
+    {
+      log_printf(proto->log, LOG_ERROR, "Could not open the spool \"%s\" (error %d)", (char*)dir.ptr, errno);
+      return 0;
+    }
+
+    Scratch tmp = scratch_get(NULL, 0);
+    SpoolDrain drain = {0};
+    drain.proto = proto;
+    drain.jobs = str8_array_alloc();
+    uint64_t amt_jobs = 0;
+    uint64_t now_ms = os_wall_ms();
+    uint64_t wake_at_ms = now_ms + SPOOL_POLL_MAX_MS;
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL)
+    {
+      Str8 name = str8_from_cstr(entry->d_name);
+      if (name.size <= 4 || !str8_equals(str8_postfix(name, 4), str8_from_lit(".job"))) { continue; }
+
+      Str8 path = str8_pushf(tmp.arena, "%s%c%s", (char*)dir.ptr, OS_SLASH, entry->d_name);
+      uint64_t next_at_ms;
+      spool_job_next_at(path, &next_at_ms); // Unreadable -> due, its retry sets it aside
+      ++amt_jobs;
+      if (next_at_ms <= now_ms) { str8_array_push(&drain.jobs, path); }
+      else if (next_at_ms < wake_at_ms) { wake_at_ms = next_at_ms; }
+    }
+    closedir(handle);
+
+    if (drain.jobs.count > 0)
+    {
+      pthread_t pool[COPY_CHUNK_THREADS_MAX];
+      uint64_t amt_threads = 0;
+      uint64_t wanted = (drain.jobs.count < threads) ? drain.jobs.count : threads;
+      if (wanted > COPY_CHUNK_THREADS_MAX) { wanted = COPY_CHUNK_THREADS_MAX; }
+      while (amt_threads + 1 < wanted && pthread_create(&pool[amt_threads], NULL, spool_drain_thread, &drain) == 0) { ++amt_threads; }
+      spool_drain_thread(&drain);
+      for (uint64_t i = 0; i < amt_threads; ++i) { pthread_join(pool[i], NULL); }
+    }
+    str8_array_free(&drain.jobs);
+    scratch_end(tmp);
+
+    if (amt_jobs == 0) { break; } // Drained
+    if (drain.retried == 0)
+    { // Nothing due (or only jobs another drain holds) -> sleep
+      now_ms = os_wall_ms();
+      uint64_t sleep_ms = (wake_at_ms > now_ms) ? wake_at_ms - now_ms : 1000;
+      log_flush(proto->log);
+      poll(NULL, 0, (int)((sleep_ms < SPOOL_POLL_MAX_MS) ? sleep_ms : SPOOL_POLL_MAX_MS));
+    }
+  }
+
+  log_printf(proto->log, LOG_INFO, "Spool \"%s\" drained", (char*)dir.ptr);
+  return 1;
+}
+
+#else // No flock/dirent here yet -> nothing is spooled
+
+static uint64_t
+spool_push(Str8 dir, Broadcast *job)
+{
+  log_printf(job->log, LOG_WARN, "Spooling is not available on Windows, ignoring \"%s\".", (char*)dir.ptr);
+  return 0;
+}
+
+static int32_t
+spool_drain(Str8 dir, Broadcast *proto, uint32_t threads)
+{
+  (void)threads;
+  log_printf(proto->log, LOG_ERROR, "Draining \"%s\": spooling is not available on Windows.", (char*)dir.ptr);
+  return 0;
+}
+
+#endif
@@ -1,5 +1,5 @@
-#ifndef BROCOPY_H
-#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#ifndef BROCOPY_BASE_H
+#include "base.h" // only to make it possible to use -fsyntax-only
 #endif
 
 //==================================================
@@ -9,7 +9,8 @@
 static Str8
 str8_push(Arena *arena, uint64_t size)
 {
-  return (Str8){ (uint8_t*)arena_push(arena, size), size };
+  uint8_t *ptr = (uint8_t*)arena_push(arena, size);
+  return (Str8){ ptr, ptr ? size : 0 };
 }
 
 static Str8
@@ -26,7 +27,7 @@ str8_pushf(Arena *arena, char *fmt, ...)
   if (len >= 0)
   {
     result.ptr = (uint8_t*)arena_push(arena, (uint64_t)len + 1); // vsnprintf writes `bufsz - 1` + NULL char
-    result.size = len;
+    result.size = result.ptr ? (uint64_t)len : 0;
     if (result.ptr) vsnprintf((char*)result.ptr, result.size + 1, fmt, args);
   }
   va_end(args);
@@ -37,10 +38,8 @@ str8_pushf(Arena *arena, char *fmt, ...)
 static Str8
 str8_push_copy(Arena *arena, Str8 str)
 {
-  Str8 result;
-  result.ptr = (uint8_t*)arena_push(arena, str.size);
-  result.size = str.size;
-  memcpy(result.ptr, str.ptr, str.size);
+  Str8 result = str8_push(arena, str.size);
+  if (result.ptr) { memcpy(result.ptr, str.ptr, str.size); }
   return result;
 }
 
@@ -67,10 +66,235 @@ str8_list_push(Arena *arena, Str8List *list)
   return node;
 }
 
+static Str8Array
+str8_array_alloc(void)
+{
+  Str8Array array = {0};
+  array.bytes = arena_alloc(STR8_ARRAY_RESERVE_SIZE);
+  array.offsets_mem = arena_alloc(STR8_ARRAY_RESERVE_SIZE);
+  array.sizes_mem = arena_alloc(STR8_ARRAY_RESERVE_SIZE);
+  array.offsets = (uint64_t*)array.offsets_mem.base;
+  array.sizes = (uint64_t*)array.sizes_mem.base;
+  return array;
+}
+
+static void
+str8_array_free(Str8Array *array)
+{
+  arena_free(&array->bytes);
+  arena_free(&array->offsets_mem);
+  arena_free(&array->sizes_mem);
+  *array = (Str8Array){0};
+}
+
+// Empty the array but keep its reservations -> reused across jobs
+static void
+str8_array_clear(Str8Array *array)
+{
+  arena_clear(&array->bytes);
+  arena_clear(&array->offsets_mem);
+  arena_clear(&array->sizes_mem);
+  array->count = 0;
+}
+
+// Copy `str` (+ null terminator) to the end of the array, return 1 on success
+static int32_t
+str8_array_push(Str8Array *array, Str8 str)
+{
+  uint64_t offset = array->bytes.pos;
+  uint8_t *dst = (uint8_t*)arena_push_bytes(&array->bytes, str.size + 1);
+  uint64_t *offset_slot = (uint64_t*)arena_push(&array->offsets_mem, sizeof(uint64_t));
+  uint64_t *size_slot = (uint64_t*)arena_push(&array->sizes_mem, sizeof(uint64_t));
+  if (!dst || !offset_slot || !size_slot) { return 0; }
+
+  memcpy(dst, str.ptr, str.size);
+  dst[str.size] = '\0';
+  *offset_slot = offset;
+  *size_slot = str.size;
+  ++array->count;
+  return 1;
+}
+
+static Str8
+str8_array_get(Str8Array *array, uint64_t idx)
+{
+  return (Str8){ array->bytes.base + array->offsets[idx], array->sizes[idx] };
+}
+
+static void
+str8_array_swap(Str8Array *array, uint64_t a, uint64_t b)
+{
+  uint64_t offset = array->offsets[a], size = array->sizes[a];
+  array->offsets[a] = array->offsets[b];
+  array->sizes[a] = array->sizes[b];
+  array->offsets[b] = offset;
+  array->sizes[b] = size;
+}
+
+static void
+str8_array_sift_down(Str8Array *array, uint64_t root, uint64_t count, int32_t insensitive)
+{
+  for (uint64_t child; (child = 2*root + 1) < count; root = child)
+  {
+    if (child + 1 < count &&
+        str8_compare(str8_array_get(array, child), str8_array_get(array, child + 1), insensitive) < 0)
+    {
+      ++child;
+    }
+    if (str8_compare(str8_array_get(array, root), str8_array_get(array, child), insensitive) >= 0) { return; }
+    str8_array_swap(array, root, child);
+  }
+}
+
+// In place heapsort -> only `offsets`/`sizes` move, the blob stays untouched
+static void
+str8_array_sort(Str8Array *array, int32_t insensitive)
+{
+  for (uint64_t i = array->count / 2; i > 0; --i)
+  {
+    str8_array_sift_down(array, i - 1, array->count, insensitive);
+  }
+  for (uint64_t end = array->count; end > 1; --end)
+  {
+    str8_array_swap(array, 0, end - 1);
+    str8_array_sift_down(array, 0, end - 1, insensitive);
+  }
+}
+
+// Drop adjacent duplicates (sort first) and return the new count
+static uint64_t
+str8_array_dedup(Str8Array *array, int32_t insensitive)
+{
+  uint64_t kept = (array->count > 0);
+  for (uint64_t i = 1; i < array->count; ++i)
+  {
+    if (str8_compare(str8_array_get(array, kept - 1), str8_array_get(array, i), insensitive) != 0)
+    {
+      array->offsets[kept] = array->offsets[i];
+      array->sizes[kept] = array->sizes[i];
+      ++kept;
+    }
+  }
+
+  array->count = kept;
+  return kept;
+}
+
+// Binary search on a sorted array -> index of `str` or array->count
+static uint64_t
+str8_array_find(Str8Array *array, Str8 str, int32_t insensitive)
+{
+  uint64_t lo = 0, hi = array->count;
+  while (lo < hi)
+  {
+    uint64_t mid = lo + (hi - lo) / 2;
+    int32_t cmp = str8_compare(str8_array_get(array, mid), str, insensitive);
+    if (cmp == 0) { return mid; }
+    if (cmp < 0) { lo = mid + 1; }
+    else         { hi = mid; }
+  }
+
+  return array->count;
+}
+
 static Str8
 str8_append(Arena *arena, Str8 lhs, Str8 rhs)
 {
-  return str8_pushf(arena, "%.*s%.*s", (int)lhs.size, lhs.ptr, (int)rhs.size, rhs.ptr);
+  Str8Builder builder = str8_builder_begin(arena);
+  str8_builder_push(&builder, lhs);
+  str8_builder_push(&builder, rhs);
+  return str8_builder_end(&builder, 1);
+}
+
+static Str8Builder
+str8_builder_begin(Arena *arena)
+{
+  Str8Builder builder = {0};
+  builder.arena = arena;
+  builder.str.ptr = arena->base + arena->pos;
+  return builder;
+}
+
+// Reserve `size` more bytes right after the built ones -> NULL once the builder failed
+static uint8_t *
+str8_builder_grow(Str8Builder *builder, uint64_t size)
+{
+  if (builder->failed) { return NULL; }
+
+  Arena *arena = builder->arena;
+  uint8_t *dst = NULL;
+  if (arena->base + arena->pos == builder->str.ptr + builder->str.size)
+  {
+    dst = (uint8_t*)arena_push_bytes(arena, size);
+  }
+
+  if (!dst)
+  {
+    builder->failed = 1;
+    return NULL;
+  }
+
+  builder->str.size += size;
+  return dst;
+}
+
+static void
+str8_builder_push(Str8Builder *builder, Str8 str)
+{
+  uint8_t *dst = str8_builder_grow(builder, str.size);
+  if (dst) { memcpy(dst, str.ptr, str.size); }
+}
+
+static void
+str8_builder_push_char(Str8Builder *builder, uint8_t ch)
+{
+  uint8_t *dst = str8_builder_grow(builder, 1);
+  if (dst) { *dst = ch; }
+}
+
+static void
+str8_builder_push_u64(Str8Builder *builder, uint64_t value)
+{
+  uint8_t digits[20]; // UINT64_MAX has 20 digits
+  uint64_t count = 0;
+  do
+  {
+    digits[sizeof(digits) - ++count] = (uint8_t)('0' + value % 10);
+    value /= 10;
+  } while (value);
+
+  str8_builder_push(builder, (Str8){ digits + sizeof(digits) - count, count });
+}
+
+static Str8
+str8_builder_end(Str8Builder *builder, int32_t null_terminate)
+{
+  if (null_terminate)
+  {
+    str8_builder_push_char(builder, '\0');
+    builder->str.size -= !builder->failed;
+  }
+
+  if (builder->failed)
+  { // Roll back what we pushed, unless someone else pushed after us
+    Arena *arena = builder->arena;
+    if (arena->base + arena->pos == builder->str.ptr + builder->str.size)
+    {
+      arena->pos = (uint64_t)(builder->str.ptr - arena->base);
+    }
+    return (Str8){0};
+  }
+
+  return builder->str;
+}
+
+// Copy `str` + null terminator, the common case of building from a single slice
+static Str8
+str8_push_copy_term(Arena *arena, Str8 str)
+{
+  Str8Builder builder = str8_builder_begin(arena);
+  str8_builder_push(&builder, str);
+  return str8_builder_end(&builder, 1);
 }
 
 // Change elements of Str8 -> vsnprintf truncates new format if it exceed Str8 size
@@ -99,17 +323,27 @@ str8_equals(Str8 lhs, Str8 rhs)
   return 1;
 }
 
+// Lexicographic order (shorter first on a common prefix) -> <0, 0 or >0
 static int32_t
-str8_equals_insensitive(Str8 lhs, Str8 rhs)
+str8_compare(Str8 lhs, Str8 rhs, int32_t insensitive)
 {
-  if (lhs.size != rhs.size) { return 0; }
-
-  for (uint64_t i = 0; i < lhs.size; ++i)
+  uint64_t size = (lhs.size < rhs.size) ? lhs.size : rhs.size;
+  for (uint64_t i = 0; i < size; ++i)
   {
-    if (to_lower(lhs.ptr[i]) != to_lower(rhs.ptr[i])) { return 0; }
+    int32_t l = insensitive ? to_lower(lhs.ptr[i]) : lhs.ptr[i];
+    int32_t r = insensitive ? to_lower(rhs.ptr[i]) : rhs.ptr[i];
+    if (l != r) { return l - r; }
   }
 
-  return 1;
+  return (lhs.size > rhs.size) - (lhs.size < rhs.size);
+}
+
+static int32_t
+str8_equals_insensitive(Str8 lhs, Str8 rhs)
+{
+  if (lhs.size != rhs.size) { return 0; }
+
+  return str8_kernels()->equals_insensitive(lhs.ptr, rhs.ptr, lhs.size);
 }
 
 // Return 1 if the Str8 match up to `n` chars, zero otherwise
@@ -131,42 +365,25 @@ str8_match_insensitive(Str8 lhs, Str8 rhs, uint64_t n)
 {
   if (lhs.size < n || rhs.size < n) { return 0; }
 
-  for (uint64_t i = 0; i < n; ++i)
-  {
-    if (to_lower(lhs.ptr[i]) != to_lower(rhs.ptr[i])) { return 0; }
-  }
-
-  return 1;
+  return str8_kernels()->equals_insensitive(lhs.ptr, rhs.ptr, n);
 }
 
 static uint64_t
 str8_index(Str8 str, uint8_t ch)
 {
-  for (uint64_t i = 0; i < str.size; ++i)
-  {
-    if (str.ptr[i] == ch)
-      return i;
-  }
-
-  return str.size;
+  return str8_kernels()->index(str, ch);
 }
 
 static uint64_t
 str8_index_last(Str8 str, uint8_t ch)
 {
-  for (uint64_t i = str.size - 1; i > 0; --i)
-  {
-    if (str.ptr[i - 1] == ch)
-      return i - 1;
-  }
-
-  return str.size;
+  return str8_kernels()->index_last(str, ch);
 }
 
 static uint64_t
 str8_index_last_slash(Str8 str)
 {
-  for (uint64_t i = str.size - 1; i > 0; --i)
+  for (uint64_t i = str.size; i > 0; --i)
   {
     if (is_slash(str.ptr[i - 1]))
       return i - 1;
@@ -180,17 +397,7 @@ str8_index_substr(Str8 str, Str8 sub)
 {
   if (sub.size > str.size || sub.size == 0) { return str.size; }
 
-  Str8 slice = {0};
-  for (uint64_t i = 0, last_idx = (str.size - sub.size); i <= last_idx; ++i)
-  {
-    slice = (Str8){ str.ptr + i, sub.size };
-    if (str8_equals(slice, sub))
-    {
-      return i;
-    }
-  }
-
-  return str.size;
+  return str8_kernels()->index_substr(str, sub);
 }
 
 static uint64_t
@@ -240,10 +447,20 @@ str8_postfix(Str8 str, uint64_t size)
 static Str8
 str8_buffer_file(Arena *arena, Str8 path)
 {
-  Str8 result = {0};
-
   FILE *file = fopen((char*)path.ptr, "rb");
-  if (!file) { return result; }
+  if (!file) { return (Str8){0}; }
+
+  Str8 result = str8_buffer_stream(arena, file);
+  fclose(file);
+
+  return result;
+}
+
+// Buffer the whole of an already open `file` (from its start), which stays open
+static Str8
+str8_buffer_stream(Arena *arena, FILE *file)
+{
+  Str8 result = {0};
 
   fseek(file, 0, SEEK_END);
   int64_t file_size = ftell(file);
@@ -253,12 +470,9 @@ str8_buffer_file(Arena *arena, Str8 path)
   {
     // Alocate file_size bytes on arena and buffer the stream
     result.ptr = (uint8_t*)arena_push(arena, (uint64_t)file_size);
-    result.size = (uint64_t)file_size;
-    fread(result.ptr, 1, result.size, file);
+    if (result.ptr) { result.size = fread(result.ptr, 1, (uint64_t)file_size, file); }
   }
 
-  fclose(file);
-
   return result;
 }
 
@@ -271,3 +485,35 @@ str8_normalize_slash(Str8 str)
       str.ptr[i] = OS_SLASH;
   }
 }
+
+// Return 1 if `str` is a non-empty run of decimal digits that fits in `out`, zero otherwise
+static int32_t
+str8_parse_u64(Str8 str, uint64_t *out)
+{
+  if (str.size == 0) { return 0; }
+
+  uint64_t value = 0;
+  for (uint64_t i = 0; i < str.size; ++i)
+  {
+    uint8_t digit = str.ptr[i] - '0';
+    if (digit > 9) { return 0; }
+    if (value > (UINT64_MAX - digit) / 10) { return 0; } // Overflow
+    value = value*10 + digit;
+  }
+
+  *out = value;
+  return 1;
+}
+
+// FNV-1a, never returns 0 so callers can use it to mark free hash table slots
+static uint64_t
+str8_hash(Str8 str)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (uint64_t i = 0; i < str.size; ++i)
+  {
+    hash ^= str.ptr[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash ? hash : 1;
+}
@@ -0,0 +1,374 @@
+#ifndef BROCOPY_BASE_H
+#include "base.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Str8 kernels (SIMD with runtime dispatch)
+//==================================================
+/*
+   Scalar kernels are always compiled. On x86 the SSE2 (16 bytes) and AVX2 (32 bytes) variants
+   are compiled too, each function tagged with its target so the rest of the program keeps the
+   baseline ISA, and str8_kernels() picks the widest one the CPU supports on first use.
+   Every vector loop only loads full chunks inside the string and leaves the tail to scalar code.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define STR8_SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+static inline uint32_t
+bit_scan_forward32(uint32_t mask) // `mask` != 0
+{
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return (uint32_t)idx;
+#else
+  return (uint32_t)__builtin_ctz(mask);
+#endif
+}
+
+static inline uint32_t
+bit_scan_reverse32(uint32_t mask) // `mask` != 0
+{
+#ifdef _MSC_VER
+  unsigned long idx;
+  _BitScanReverse(&idx, mask);
+  return (uint32_t)idx;
+#else
+  return 31u - (uint32_t)__builtin_clz(mask);
+#endif
+}
+
+
+//==================================================
+// Scalar
+//==================================================
+
+static uint64_t
+str8_index_scalar(Str8 str, uint8_t ch)
+{
+  uint8_t *found = (uint8_t*)memchr(str.ptr, ch, str.size);
+  return found ? (uint64_t)(found - str.ptr) : str.size;
+}
+
+static uint64_t
+str8_index_last_scalar(Str8 str, uint8_t ch)
+{
+  for (uint64_t i = str.size; i > 0; --i)
+  {
+    if (str.ptr[i - 1] == ch)
+      return i - 1;
+  }
+
+  return str.size;
+}
+
+static int32_t
+str8_equals_insensitive_scalar(uint8_t *lhs, uint8_t *rhs, uint64_t size)
+{
+  for (uint64_t i = 0; i < size; ++i)
+  {
+    if (to_lower(lhs[i]) != to_lower(rhs[i])) { return 0; }
+  }
+
+  return 1;
+}
+
+// First byte candidates through memchr, then a full compare
+static uint64_t
+str8_index_substr_scalar(Str8 str, Str8 sub)
+{
+  if (sub.size > str.size || sub.size == 0) { return str.size; } // Also guards the SIMD tails
+
+  uint64_t last_idx = str.size - sub.size;
+  for (uint64_t i = 0; i <= last_idx; ++i)
+  {
+    uint8_t *found = (uint8_t*)memchr(str.ptr + i, sub.ptr[0], last_idx - i + 1);
+    if (!found) { break; }
+
+    i = (uint64_t)(found - str.ptr);
+    if (memcmp(found, sub.ptr, sub.size) == 0) { return i; }
+  }
+
+  return str.size;
+}
+
+
+#ifdef STR8_SIMD_X86
+//==================================================
+// SSE2 (16 bytes)
+//==================================================
+
+TARGET_SSE2 static uint64_t
+str8_index_sse2(Str8 str, uint8_t ch)
+{
+  __m128i needle = _mm_set1_epi8((char)ch);
+  uint64_t i = 0;
+  for (; i + 16 <= str.size; i += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((__m128i*)(str.ptr + i));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) { return i + bit_scan_forward32(mask); }
+  }
+
+  for (; i < str.size; ++i)
+  {
+    if (str.ptr[i] == ch) { return i; }
+  }
+  return str.size;
+}
+
+TARGET_SSE2 static uint64_t
+str8_index_last_sse2(Str8 str, uint8_t ch)
+{
+  __m128i needle = _mm_set1_epi8((char)ch);
+  uint64_t end = str.size;
+  for (; end >= 16; end -= 16)
+  {
+    __m128i chunk = _mm_loadu_si128((__m128i*)(str.ptr + end - 16));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) { return end - 16 + bit_scan_reverse32(mask); }
+  }
+
+  for (; end > 0; --end)
+  {
+    if (str.ptr[end - 1] == ch) { return end - 1; }
+  }
+  return str.size;
+}
+
+// 'A'..'Z' -> bit 5 set, via a signed compare after biasing 'A' to -128
+TARGET_SSE2 static inline __m128i
+to_lower_sse2(__m128i chunk)
+{
+  __m128i biased = _mm_add_epi8(chunk, _mm_set1_epi8((char)(0x80 - 'A')));
+  __m128i is_cap = _mm_cmplt_epi8(biased, _mm_set1_epi8((char)(0x80 + 26)));
+  return _mm_or_si128(chunk, _mm_and_si128(is_cap, _mm_set1_epi8(0x20)));
+}
+
+TARGET_SSE2 static int32_t
+str8_equals_insensitive_sse2(uint8_t *lhs, uint8_t *rhs, uint64_t size)
+{
+  uint64_t i = 0;
+  for (; i + 16 <= size; i += 16)
+  {
+    __m128i l = to_lower_sse2(_mm_loadu_si128((__m128i*)(lhs + i)));
+    __m128i r = to_lower_sse2(_mm_loadu_si128((__m128i*)(rhs + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xffff) { return 0; }
+  }
+
+  return str8_equals_insensitive_scalar(lhs + i, rhs + i, size - i);
+}
+
+// Candidates must match both the first and the last byte of `sub` -> one memcmp per candidate
+TARGET_SSE2 static uint64_t
+str8_index_substr_sse2(Str8 str, Str8 sub)
+{
+  __m128i first = _mm_set1_epi8((char)sub.ptr[0]);
+  __m128i last = _mm_set1_epi8((char)sub.ptr[sub.size - 1]);
+  uint64_t i = 0;
+  for (; i + sub.size - 1 + 16 <= str.size; i += 16)
+  {
+    __m128i block_first = _mm_loadu_si128((__m128i*)(str.ptr + i));
+    __m128i block_last = _mm_loadu_si128((__m128i*)(str.ptr + i + sub.size - 1));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                               _mm_cmpeq_epi8(block_last, last)));
+    while (mask)
+    {
+      uint64_t idx = i + bit_scan_forward32(mask);
+      if (memcmp(str.ptr + idx, sub.ptr, sub.size) == 0) { return idx; }
+      mask &= mask - 1;
+    }
+  }
+
+  uint64_t rest = str8_index_substr_scalar(str8_skip(str, i), sub);
+  return (rest == str.size - i) ? str.size : i + rest;
+}
+
+
+//==================================================
+// AVX2 (32 bytes)
+//==================================================
+
+TARGET_AVX2 static uint64_t
+str8_index_avx2(Str8 str, uint8_t ch)
+{
+  __m256i needle = _mm256_set1_epi8((char)ch);
+  uint64_t i = 0;
+  for (; i + 32 <= str.size; i += 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((__m256i*)(str.ptr + i));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask) { return i + bit_scan_forward32(mask); }
+  }
+
+  if (i + 16 <= str.size)
+  { // Keys and path segments are mostly shorter than 32 -> one 16 byte step before the scalar tail
+    __m128i chunk = _mm_loadu_si128((__m128i*)(str.ptr + i));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(needle)));
+    if (mask) { return i + bit_scan_forward32(mask); }
+    i += 16;
+  }
+
+  for (; i < str.size; ++i)
+  {
+    if (str.ptr[i] == ch) { return i; }
+  }
+  return str.size;
+}
+
+TARGET_AVX2 static uint64_t
+str8_index_last_avx2(Str8 str, uint8_t ch)
+{
+  __m256i needle = _mm256_set1_epi8((char)ch);
+  uint64_t end = str.size;
+  for (; end >= 32; end -= 32)
+  {
+    __m256i chunk = _mm256_loadu_si256((__m256i*)(str.ptr + end - 32));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask) { return end - 32 + bit_scan_reverse32(mask); }
+  }
+
+  if (end >= 16)
+  {
+    __m128i chunk = _mm_loadu_si128((__m128i*)(str.ptr + end - 16));
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(needle)));
+    if (mask) { return end - 16 + bit_scan_reverse32(mask); }
+    end -= 16;
+  }
+
+  for (; end > 0; --end)
+  {
+    if (str.ptr[end - 1] == ch) { return end - 1; }
+  }
+  return str.size;
+}
+
+TARGET_AVX2 static inline __m256i
+to_lower_avx2(__m256i chunk)
+{
+  __m256i biased = _mm256_add_epi8(chunk, _mm256_set1_epi8((char)(0x80 - 'A')));
+  __m256i is_cap = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)), biased);
+  return _mm256_or_si256(chunk, _mm256_and_si256(is_cap, _mm256_set1_epi8(0x20)));
+}
+
+TARGET_AVX2 static int32_t
+str8_equals_insensitive_avx2(uint8_t *lhs, uint8_t *rhs, uint64_t size)
+{
+  uint64_t i = 0;
+  for (; i + 32 <= size; i += 32)
+  {
+    __m256i l = to_lower_avx2(_mm256_loadu_si256((__m256i*)(lhs + i)));
+    __m256i r = to_lower_avx2(_mm256_loadu_si256((__m256i*)(rhs + i)));
+    if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(l, r)) != 0xffffffffu) { return 0; }
+  }
+
+  if (i + 16 <= size)
+  {
+    __m128i l = to_lower_sse2(_mm_loadu_si128((__m128i*)(lhs + i)));
+    __m128i r = to_lower_sse2(_mm_loadu_si128((__m128i*)(rhs + i)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(l, r)) != 0xffff) { return 0; }
+    i += 16;
+  }
+
+  return str8_equals_insensitive_scalar(lhs + i, rhs + i, size - i);
+}
+
+TARGET_AVX2 static uint64_t
+str8_index_substr_avx2(Str8 str, Str8 sub)
+{
+  __m256i first = _mm256_set1_epi8((char)sub.ptr[0]);
+  __m256i last = _mm256_set1_epi8((char)sub.ptr[sub.size - 1]);
+  uint64_t i = 0;
+  for (; i + sub.size - 1 + 32 <= str.size; i += 32)
+  {
+    __m256i block_first = _mm256_loadu_si256((__m256i*)(str.ptr + i));
+    __m256i block_last = _mm256_loadu_si256((__m256i*)(str.ptr + i + sub.size - 1));
+    uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                                     _mm256_cmpeq_epi8(block_last, last)));
+    while (mask)
+    {
+      uint64_t idx = i + bit_scan_forward32(mask);
+      if (memcmp(str.ptr + idx, sub.ptr, sub.size) == 0) { return idx; }
+      mask &= mask - 1;
+    }
+  }
+
+  uint64_t rest = str8_index_substr_scalar(str8_skip(str, i), sub);
+  return (rest == str.size - i) ? str.size : i + rest;
+}
+#endif // STR8_SIMD_X86
+
+
+//==================================================
+// Dispatch
+//==================================================
+
+static Str8Kernels str8_kernel_table[] =
+{
+  { "scalar", STR8_ISA_SCALAR, str8_index_scalar, str8_index_last_scalar, str8_equals_insensitive_scalar, str8_index_substr_scalar },
+#ifdef STR8_SIMD_X86
+  { "sse2", STR8_ISA_SSE2, str8_index_sse2, str8_index_last_sse2, str8_equals_insensitive_sse2, str8_index_substr_sse2 },
+  { "avx2", STR8_ISA_AVX2, str8_index_avx2, str8_index_last_avx2, str8_equals_insensitive_avx2, str8_index_substr_avx2 },
+#endif
+};
+
+static Str8Kernels *str8_kernels_selected;
+
+static int32_t
+str8_kernels_supported(Str8Kernels *kernels)
+{
+  if (kernels->isa == STR8_ISA_SCALAR) { return 1; }
+
+#ifdef STR8_SIMD_X86
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 1);
+  if (kernels->isa == STR8_ISA_SSE2) { return (info[3] >> 26) & 1; }
+  if (kernels->isa == STR8_ISA_AVX2)
+  { // AVX2 needs the OS to save the ymm registers too (OSXSAVE + XCR0)
+    if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6) { return 0; }
+    __cpuidex(info, 7, 0);
+    return (info[1] >> 5) & 1;
+  }
+#else
+  __builtin_cpu_init();
+  if (kernels->isa == STR8_ISA_SSE2) { return __builtin_cpu_supports("sse2"); }
+  if (kernels->isa == STR8_ISA_AVX2) { return __builtin_cpu_supports("avx2"); }
+#endif
+#endif
+
+  return 0;
+}
+
+// Widest supported variant -> the table is ordered from narrowest to widest
+static Str8Kernels *
+str8_kernels(void)
+{
+  Str8Kernels *selected = str8_kernels_selected;
+  if (!selected)
+  { // Benign race: every thread resolves to the same entry
+    uint64_t count = sizeof(str8_kernel_table) / sizeof(str8_kernel_table[0]);
+    selected = &str8_kernel_table[0];
+    for (uint64_t i = 1; i < count; ++i)
+    {
+      if (str8_kernels_supported(&str8_kernel_table[i])) { selected = &str8_kernel_table[i]; }
+    }
+    str8_kernels_selected = selected;
+  }
+
+  return selected;
+}
@@ -0,0 +1,132 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Trace zones (Chrome trace export, -DBROCOPY_NO_TRACE removes them)
+//==================================================
+/*
+   Events are "complete" (ph = X) events: one slot per finished zone, reserved with an atomic add
+   so the log flusher thread can record its own zones. Output:
+     {"traceEvents":[{"name":"copy_file","cat":"brocopy","ph":"X","ts":1200,"dur":350,"pid":42,"tid":1,
+                      "args":{"detail":"/foo/bar/baz/new/bro.out"}}, ...],"displayTimeUnit":"ms"}
+   Timestamps are microseconds since the first zone of the job.
+*/
+
+#ifndef BROCOPY_NO_TRACE
+
+static Tracer tracer;
+static THREAD_LOCAL uint32_t tl_trace_tid;
+
+// Start storing zones -> zones already open (e.g. around argument parsing) are kept too
+static int32_t
+trace_enable(void)
+{
+  if (!tracer.events)
+  {
+    tracer.events = (TraceEvent*)malloc(TRACE_MAX_EVENTS*sizeof(TraceEvent));
+#ifdef _WIN32
+    tracer.pid = (int32_t)GetCurrentProcessId();
+#else
+    tracer.pid = (int32_t)getpid();
+#endif
+  }
+  return tracer.events != NULL;
+}
+
+static TraceZone
+trace_zone_begin(char *name)
+{
+  return (TraceZone){ name, os_now_us() };
+}
+
+// Store a zone timed elsewhere -> `pid` != 0 files it under another process (e.g. a CopyWorker)
+static void
+trace_record(char *name, int32_t pid, uint64_t start_us, uint64_t dur_us, Str8 detail)
+{
+  if (!tracer.events) { return; }
+
+  uint64_t idx = __atomic_fetch_add(&tracer.count, 1, __ATOMIC_RELAXED);
+  if (idx >= TRACE_MAX_EVENTS) { return; }
+
+  if (tl_trace_tid == 0) { tl_trace_tid = __atomic_add_fetch(&tracer.next_tid, 1, __ATOMIC_RELAXED); }
+  tracer.events[idx] = (TraceEvent){ name, detail, start_us, dur_us, pid, pid ? 1 : tl_trace_tid };
+}
+
+static void
+trace_zone_end(TraceZone *zone, Str8 detail)
+{
+  if (!tracer.events) { return; }
+  trace_record(zone->name, 0, zone->start_us, os_now_us() - zone->start_us, detail);
+}
+
+// Dump the zones recorded so far as Chrome trace JSON. Return 0 on failure.
+static int32_t
+trace_write(Str8 path)
+{
+  if (!tracer.events) { return 0; }
+
+  Scratch tmp = scratch_get(NULL, 0);
+  uint64_t count = __atomic_load_n(&tracer.count, __ATOMIC_ACQUIRE);
+  if (count > TRACE_MAX_EVENTS) { count = TRACE_MAX_EVENTS; }
+
+  uint64_t origin_us = UINT64_MAX;
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    if (tracer.events[i].start_us < origin_us) { origin_us = tracer.events[i].start_us; }
+  }
+
+  Str8Builder builder = str8_builder_begin(tmp.arena);
+  str8_builder_push(&builder, str8_from_lit("{\"traceEvents\":["));
+  for (uint64_t i = 0; i < count; ++i)
+  {
+    TraceEvent *event = &tracer.events[i];
+    str8_builder_push(&builder, (i == 0) ? str8_from_lit("\n{\"name\":\"") : str8_from_lit(",\n{\"name\":\""));
+    str8_builder_push(&builder, str8_from_cstr(event->name));
+    str8_builder_push(&builder, str8_from_lit("\",\"cat\":\"brocopy\",\"ph\":\"X\",\"ts\":"));
+    str8_builder_push_u64(&builder, event->start_us - origin_us);
+    str8_builder_push(&builder, str8_from_lit(",\"dur\":"));
+    str8_builder_push_u64(&builder, event->dur_us);
+    str8_builder_push(&builder, str8_from_lit(",\"pid\":"));
+    str8_builder_push_u64(&builder, (uint64_t)(event->pid ? event->pid : tracer.pid));
+    str8_builder_push(&builder, str8_from_lit(",\"tid\":"));
+    str8_builder_push_u64(&builder, event->tid);
+
+    if (event->detail.size > 0)
+    {
+      str8_builder_push(&builder, str8_from_lit(",\"args\":{\"detail\":\""));
+      for (uint64_t c = 0; c < event->detail.size; ++c)
+      {
+        uint8_t ch = event->detail.ptr[c];
+        if (ch == 0) { break; } // Null terminated paths carry it in their size
+        if (ch == '"' || ch == '\\') { str8_builder_push_char(&builder, '\\'); }
+        str8_builder_push_char(&builder, (ch < 0x20) ? '?' : ch);
+      }
+      str8_builder_push(&builder, str8_from_lit("\"}"));
+    }
+    str8_builder_push_char(&builder, '}');
+  }
+  str8_builder_push(&builder, str8_from_lit("\n],\"displayTimeUnit\":\"ms\"}\n"));
+  Str8 json = str8_builder_end(&builder, 0);
+
+  int32_t result = 0;
+  FILE *stream = json.ptr ? fopen((char*)path.ptr, "wb") : NULL;
+  if (stream)
+  {
+    result = (fwrite(json.ptr, 1, json.size, stream) == json.size);
+    result = (fclose(stream) == 0) && result;
+  }
+
+  scratch_end(tmp);
+  return result;
+}
+
+#else // Compiled out -> --trace is accepted but produces nothing
+
+static int32_t trace_enable(void) { return 0; }
+static TraceZone trace_zone_begin(char *name) { return (TraceZone){ name, 0 }; }
+static void trace_zone_end(TraceZone *zone, Str8 detail) { (void)zone; (void)detail; }
+static void trace_record(char *name, int32_t pid, uint64_t start_us, uint64_t dur_us, Str8 detail) { (void)name; (void)pid; (void)start_us; (void)dur_us; (void)detail; }
+static int32_t trace_write(Str8 path) { (void)path; return 0; }
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef BROCOPY_H
+#include "brocopy.h" // only to make it possible to use -fsyntax-only
+#endif
+
+//==================================================
+// Tuner (Copy parameters learned per destination device)
+//==================================================
+/*
+   Buffer size and chunk threads are picked per device from the best rate seen so far (the buffer
+   seeded from st_blksize until anything was measured). Every TUNE_EXPLORE_EVERY-th measured copy
+   moves one step away from the best instead, cycling bigger/smaller buffer, more/fewer threads,
+   so a setting that got faster (or a slow first guess) is noticed without ever straying far.
+   The copy backend calibrated for each filesystem type (--backend auto) is kept here as well.
+*/
+
+#ifndef _WIN32
+
+static uint64_t
+tune_hash(uint64_t dev)
+{
+  uint64_t hash = (dev + 1)*0x9e3779b97f4a7c15ull;
+  return hash ? hash : 1; // 0 is reserved for free slots
+}
+
+// Linear probe for `hash`, claiming a free slot -> NULL if the table is full
+static TuneSlot *
+tune_slot(TuneFile *file, uint64_t hash)
+{
+  for (uint64_t i = 0; i < TUNE_SLOTS; ++i)
+  {
+    TuneSlot *slot = &file->slots[(hash + i) % TUNE_SLOTS];
+    uint64_t expected = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+    if (expected == hash) { return slot; }
+    if (expected == 0 &&
+        (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == hash))
+    {
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+static Tuner
+tune_open(Str8 path)
+{
+  Tuner tuner = {0};
+
+  int fd = open((char*)path.ptr, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0) { return tuner; }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || ((uint64_t)st.st_size < sizeof(TuneFile) && ftruncate(fd, sizeof(TuneFile)) != 0))
+  {
+    close(fd);
+    return tuner;
+  }
+
+  void *map = mmap(NULL, sizeof(TuneFile), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd); // The mapping keeps the file referenced
+  if (map == MAP_FAILED) { return tuner; }
+
+  TuneFile *file = (TuneFile*)map;
+  uint64_t expected = 0;
+  if (__atomic_compare_exchange_n(&file->magic, &expected, TUNE_MAGIC, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  { // Fresh (zero filled) file
+    __atomic_store_n(&file->slot_count, TUNE_SLOTS, __ATOMIC_RELEASE);
+  }
+  else if (expected != TUNE_MAGIC || __atomic_load_n(&file->slot_count, __ATOMIC_ACQUIRE) != TUNE_SLOTS)
+  { // Not a tune file (or a different layout), leave it alone
+    munmap(map, sizeof(TuneFile));
+    return tuner;
+  }
+
+  tuner.file = file;
+  return tuner;
+}
+
+static void
+tune_close(Tuner *tuner)
+{
+  if (tuner->file)
+  {
+    munmap(tuner->file, sizeof(TuneFile));
+    tuner->file = NULL;
+  }
+}
+
+// Step of the biggest rate in `rates[0, count)`, `fallback` if none was measured yet
+static uint32_t
+tune_best(uint32_t *rates, uint32_t count, uint32_t fallback)
+{
+  uint32_t best = fallback;
+  uint32_t best_rate = 0;
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    uint32_t rate = __atomic_load_n(&rates[i], __ATOMIC_RELAXED);
+    if (rate > best_rate)
+    {
+      best_rate = rate;
+      best = i;
+    }
+  }
+  return best;
+}
+
+// Parameters for copying `size` bytes to a file on `dev`. Without a tuner (or a free slot):
+// the copy loop's buffer and `max_threads`, and nothing gets recorded.
+static void
+tune_pick(Tuner *tuner, uint64_t dev, uint64_t blksize, uint64_t size, int32_t chunkable,
+          uint32_t max_threads, TuneChoice *choice)
+{
+  *choice = (TuneChoice){0};
+  choice->threads = max_threads;
+  choice->chunkable = chunkable;
+  TuneSlot *slot = tuner && tuner->file ? tune_slot(tuner->file, tune_hash(dev)) : NULL;
+  if (!slot) { return; }
+
+  uint32_t max_thread_step = 0; // Thread counts are powers of two up to `max_threads`
+  while (max_thread_step + 1 < TUNE_THREAD_STEPS && (1u << (max_thread_step + 1)) <= max_threads) { ++max_thread_step; }
+  uint32_t seed_step = 0;
+  while (seed_step + 1 < TUNE_BUF_STEPS && (1ull << (TUNE_BUF_MIN_SHIFT + seed_step + 1)) <= blksize) { ++seed_step; }
+
+  uint32_t buf_step = tune_best(slot->buf_rates, TUNE_BUF_STEPS, seed_step);
+  uint32_t thread_step = tune_best(slot->thread_rates, max_thread_step + 1, max_thread_step);
+
+  if (size >= TUNE_SAMPLE_MIN_BYTES)
+  { // Measured -> may explore
+    uint64_t sample = __atomic_fetch_add(&slot->samples, 1, __ATOMIC_RELAXED);
+    if (sample % TUNE_EXPLORE_EVERY == TUNE_EXPLORE_EVERY - 1)
+    {
+      uint64_t direction = (sample / TUNE_EXPLORE_EVERY) % (chunkable ? 4 : 2);
+      if (direction == 0 && buf_step + 1 < TUNE_BUF_STEPS) { ++buf_step; }
+      else if (direction == 1 && buf_step > 0) { --buf_step; }
+      else if (direction == 2 && thread_step < max_thread_step) { ++thread_step; }
+      else if (direction == 3 && thread_step > 0) { --thread_step; }
+    }
+    choice->slot = slot;
+  }
+
+  choice->buf_step = buf_step;
+  choice->thread_step = thread_step;
+  choice->buf_size = 1ull << (TUNE_BUF_MIN_SHIFT + buf_step);
+  if (chunkable) { choice->threads = 1u << thread_step; }
+}
+
+static void
+tune_ewma(uint32_t *rate, uint64_t sample)
+{
+  uint32_t old = __atomic_load_n(rate, __ATOMIC_RELAXED);
+  uint64_t value = old ? old - old/4 + sample/4 : sample; // New samples weigh 1/4
+  __atomic_store_n(rate, (uint32_t)(value ? value : 1), __ATOMIC_RELAXED);
+}
+
+// Feed the throughput of a copy made with `choice` back into its device's slot
+static void
+tune_record(TuneChoice *choice, uint64_t bytes, uint64_t xfer_us)
+{
+  if (!choice->slot || bytes < TUNE_SAMPLE_MIN_BYTES || xfer_us == 0) { return; }
+
+  uint64_t kb_per_s = (bytes / 1024)*1000000 / xfer_us;
+  if (kb_per_s > UINT32_MAX) { kb_per_s = UINT32_MAX; }
+  tune_ewma(&choice->slot->buf_rates[choice->buf_step], kb_per_s);
+  if (choice->chunkable) { tune_ewma(&choice->slot->thread_rates[choice->thread_step], kb_per_s); }
+}
+
+// Calibrations of a process without a tuning file -> each process calibrates once
+static TuneFs tune_fs_local[TUNE_FS_SLOTS];
+
+static TuneFs *
+tune_fs_slot(Tuner *tuner, uint64_t fs_type)
+{
+  TuneFs *table = (tuner && tuner->file) ? tuner->file->fs : tune_fs_local;
+  uint64_t hash = tune_hash(fs_type);
+  for (uint64_t i = 0; i < TUNE_FS_SLOTS; ++i)
+  {
+    TuneFs *slot = &table[(hash + i) % TUNE_FS_SLOTS];
+    uint64_t expected = __atomic_load_n(&slot->hash, __ATOMIC_ACQUIRE);
+    if (expected == hash) { return slot; }
+    if (expected == 0 &&
+        (__atomic_compare_exchange_n(&slot->hash, &expected, hash, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == hash))
+    {
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+// CopyBackendId + 1 calibrated for `fs_type`, 0 = not yet
+static uint32_t
+tune_fs_backend(Tuner *tuner, uint64_t fs_type)
+{
+  TuneFs *slot = tune_fs_slot(tuner, fs_type);
+  return slot ? (uint32_t)__atomic_load_n(&slot->backend, __ATOMIC_ACQUIRE) : 0;
+}
+
+static void
+tune_fs_calibrated(Tuner *tuner, uint64_t fs_type, uint32_t backend)
+{
+  TuneFs *slot = tune_fs_slot(tuner, fs_type);
+  if (slot) { __atomic_store_n(&slot->backend, (uint64_t)backend + 1, __ATOMIC_RELEASE); }
+}
+
+#else // CopyFile picks its own buffers on Windows -> nothing to tune
+
+static Tuner tune_open(Str8 path) { (void)path; return (Tuner){0}; }
+static void tune_close(Tuner *tuner) { tuner->file = NULL; }
+
+static void
+tune_pick(Tuner *tuner, uint64_t dev, uint64_t blksize, uint64_t size, int32_t chunkable,
+          uint32_t max_threads, TuneChoice *choice)
+{
+  (void)tuner; (void)dev; (void)blksize; (void)size;
+  *choice = (TuneChoice){0};
+  choice->threads = max_threads;
+  choice->chunkable = chunkable;
+}
+
+static void tune_record(TuneChoice *choice, uint64_t bytes, uint64_t xfer_us) { (void)choice; (void)bytes; (void)xfer_us; }
+static uint32_t tune_fs_backend(Tuner *tuner, uint64_t fs_type) { (void)tuner; (void)fs_type; return 0; }
+static void tune_fs_calibrated(Tuner *tuner, uint64_t fs_type, uint32_t backend) { (void)tuner; (void)fs_type; (void)backend; }
+
+#endif